@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "datagram.h"
+#include "rates.h"
+#include "shm_ring.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define DEFAULT_RATES "rates.tsv"
+#define DEFAULT_CONVERSIONS 10000000
+#define CURRENCY_SERVER_ADDR "127.0.0.1"
+#define CURRENCY_SERVER_PORT 9045
+//Batches sent to the currency server before waiting for results
+#define BATCH_WINDOW 32
+//Single conversions timed one after the other to measure the round trip
+#define LATENCY_SAMPLES 100000
+
+/*
+ * Measures how many currency conversions per second can be done, either in this process with the same code
+ * as the currency server or through a running currency server with DG_CONVERT_BATCH requests
+ * The currency server is reached over UDP, or through the shared memory ring it serves with -x
+ */
+
+/**
+ * The way to a running currency server
+ */
+struct transport {
+    int fd;
+    //Only used if name is set
+    const char *name;
+    struct ring_link ring;
+};
+
+/**
+ * Returns the seconds elapsed since start
+ */
+double secondsSince(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Fills in n random conversions between the currencies of a table
+ */
+void randomConversions(const struct rate_table *table, int64_t *amounts, uint32_t *sources, uint32_t *dests, int n) {
+    uint32_t codes[RATE_SLOTS];
+    int count = 0;
+
+    for (int slot = 0; slot < RATE_SLOTS; slot++) {
+        if (table->index[slot] >= 0) {
+            codes[count++] = ((uint32_t) ('A' + slot / (26 * 26)) << 16) | ((uint32_t) ('A' + slot / 26 % 26) << 8) | ('A' + slot % 26);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        //Up to 10 million units, in hundredths
+        amounts[i] = rand() % 1000000000;
+        sources[i] = codes[rand() % count];
+        dests[i] = codes[rand() % count];
+    }
+}
+
+/**
+ * Converts every amount through convertAmounts(), in batches of the given size
+ * Returns the conversions per second
+ */
+double benchmarkLocal(const struct rate_table *table, int64_t *amounts, uint32_t *sources, uint32_t *dests,
+        int64_t *results, int n, int batch) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < n; i += batch) {
+        convertAmounts(table, amounts + i, sources + i, dests + i, results + i, n - i < batch ? n - i : batch);
+    }
+    return n / secondsSince(&start);
+}
+
+/**
+ * Connects to the currency server, over UDP or through its ring if ring is not NULL
+ * Returns -1 if the server could not be reached
+ */
+int openTransport(struct transport *transport, const char *ring) {
+    transport->name = ring;
+
+    if (ring != NULL) {
+        if ((transport->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || attachRing(ring, transport->fd, &transport->ring) < 0) {
+            fprintf(stderr, "[ERROR]: No currency server is serving the ring %s!\n", ring);
+            return -1;
+        }
+        return 0;
+    }
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(CURRENCY_SERVER_PORT);
+    server.sin_addr.s_addr = inet_addr(CURRENCY_SERVER_ADDR);
+
+    struct timeval timeout = {1, 0};
+
+    if ((transport->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+            connect(transport->fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(transport->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return 0;
+}
+
+void closeTransport(struct transport *transport) {
+    if (transport->name != NULL) detachRing(&transport->ring);
+    close(transport->fd);
+}
+
+/**
+ * Sends a request to the currency server, waiting up to a second for room in the ring if it is full
+ * Returns -1 if it could not be sent
+ */
+int sendRequest(struct transport *transport, const char *datagram, int length) {
+    struct timespec start;
+
+    if (transport->name == NULL) return send(transport->fd, datagram, length, 0) < 0 ? -1 : 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (sendRing(&transport->ring, datagram, length) < 0) {
+        //The currency server frees slots as it takes requests, unless it has stopped serving the ring
+        if (errno != EAGAIN || !isRingAttached(&transport->ring) || secondsSince(&start) > 1) return -1;
+        usleep(100);
+    }
+    return 0;
+}
+
+/**
+ * Waits up to a second for a response from the currency server
+ * Returns -1 if none arrived
+ */
+int receiveResponse(struct transport *transport, char *datagram) {
+    int bytes;
+
+    if (transport->name == NULL) return recv(transport->fd, datagram, MAX_DATAGRAM_SIZE, 0);
+
+    while ((bytes = receiveRing(&transport->ring, datagram)) < 0) {
+        if (waitRing(&transport->ring, 1000) < 0) return -1;
+    }
+    return bytes;
+}
+
+/**
+ * Sends every conversion to the currency server in full DG_CONVERT_BATCH requests
+ * Returns the conversions per second, or -1 if the server stopped responding
+ */
+double benchmarkServer(struct transport *transport, int64_t *amounts, uint32_t *sources, uint32_t *dests, int n) {
+    char datagram[MAX_DATAGRAM_SIZE];
+    struct datagram_header header = {DATAGRAM_VERSION, DG_CONVERT_BATCH, DG_OK, 0, 0};
+    struct convert_batch_entry entry;
+    long sent = 0, received = 0, batches = (n + MAX_CONVERT_BATCH - 1) / MAX_CONVERT_BATCH;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (received < batches) {
+        //Keep a window of batches in flight
+        for (; sent < batches && sent - received < BATCH_WINDOW; sent++) {
+            int first = sent * MAX_CONVERT_BATCH;
+            int count = n - first < MAX_CONVERT_BATCH ? n - first : MAX_CONVERT_BATCH;
+
+            for (int i = 0; i < count; i++) {
+                entry.amount = amounts[first + i];
+                entry.source = sources[first + i];
+                entry.dest = dests[first + i];
+                writeBatchEntry(datagram + DATAGRAM_HEADER_SIZE + i * CONVERT_BATCH_ENTRY_SIZE, &entry);
+            }
+            header.request_id = sent;
+            header.length = count * CONVERT_BATCH_ENTRY_SIZE;
+            writeDatagramHeader(datagram, &header);
+            if (sendRequest(transport, datagram, DATAGRAM_HEADER_SIZE + header.length) < 0) break;
+        }
+        if (sent == received || receiveResponse(transport, datagram) < 0) {
+            fprintf(stderr, "[ERROR]: The currency server is not responding!\n");
+            return -1;
+        }
+        received++;
+    }
+    return n / secondsSince(&start);
+}
+
+int compareLatencies(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sends single DG_CONVERT requests one after the other, each once the previous one is answered
+ * Prints the median and 99th percentile round trips, returns -1 if the server stopped responding
+ */
+int benchmarkLatency(struct transport *transport, uint32_t *sources, uint32_t *dests, int n) {
+    double *latencies = malloc(LATENCY_SAMPLES * sizeof(double));
+    char datagram[MAX_DATAGRAM_SIZE];
+    struct datagram_header header = {DATAGRAM_VERSION, DG_CONVERT, DG_OK, 0, CONVERT_REQUEST_SIZE};
+    struct convert_request request;
+
+    if (latencies == NULL) return -1;
+
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        struct timespec start;
+
+        request.amount = 100 + i % 100000;
+        request.source = sources[i % n];
+        request.dest = dests[i % n];
+        header.request_id = i;
+        writeDatagramHeader(datagram, &header);
+        writeConvertRequest(datagram + DATAGRAM_HEADER_SIZE, &request);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (sendRequest(transport, datagram, DATAGRAM_HEADER_SIZE + CONVERT_REQUEST_SIZE) < 0 ||
+                receiveResponse(transport, datagram) < 0) {
+            fprintf(stderr, "[ERROR]: The currency server is not responding!\n");
+            free(latencies);
+            return -1;
+        }
+        latencies[i] = secondsSince(&start) * 1e6;
+    }
+    qsort(latencies, LATENCY_SAMPLES, sizeof(double), compareLatencies);
+    printf("Single conversions, round trip:\tp50 %.1f usec, p99 %.1f usec\n",
+        latencies[LATENCY_SAMPLES / 2], latencies[LATENCY_SAMPLES * 99 / 100]);
+    free(latencies);
+
+    return 0;
+}
+
+/**
+ * Prints the correct usage of the program and exits
+ */
+void usageError(const char *program) {
+    fprintf(stderr, "Usage: %s [-r rates] [-c conversions] [-s] [-x ring]\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = DEFAULT_RATES;
+    int n = DEFAULT_CONVERSIONS;
+    int use_server = FALSE;
+    const char *ring = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:c:sx:")) != -1) {
+        if (opt == 'r') {
+            path = optarg;
+        } else if (opt == 'c' && atoi(optarg) > 0) {
+            n = atoi(optarg);
+        } else if (opt == 's') {
+            use_server = TRUE;
+        } else if (opt == 'x') {
+            use_server = TRUE;
+            ring = optarg;
+        } else {
+            usageError(argv[0]);
+        }
+    }
+    struct rate_table *table = loadRates(path);
+    int64_t *amounts = malloc(n * sizeof(int64_t));
+    int64_t *results = malloc(n * sizeof(int64_t));
+    uint32_t *sources = malloc(n * sizeof(uint32_t));
+    uint32_t *dests = malloc(n * sizeof(uint32_t));
+
+    if (table == NULL || !amounts || !results || !sources || !dests) {
+        fprintf(stderr, "[ERROR]: Could not set up the benchmark!\n");
+        exit(1);
+    }
+    randomConversions(table, amounts, sources, dests, n);
+    printf("%d random conversions between %d currencies\n", n, table->count);
+
+    if (use_server) {
+        struct transport transport;
+
+        if (openTransport(&transport, ring) < 0) exit(1);
+        printf("Currency server over %s\n", ring == NULL ? "UDP" : "its ring");
+
+        double rate = benchmarkServer(&transport, amounts, sources, dests, n);
+        if (rate < 0 || benchmarkLatency(&transport, sources, dests, n) < 0) exit(1);
+
+        printf("Currency server, batches of %d:\t%.0f conversions/sec\n", MAX_CONVERT_BATCH, rate);
+        closeTransport(&transport);
+    } else {
+        printf("One at a time:\t\t%.0f conversions/sec\n", benchmarkLocal(table, amounts, sources, dests, results, n, 1));
+        printf("Batches of %d:\t\t%.0f conversions/sec\n", MAX_CONVERT_BATCH,
+            benchmarkLocal(table, amounts, sources, dests, results, n, MAX_CONVERT_BATCH));
+        printf("Batches of %d:\t%.0f conversions/sec\n", n, benchmarkLocal(table, amounts, sources, dests, results, n, n));
+    }
+    freeRates(table);
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "datagram.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define DEFAULT_VOTES 10000000
+#define VOTING_SERVER_ADDR "127.0.0.1"
+#define VOTING_SERVER_PORT 9046
+//Batches sent to the voting server before waiting for summaries
+#define BATCH_WINDOW 32
+//Votes sent one at a time, each waiting for its response like a client would
+#define SINGLE_VOTES 20000
+#define MAX_CANDIDATES 1024
+
+/*
+ * Measures how many votes per second a running voting server accepts, sent one at a time as a client does
+ * and uploaded in bulk with DG_VOTE_BATCH requests
+ */
+
+/**
+ * Returns the seconds elapsed since start
+ */
+double secondsSince(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Sends a request without a payload to the voting server and waits for the response
+ * Returns the length of the response payload, or -1 if the server is not responding
+ */
+int query(int fd, int opcode, char *datagram) {
+    struct datagram_header header = {DATAGRAM_VERSION, opcode, DG_OK, 0, 0};
+
+    writeDatagramHeader(datagram, &header);
+    send(fd, datagram, DATAGRAM_HEADER_SIZE, 0);
+
+    int bytes = recv(fd, datagram, MAX_DATAGRAM_SIZE, 0);
+    if (bytes < 0 || readDatagramHeader(datagram, bytes, &header) < 0 || header.status != DG_OK) return -1;
+
+    return header.length;
+}
+
+/**
+ * Reads the ids of the candidates the voting server lists
+ * Returns the number of ids, or -1 if the server is not responding
+ */
+int readCandidates(int fd, int32_t *ids) {
+    char datagram[MAX_DATAGRAM_SIZE + 1];
+    int length = query(fd, DG_CANDIDATES, datagram), count = 0;
+
+    if (length < 0) return -1;
+    datagram[DATAGRAM_HEADER_SIZE + length] = '\0';
+
+    //Skip the two heading lines, every other line starts with an id
+    char *line = strchr(strchr(datagram + DATAGRAM_HEADER_SIZE, '\n') + 1, '\n');
+    while (line != NULL && line[1] != '\0' && count < MAX_CANDIDATES) {
+        ids[count++] = atoi(line + 1);
+        line = strchr(line + 1, '\n');
+    }
+    return count;
+}
+
+/**
+ * Sends votes one at a time, waiting for each response
+ * Returns the votes per second, or -1 if the server stopped responding
+ */
+double benchmarkSingle(int fd, const int32_t *votes, int n) {
+    char datagram[MAX_DATAGRAM_SIZE];
+    struct datagram_header header = {DATAGRAM_VERSION, DG_VOTE, DG_OK, 0, 4};
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < n; i++) {
+        header.request_id = i;
+        writeDatagramHeader(datagram, &header);
+        putU32(datagram + DATAGRAM_HEADER_SIZE, votes[i]);
+        send(fd, datagram, DATAGRAM_HEADER_SIZE + 4, 0);
+
+        if (recv(fd, datagram, MAX_DATAGRAM_SIZE, 0) < 0) {
+            fprintf(stderr, "[ERROR]: The voting server is not responding!\n");
+            return -1;
+        }
+    }
+    return n / secondsSince(&start);
+}
+
+/**
+ * Uploads every vote in full DG_VOTE_BATCH requests
+ * Returns the votes per second, or -1 if the server stopped responding
+ */
+double benchmarkBatch(int fd, const int32_t *votes, int n, long *accepted) {
+    char datagram[MAX_DATAGRAM_SIZE];
+    struct datagram_header header = {DATAGRAM_VERSION, DG_VOTE_BATCH, DG_OK, 0, 0};
+    long sent = 0, received = 0, batches = (n + MAX_VOTE_BATCH - 1) / MAX_VOTE_BATCH;
+    struct timespec start;
+
+    *accepted = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (received < batches) {
+        //Keep a window of batches in flight
+        for (; sent < batches && sent - received < BATCH_WINDOW; sent++) {
+            int first = sent * MAX_VOTE_BATCH;
+            int count = n - first < MAX_VOTE_BATCH ? n - first : MAX_VOTE_BATCH;
+
+            for (int i = 0; i < count; i++) {
+                putU32(datagram + DATAGRAM_HEADER_SIZE + i * VOTE_BATCH_ENTRY_SIZE, votes[first + i]);
+            }
+            header.request_id = sent;
+            header.length = count * VOTE_BATCH_ENTRY_SIZE;
+            writeDatagramHeader(datagram, &header);
+            send(fd, datagram, DATAGRAM_HEADER_SIZE + header.length, 0);
+        }
+        int bytes = recv(fd, datagram, MAX_DATAGRAM_SIZE, 0);
+        if (bytes < DATAGRAM_HEADER_SIZE + VOTE_SUMMARY_SIZE) {
+            fprintf(stderr, "[ERROR]: The voting server is not responding!\n");
+            return -1;
+        }
+        *accepted += getU32(datagram + DATAGRAM_HEADER_SIZE);
+        received++;
+    }
+    return n / secondsSince(&start);
+}
+
+/**
+ * Prints the correct usage of the program and exits
+ */
+void usageError(const char *program) {
+    fprintf(stderr, "Usage: %s [-v votes]\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int n = DEFAULT_VOTES;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "v:")) != -1) {
+        if (opt == 'v' && atoi(optarg) > 0) {
+            n = atoi(optarg);
+        } else {
+            usageError(argv[0]);
+        }
+    }
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(VOTING_SERVER_PORT);
+    server.sin_addr.s_addr = inet_addr(VOTING_SERVER_ADDR);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct timeval timeout = {1, 0};
+
+    if (fd < 0 || connect(fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    //Votes are for the candidates the server lists, encrypted with its key
+    char datagram[MAX_DATAGRAM_SIZE];
+    int32_t ids[MAX_CANDIDATES];
+    int key_length = query(fd, DG_KEY, datagram);
+    int count = readCandidates(fd, ids);
+    int32_t *votes = malloc(n * sizeof(int32_t));
+
+    if (key_length != 4 || count <= 0 || votes == NULL) {
+        fprintf(stderr, "[ERROR]: Could not set up the benchmark, is the voting server running?\n");
+        exit(1);
+    }
+    int32_t key = getU32(datagram + DATAGRAM_HEADER_SIZE);
+
+    for (int i = 0; i < n; i++) {
+        votes[i] = ids[rand() % count] * key;
+    }
+    printf("%d random votes for %d candidates\n", n, count);
+
+    double rate = benchmarkSingle(fd, votes, n < SINGLE_VOTES ? n : SINGLE_VOTES);
+    if (rate < 0) exit(1);
+    printf("One at a time:\t\t%.0f votes/sec\n", rate);
+
+    long accepted;
+    if ((rate = benchmarkBatch(fd, votes, n, &accepted)) < 0) exit(1);
+    printf("Batches of %d:\t\t%.0f votes/sec (%ld accepted)\n", MAX_VOTE_BATCH, rate, accepted);
+
+    close(fd);
+    free(votes);
+
+    return 0;
+}
@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dictionary.h"
+
+/**
+ * Builds the index file of a TSV word list for the translate server
+ * Each line of the word list holds an English word and its French translation separated by a tab
+ */
+int main(int argc, char *argv[]) {
+    struct dictionary dict;
+    struct timespec start, end;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <word list.tsv> <index file>\n", argv[0]);
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (buildDictionary(argv[1], &dict) < 0 || writeDictionary(&dict, argv[2]) < 0) {
+        fprintf(stderr, "[ERROR]: Could not build %s!\n", argv[2]);
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("Indexed %lu words in %lu buckets (%lu bytes) in %.2fs\n", (unsigned long) dict.header->word_count,
+        (unsigned long) dict.header->bucket_count, (unsigned long) dict.size,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    closeDictionary(&dict);
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "candidates.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define MAX_LINE_SIZE 256
+
+/**
+ * Returns the first bucket to probe for an id
+ */
+uint64_t candidateHash(uint32_t id) {
+    uint64_t hash = id;
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    return hash ^ (hash >> 33);
+}
+
+/**
+ * Returns TRUE if a name can be stored in the candidates file
+ */
+int validName(const char *name) {
+    size_t length = strlen(name);
+
+    return length > 0 && length <= MAX_NAME_LENGTH && strpbrk(name, "\t\r\n") == NULL;
+}
+
+int findCandidate(const struct candidate_registry *registry, uint32_t id) {
+    for (uint64_t i = candidateHash(id) & registry->mask; ; i = (i + 1) & registry->mask) {
+        const struct candidate_bucket *bucket = &registry->buckets[i];
+        //The index is written last, so a bucket with an index also has its id
+        uint32_t index = __atomic_load_n(&bucket->index, __ATOMIC_ACQUIRE);
+
+        if (index == 0) return -1;
+        if (bucket->id == id) return index - 1;
+    }
+}
+
+uint32_t candidateCount(const struct candidate_registry *registry) {
+    return __atomic_load_n(&registry->count, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Stores a candidate at the next index and publishes it
+ * Must be called with the lock held, or before any other thread can see the registry
+ */
+int insertCandidate(struct candidate_registry *registry, uint32_t id, const char *name, long votes) {
+    uint64_t i = candidateHash(id) & registry->mask;
+
+    //The table is at most half full, so there is always an empty bucket
+    for (; registry->buckets[i].index != 0; i = (i + 1) & registry->mask) {
+        if (registry->buckets[i].id == id) return CANDIDATE_EXISTS;
+    }
+    if (registry->count == registry->capacity) return CANDIDATE_FULL;
+
+    uint32_t index = registry->count;
+    char *copy = strdup(name);
+    if (copy == NULL) return CANDIDATE_FULL;
+
+    registry->ids[index] = id;
+    registry->names[index] = copy;
+    registry->seeds[index] = votes;
+
+    //Count the candidate before it can be found, so whoever sees a vote for it also sees it counted
+    __atomic_store_n(&registry->count, index + 1, __ATOMIC_RELEASE);
+    registry->buckets[i].id = id;
+    __atomic_store_n(&registry->buckets[i].index, index + 1, __ATOMIC_RELEASE);
+
+    return CANDIDATE_ADDED;
+}
+
+/**
+ * Allocates the arrays and the table of a registry for a given number of candidates
+ * Returns -1 if there is not enough memory
+ */
+int allocCandidates(struct candidate_registry *registry, uint32_t capacity) {
+    uint64_t bucket_count = 16;
+
+    while (bucket_count < (uint64_t) capacity * 2) bucket_count *= 2;
+
+    registry->capacity = capacity;
+    registry->mask = bucket_count - 1;
+    registry->ids = malloc((size_t) capacity * sizeof(uint32_t));
+    registry->names = malloc((size_t) capacity * sizeof(char *));
+    registry->seeds = malloc((size_t) capacity * sizeof(long));
+    registry->buckets = calloc(bucket_count, sizeof(struct candidate_bucket));
+
+    return registry->ids && registry->names && registry->seeds && registry->buckets ? 0 : -1;
+}
+
+int loadCandidates(const char *path, uint32_t room, struct candidate_registry *registry) {
+    FILE *file = fopen(path, "r");
+    char line[MAX_LINE_SIZE];
+    int line_number = 0;
+    uint32_t lines = 0;
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    //Size the registry for every line of the file plus the room asked for
+    while (fgets(line, MAX_LINE_SIZE, file) != NULL) {
+        if (strchr(line, '\n') != NULL) lines++;
+    }
+    memset(registry, 0, sizeof(*registry));
+    registry->path = path;
+    pthread_mutex_init(&registry->lock, NULL);
+
+    if (allocCandidates(registry, lines + 1 + room) < 0) {
+        fprintf(stderr, "[ERROR]: Not enough memory for the candidates!\n");
+        fclose(file);
+        return -1;
+    }
+    rewind(file);
+
+    while (fgets(line, MAX_LINE_SIZE, file) != NULL) {
+        char *id_end, *name, *votes_text;
+        long votes = 0;
+
+        line_number++;
+        //A line that does not fit is skipped whole, rather than having its tail read as another candidate
+        if (strchr(line, '\n') == NULL && !feof(file)) {
+            int c;
+
+            fprintf(stderr, "[WARNING]: %s:%d: lines are at most %d characters long\n", path, line_number, MAX_LINE_SIZE - 2);
+            while ((c = fgetc(file)) != EOF && c != '\n');
+            continue;
+        }
+        //Skip blank lines and comments
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') continue;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        unsigned long id = strtoul(line, &id_end, 10);
+        name = *id_end == '\t' ? id_end + 1 : NULL;
+
+        if (name != NULL && (votes_text = strchr(name, '\t')) != NULL) {
+            *votes_text++ = '\0';
+            votes = strtol(votes_text, NULL, 10);
+        }
+        if (id_end == line || id > UINT32_MAX || name == NULL || !validName(name) || votes < 0) {
+            fprintf(stderr, "[WARNING]: %s:%d: expected a candidate id, a name and optionally a number of votes\n", path, line_number);
+            continue;
+        }
+        if (insertCandidate(registry, id, name, votes) == CANDIDATE_EXISTS) {
+            fprintf(stderr, "[WARNING]: %s:%d: candidate %lu is listed twice\n", path, line_number, id);
+        }
+    }
+    fclose(file);
+
+    return 0;
+}
+
+int addCandidate(struct candidate_registry *registry, uint32_t id, const char *name, long votes, int save) {
+    if (!validName(name) || votes < 0) return CANDIDATE_INVALID;
+
+    pthread_mutex_lock(&registry->lock);
+
+    int status = findCandidate(registry, id) >= 0 ? CANDIDATE_EXISTS :
+        registry->count == registry->capacity ? CANDIDATE_FULL : CANDIDATE_ADDED;
+
+    //Save the candidate before anyone can vote for it, so the votes in the log always have a candidate
+    if (status == CANDIDATE_ADDED && save) {
+        FILE *file = fopen(registry->path, "a+");
+
+        //Finish off a last line that has no line break
+        if (file != NULL && fseek(file, -1, SEEK_END) == 0) {
+            int last = fgetc(file);
+
+            fseek(file, 0, SEEK_END);
+            if (last != '\n') fputc('\n', file);
+        }
+        if (file == NULL || fprintf(file, "%u\t%s\t%ld\n", id, name, votes) < 0 || fflush(file) != 0 ||
+                fdatasync(fileno(file)) < 0) {
+            perror(registry->path);
+            status = CANDIDATE_NOT_SAVED;
+        }
+        if (file != NULL) fclose(file);
+    }
+    if (status == CANDIDATE_ADDED) status = insertCandidate(registry, id, name, votes);
+
+    pthread_mutex_unlock(&registry->lock);
+    return status;
+}
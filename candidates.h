@@ -0,0 +1,92 @@
+#ifndef CANDIDATES_H
+#define CANDIDATES_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Candidates of the voting server
+ *
+ * Candidates are read from a file of "id<TAB>name" lines, where a line can end with a tab and the votes the
+ * candidate starts with. Each candidate gets the next index of a few contiguous arrays, so vote counts can
+ * be kept in plain arrays too, and an open addressing table maps the integer id of a candidate to its index.
+ * The table is sized for the capacity of the registry and kept at most half full, so finding the candidate
+ * of a vote hashes the id once and usually reads a single bucket, however many candidates there are.
+ *
+ * Candidates can be added while votes are being counted. Adds take a lock and are appended to the file
+ * before they are published, lookups never lock: a new bucket and a new count only become visible once
+ * everything they refer to has been written.
+ */
+
+//Longer names are rejected
+#define MAX_NAME_LENGTH 100
+
+/**
+ * A bucket is empty when its index is 0, otherwise it holds the index of the candidate plus 1
+ */
+struct candidate_bucket {
+    uint32_t id;
+    uint32_t index;
+};
+
+struct candidate_registry {
+    //Id, name and starting votes of each candidate, by index
+    uint32_t *ids;
+    char **names;
+    long *seeds;
+    //Candidates published so far, and the most the arrays can hold
+    uint32_t count;
+    uint32_t capacity;
+    //Number of buckets minus 1, the number of buckets is a power of 2
+    uint64_t mask;
+    struct candidate_bucket *buckets;
+    //File the candidates were loaded from, added candidates are appended to it
+    const char *path;
+    pthread_mutex_t lock;
+};
+
+/**
+ * Outcome of adding a candidate
+ */
+enum add_candidate_status {
+    CANDIDATE_ADDED = 0,
+    CANDIDATE_EXISTS = -1,
+    CANDIDATE_FULL = -2,
+    CANDIDATE_INVALID = -3,
+    CANDIDATE_NOT_SAVED = -4
+};
+
+/**
+ * Reads a candidates file into a new registry
+ * Returns -1 if the file could not be read or there is not enough memory
+ *
+ * @param path:     file of candidates
+ * @param room:     number of candidates that can be added after the file is loaded
+ * @param registry: registry to set up
+ */
+int loadCandidates(const char *path, uint32_t room, struct candidate_registry *registry);
+
+/**
+ * Returns the index of a candidate, or -1 if there is no candidate with that id
+ * Never blocks, even while a candidate is being added
+ */
+int findCandidate(const struct candidate_registry *registry, uint32_t id);
+
+/**
+ * Returns the number of candidates, every index below it can be used
+ */
+uint32_t candidateCount(const struct candidate_registry *registry);
+
+/**
+ * Adds a candidate, saving it to the file first if save is TRUE
+ * Returns CANDIDATE_ADDED or the reason the candidate could not be added
+ *
+ * @param registry: registry to add to
+ * @param id:       id of the new candidate
+ * @param name:     name of the new candidate, without tabs or line breaks
+ * @param votes:    votes the candidate starts with
+ * @param save:     whether to append the candidate to the file
+ */
+int addCandidate(struct candidate_registry *registry, uint32_t id, const char *name, long votes, int save);
+
+#endif
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "currency_handler.h"
+
+int64_t convert(int amount, uint32_t source, uint32_t dest, const struct rate_table *table) {
+    int64_t hundredths = (int64_t) amount * 100, result;
+
+    //Handle edge cases... 0 of any currency is always 0
+    if (amount == 0) return 0;
+    if (amount < 0) return -1;
+
+    //A single conversion is a batch of one
+    convertAmounts(table, &hundredths, &source, &dest, &result, 1);
+
+    return result == INVALID_AMOUNT ? -1 : result;
+}
+
+/**
+ * Converts every entry of a batch request and writes the results to dest
+ * Returns the length of the results
+ */
+int convertBatch(const char *payload, int length, char *dest) {
+    int64_t amounts[MAX_CONVERT_BATCH], results[MAX_CONVERT_BATCH];
+    uint32_t sources[MAX_CONVERT_BATCH], dests[MAX_CONVERT_BATCH];
+    struct convert_batch_entry entry;
+    int n = length / CONVERT_BATCH_ENTRY_SIZE;
+
+    //Split the entries into one array per field for convertAmounts()
+    for (int i = 0; i < n; i++) {
+        readBatchEntry(payload + i * CONVERT_BATCH_ENTRY_SIZE, &entry);
+        amounts[i] = entry.amount;
+        sources[i] = entry.source;
+        dests[i] = entry.dest;
+    }
+    convertAmounts(beginRates(), amounts, sources, dests, results, n);
+    endRates();
+
+    for (int i = 0; i < n; i++) {
+        putU64(dest + i * 8, (uint64_t) results[i]);
+    }
+    return n * 8;
+}
+
+int handleConvert(const struct datagram_header *header, const char *payload, char *response, void *context) {
+    struct convert_request request;
+    int64_t amount = -1;
+    uint32_t generation = 0;
+
+    //The rates in use are global, the context is only handed back by loadConverter() for the caller to hold
+    (void) context;
+
+    if (header->opcode == DG_CONVERT_BATCH && header->length % CONVERT_BATCH_ENTRY_SIZE == 0) {
+        //Entries that cannot be converted are marked in the results, the batch as a whole succeeds
+        return writeResponseHeader(response, header, DG_OK, convertBatch(payload, header->length, response + DATAGRAM_HEADER_SIZE));
+    }
+    if (header->opcode == DG_RATES) {
+        //Lets the indirection server know when the responses it cached were made with old rates
+        putU32(response + DATAGRAM_HEADER_SIZE, beginRates()->generation);
+        endRates();
+        return writeResponseHeader(response, header, DG_OK, 4);
+    }
+    //The amount and both currencies arrive as integers, so there is nothing to parse
+    if (header->opcode == DG_CONVERT && readConvertRequest(payload, header->length, &request) == 0) {
+        //The table cannot be freed by a reload until endRates()
+        const struct rate_table *table = beginRates();
+
+        amount = convert(request.amount, request.source, request.dest, table);
+        generation = table->generation;
+        endRates();
+    }
+    if (amount >= 0) {
+        //Send the converted amount as a whole number of hundredths, along with the rates used
+        putU64(response + DATAGRAM_HEADER_SIZE, (uint64_t) amount);
+        putU32(response + DATAGRAM_HEADER_SIZE + 8, generation);
+        return writeResponseHeader(response, header, DG_OK, 12);
+    }
+    //convert() returned error code -1
+    return writeResponseHeader(response, header, DG_ERROR, sprintf(response + DATAGRAM_HEADER_SIZE, "Invalid input, please try again."));
+}
+
+void *loadConverter(const char *path) {
+    struct rate_table *table = loadRates(path);
+
+    //Watch the rates file for changes while serving requests
+    if (table == NULL || startRates(path, table) < 0) {
+        if (table != NULL) freeRates(table);
+        return NULL;
+    }
+    return table;
+}
@@ -0,0 +1,41 @@
+#ifndef CURRENCY_HANDLER_H
+#define CURRENCY_HANDLER_H
+
+#include <stdint.h>
+
+#include "datagram.h"
+#include "rates.h"
+
+/*
+ * Request handler of the currency server
+ *
+ * The handler only turns a request datagram into a response datagram, so it is linked both into the currency
+ * server, which runs it behind its UDP loop, and into the indirection server, which can run it in process and
+ * skip the round trip to a currency server. Conversions use the rates in rates.c, which any number of threads
+ * can read while they are reloaded.
+ */
+
+/**
+ * Loads a rates file to convert with and starts the thread that reloads it when it changes
+ * Returns the context to give handleConvert(), or NULL if the rates could not be loaded
+ */
+void *loadConverter(const char *path);
+
+/**
+ * Converts a source currency to the equivalent amount in a destination currency
+ * Returns the converted amount in hundredths, or -1 if the amount is negative or a currency is unknown
+ * 
+ * @param amount:      quantity of the source currency
+ * @param source:      packed code of the source currency
+ * @param dest:        packed code of the destination currency
+ * @param table:       rates to convert with
+ */
+int64_t convert(int amount, uint32_t source, uint32_t dest, const struct rate_table *table);
+
+/**
+ * Converts the amount, or batch of amounts, in a request and writes the response
+ * Returns the size of the response
+ */
+int handleConvert(const struct datagram_header *header, const char *payload, char *response, void *context);
+
+#endif
@@ -6,6 +6,11 @@
 #include <signal.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <pthread.h>
+
+#include "datagram.h"
+#include "udp_loop.h"
+#include "currency_handler.h"
 
 #define TRUE 1
 #define FALSE 0
@@ -13,7 +18,10 @@
 #define MAX_BUFFER_SIZE 2048
 
 #define PORT 9045
-#define NUM_CURRENCIES 5
+//Rates file loaded when none is given on the command line
+#define DEFAULT_RATES "rates.tsv"
+//Rate tables up to this size are printed at startup
+#define MAX_PRINTED_RATES 20
 
 /**
  * Check whether a function has returned an error code and exit the program if necessary
@@ -30,91 +38,21 @@ int check(int status, char *function_name, int can_exit) {
     return status;
 }
 
-/**
- * Converts a source currency to the equivalent amount in a destination currency
- * 
- * @param amount:      quantity of the source currency
- * @param source:      name of the source currency
- * @param dest:        name of the destination currency
- * @param currencies:  list of all currency names
- * @param conversions: list of currency conversion rates relative to CAD
- */
-float convert(int amount, char *source, char *dest, char *currencies[NUM_CURRENCIES], float conversions[NUM_CURRENCIES]) {
-    //Handle edge cases... 0 of any currency is always 0
-    if (amount == 0) return 0;
-    //Both a source and dest currency must be specified
-    if (source == NULL || dest == NULL) return -1;
-    
-    float res = -1;
-    //Booleans indicating whether valid currency names were given
-    int validSource = FALSE;
-    int validDest = FALSE;
-
-    if (amount > 0) {
-        // If it isn't already, convert the source currency to the default currency (CAD)
-        if (strcmp(source, currencies[0]) != 0) {
-            for (int i = 0; i < NUM_CURRENCIES; i++) {
-                //Find the conversion factor for converting the source currency to CAD
-                if (strcmp(source, currencies[i]) == 0) {
-                    //To convert to CAD, we use the reciprocal of the value provided in conversions
-                    res = ((float) amount) * (1.0 / conversions[i]);
-                    validSource = TRUE;
-                    break;
-                }
-            }
-        } else {
-            validSource = TRUE;
-        }
-        //Covert the source currency (now in CAD), to the dest currency
-        for (int i = 0; i < NUM_CURRENCIES; i++) {
-            //Find the conversion factor for converting to the dest currency
-            if (strcmp(dest, currencies[i]) == 0) {
-                // If the original source currency was CAD, use amount
-                //Otherwise, use the new value of res from the previous step
-                res = (res == -1 ? amount : res) * conversions[i];
-                validDest = TRUE;
-                break;
-            }
-        }
-    }
-    //Return error if a valid source/dest currency was not provided
-    return validSource && validDest ? res : -1;
-}
-
-/**
- * Splits a string into an array of strings about a given delimitor
- * Eg. "a|b|c" split about '|' becomes 3 separate strings a, b, c
- * 
- * @param source:      the string to split
- * @param dest:        array to hold the split strings
- * @param delim:       the delimitor character
- */
-int split(char *source, char dest[5][10], char delim) {
-	int i = 0, j = 0, n = 0;
-	
-	do {
-        //Keep iterating until we find an occurrence of delim
-		if (source[i] != delim) {
-			dest[n][j++] = source[i];
-		} else {
-            //We found a delim character, so insert the string into dest
-			dest[n++][j] = '\0';
-            //Reset counter
-			j = 0;
-		}
-	} while (source[i++] != '\0');
-    
-	return n+1;
-}
-
 /*
- * Prints useful info about the microserver, including the conversion rates
+ * Prints useful info about the microserver, including the conversion rates of small tables
  */
-void printStartup(char *currencies[NUM_CURRENCIES], float conversions[NUM_CURRENCIES]) {
+void printStartup(const char *path, const struct rate_table *table) {
+    printf("Loaded %d currencies from %s\n\n", table->count, path);
+    if (table->count > MAX_PRINTED_RATES) return;
+
     printf("Currency\tMult Factor (CAD)\n--------\t-----------------\n");
 
-    for (int i = 0; i < NUM_CURRENCIES; i++) {
-        printf("%s\t\t%.2f\n", currencies[i], conversions[i]);
+    for (int i = 0; i < RATE_SLOTS; i++) {
+        if (table->index[i] >= 0) {
+            char rate[MAX_RATE_TEXT];
+            formatRate(table, i, rate);
+            printf("%c%c%c\t\t%s\n", 'A' + i / (26 * 26), 'A' + i / 26 % 26, 'A' + i % 26, rate);
+        }
     }
 }
 
@@ -147,58 +85,73 @@ int initServer(int server_port) {
     return server_fd;
 }
 
-int main() {
-	int server_fd = initServer(PORT);
+/**
+ * Serves the shared memory ring next to the UDP socket, see shm_ring.h
+ */
+void *serveRing(void *arg) {
+    runUdpLoop(arg);
+    return NULL;
+}
+
+/**
+ * Prints the correct usage of the program and exits
+ */
+void usageError(const char *program) {
+    fprintf(stderr, "Usage: %s [-r rates] [-n batch] [-m mmsg|uring] [-p port] [-x ring]\n", program);
+    exit(1);
+}
 
+int main(int argc, char *argv[]) {
     //Important microservice info
-    char *currencies[NUM_CURRENCIES] = {"CAD", "USD", "EUR", "GBP", "BTC"};
-    float conversions[NUM_CURRENCIES] = {1, 0.81, 0.70, 0.59, 0.00001277};
+    const char *path = DEFAULT_RATES;
+    struct udp_loop loop = {.name = "currency", .batch = DEFAULT_UDP_BATCH, .backend = BACKEND_URING, .handler = handleConvert};
+    struct udp_loop ring_loop;
+    const char *ring = NULL;
+    pthread_t ring_thread;
+    int port = PORT, opt;
+
+    while ((opt = getopt(argc, argv, "r:n:m:p:x:")) != -1) {
+        if (opt == 'r') {
+            path = optarg;
+        } else if (opt == 'n' && atoi(optarg) > 0) {
+            loop.batch = atoi(optarg);
+        } else if (opt == 'm' && parseBackend(optarg) >= 0) {
+            loop.backend = parseBackend(optarg);
+        } else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= 65535) {
+            //Replicas running on the same machine each need their own port
+            port = atoi(optarg);
+        } else if (opt == 'x') {
+            ring = optarg;
+        } else {
+            usageError(argv[0]);
+        }
+    }
 
-    //String for holding incoming/outgoing network data
-    char buffer[MAX_BUFFER_SIZE];
-	memset(&buffer, 0, MAX_BUFFER_SIZE);
+    //The rates are reloaded by their own thread from now on
+    if ((loop.context = loadConverter(path)) == NULL) {
+        fprintf(stderr, "[ERROR]: Could not load the rates %s!\n", path);
+        exit(1);
+    }
+	loop.fd = initServer(port);
 
     //Print info about the microservice
-    printStartup(currencies, conversions);
-
-    //Placeholder info for communicating with indirection server
-    struct sockaddr_in server;
-
-    int sock_len = sizeof(struct sockaddr_in);
-    int done = FALSE;
-    int bytes;
-
-	while (!done) {
-        memset(buffer, 0, MAX_BUFFER_SIZE);
-
-        if (bytes = recvfrom(server_fd, buffer, MAX_BUFFER_SIZE, 0, (struct sockaddr *) &server, &sock_len) > 0) {
-            //Get conversion string from the buffer and split it about the '|' char
-            //Store the 3 individual strings in input
-            char input[5][10];
-            int n = split(buffer, input, '|');
-
-            memset(buffer, 0, MAX_BUFFER_SIZE);
-
-            if (n == 3) {
-                //We received the 3 desired separate strings (amount, source, dest)
-                //Convert the currency
-                float amount = convert(atoi(input[0]), input[1], input[2], currencies, conversions);
-
-                if (amount >= 0) {
-                    sprintf(buffer, "%.2f", amount);
-                } else {
-                    //convert() returned error code -1
-                    strcpy(buffer, "Invalid input, please try again.");
-                }
-            } else {
-                //User input did not split into 3 strings
-                strcpy(buffer, "Invalid input, please try again.");
-            }
-            //Send result message back to indirection server
-            sendto(server_fd, buffer, sizeof(buffer), 0, (struct sockaddr *) &server, sock_len);
+    printStartup(path, beginRates());
+    endRates();
+
+    //Requests from an indirection server on the same machine can come through shared memory instead
+    if (ring != NULL) {
+        ring_loop = loop;
+        ring_loop.name = "currency ring";
+        ring_loop.ring = ring;
+        if (pthread_create(&ring_thread, NULL, serveRing, &ring_loop) != 0) {
+            fprintf(stderr, "[ERROR]: Could not start serving the ring!\n");
+            exit(1);
         }
-	}
-	close(server_fd);
+    }
+
+    //Serve requests in batches until the program is killed
+    runUdpLoop(&loop);
+	close(loop.fd);
 	
 	return 0;
 }
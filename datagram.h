@@ -0,0 +1,261 @@
+#ifndef DATAGRAM_H
+#define DATAGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * Binary format of the datagrams exchanged between the indirection server and the microservices
+ *
+ * Every datagram is a fixed size header followed by exactly `length` bytes of payload, and only those
+ * bytes are put on the wire. Numbers are sent as big endian integers rather than text, and strings are
+ * sized by the header rather than terminated, so nothing on either side has to scan for a NUL.
+ *
+ * The request id is chosen by the indirection server and copied into the response by the microservice.
+ * This lets the indirection server keep many requests in flight on one socket and still match each
+ * response back to the client waiting on it.
+ */
+
+#define DATAGRAM_VERSION 1
+
+//version (1 byte), opcode (1 byte), status (1 byte), reserved (1 byte), request id (4 bytes), length (2 bytes), reserved (2 bytes)
+#define DATAGRAM_HEADER_SIZE 12
+#define MAX_DATAGRAM_SIZE 2048
+#define MAX_DATAGRAM_PAYLOAD (MAX_DATAGRAM_SIZE - DATAGRAM_HEADER_SIZE)
+
+/**
+ * Requests a microservice can handle, the response carries the same opcode
+ *
+ * DG_TRANSLATE:  request is an English word, response is the French word
+ * DG_CONVERT:    request is a convert_request, response is the converted amount in hundredths as an int64,
+ *                followed by the generation of the rate table it was converted with as a uint32
+ * DG_CANDIDATES: no request payload, response is the candidate table as text
+ * DG_VOTE:       request is the encrypted candidate id as an int32, response is a message
+ * DG_RESULTS:    no request payload, response is the results table as text
+ * DG_KEY:        no request payload, response is the key for encrypting candidate ids as a uint32
+ * DG_TRANSLATE_TEXT: request is English text, response is the text with every known word in French,
+ *                    and punctuation, spacing and unknown words left as they are
+ * DG_CONVERT_BATCH:  request is up to MAX_CONVERT_BATCH convert_batch_entry, response is the converted
+ *                    amount of each entry in hundredths as an int64, or INVALID_AMOUNT
+ * DG_LEADERS:    request is an optional uint32 k, response is the k candidates with the most votes as text
+ * DG_ADD_CANDIDATE: request is the new candidate's id as a uint32 followed by their name, response is a message
+ * DG_VOTE_BATCH: request is up to MAX_VOTE_BATCH encrypted candidate ids as int32, response is a vote summary
+ * DG_RATES:      no request payload, response is the generation of the rate table as a uint32, which changes
+ *                every time the rates are reloaded
+ * DG_PING:       no request payload, empty response, answered by every microservice to show it is up
+ */
+enum datagram_opcode {
+    DG_TRANSLATE = 1,
+    DG_CONVERT = 2,
+    DG_CANDIDATES = 3,
+    DG_VOTE = 4,
+    DG_RESULTS = 5,
+    DG_KEY = 6,
+    DG_TRANSLATE_TEXT = 7,
+    DG_CONVERT_BATCH = 8,
+    DG_LEADERS = 9,
+    DG_ADD_CANDIDATE = 10,
+    DG_VOTE_BATCH = 11,
+    DG_RATES = 12,
+    DG_PING = 13
+};
+
+/**
+ * Outcome of a request, an error response carries a message as its payload
+ */
+enum datagram_status {
+    DG_OK = 0,
+    DG_ERROR = 1
+};
+
+struct datagram_header {
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t status;
+    uint32_t request_id;
+    uint16_t length;
+};
+
+//amount (4 bytes), source currency (4 bytes), destination currency (4 bytes)
+#define CONVERT_REQUEST_SIZE 12
+
+/**
+ * Payload of a DG_CONVERT request, currencies are three letter codes packed with packCurrency()
+ */
+struct convert_request {
+    int32_t amount;
+    uint32_t source;
+    uint32_t dest;
+};
+
+//amount (8 bytes), source currency (4 bytes), destination currency (4 bytes)
+#define CONVERT_BATCH_ENTRY_SIZE 16
+#define MAX_CONVERT_BATCH (MAX_DATAGRAM_PAYLOAD / CONVERT_BATCH_ENTRY_SIZE)
+//Result of an entry that could not be converted
+#define INVALID_AMOUNT INT64_MIN
+
+/**
+ * One conversion of a DG_CONVERT_BATCH request
+ * The amount is in hundredths of the source currency and may be negative, such as for a refund
+ */
+struct convert_batch_entry {
+    int64_t amount;
+    uint32_t source;
+    uint32_t dest;
+};
+
+//Encrypted candidate id (4 bytes)
+#define VOTE_BATCH_ENTRY_SIZE 4
+#define MAX_VOTE_BATCH (MAX_DATAGRAM_PAYLOAD / VOTE_BATCH_ENTRY_SIZE)
+//Votes accepted (4 bytes) and rejected (4 bytes), followed by the position of each rejected vote (2 bytes each)
+#define VOTE_SUMMARY_SIZE 8
+
+/**
+ * Writes a 16 bit integer in network byte order
+ */
+static inline void putU16(char *dest, uint16_t value) {
+    value = htons(value);
+    memcpy(dest, &value, 2);
+}
+
+/**
+ * Reads a 16 bit integer in network byte order
+ */
+static inline uint16_t getU16(const char *src) {
+    uint16_t value;
+    memcpy(&value, src, 2);
+    return ntohs(value);
+}
+
+/**
+ * Writes a 32 bit integer in network byte order
+ */
+static inline void putU32(char *dest, uint32_t value) {
+    value = htonl(value);
+    memcpy(dest, &value, 4);
+}
+
+/**
+ * Reads a 32 bit integer in network byte order
+ */
+static inline uint32_t getU32(const char *src) {
+    uint32_t value;
+    memcpy(&value, src, 4);
+    return ntohl(value);
+}
+
+/**
+ * Writes a 64 bit integer in network byte order
+ */
+static inline void putU64(char *dest, uint64_t value) {
+    putU32(dest, (uint32_t) (value >> 32));
+    putU32(dest + 4, (uint32_t) value);
+}
+
+/**
+ * Reads a 64 bit integer in network byte order
+ */
+static inline uint64_t getU64(const char *src) {
+    return ((uint64_t) getU32(src) << 32) | getU32(src + 4);
+}
+
+/**
+ * Writes a datagram header to the first DATAGRAM_HEADER_SIZE bytes of dest
+ */
+static inline void writeDatagramHeader(char *dest, const struct datagram_header *header) {
+    uint16_t length = htons(header->length);
+
+    dest[0] = header->version;
+    dest[1] = header->opcode;
+    dest[2] = header->status;
+    dest[3] = 0;
+    putU32(dest + 4, header->request_id);
+    memcpy(dest + 8, &length, 2);
+    dest[10] = dest[11] = 0;
+}
+
+/**
+ * Reads the header of a received datagram
+ * Returns -1 if the datagram is too short, has an unknown version or is shorter than its header claims
+ */
+static inline int readDatagramHeader(const char *src, int bytes, struct datagram_header *header) {
+    uint16_t length;
+
+    if (bytes < DATAGRAM_HEADER_SIZE) return -1;
+
+    header->version = src[0];
+    header->opcode = src[1];
+    header->status = src[2];
+    header->request_id = getU32(src + 4);
+    memcpy(&length, src + 8, 2);
+    header->length = ntohs(length);
+
+    if (header->version != DATAGRAM_VERSION || header->length > bytes - DATAGRAM_HEADER_SIZE) return -1;
+    return 0;
+}
+
+/**
+ * Writes the header of the response to a request, for a payload of `length` bytes that follows the header
+ * Returns the size of the whole response datagram
+ */
+static inline int writeResponseHeader(char *dest, const struct datagram_header *request, int status, int length) {
+    struct datagram_header header = *request;
+
+    header.status = status;
+    header.length = length;
+    writeDatagramHeader(dest, &header);
+
+    return DATAGRAM_HEADER_SIZE + length;
+}
+
+/**
+ * Writes the payload of a DG_CONVERT request
+ */
+static inline void writeConvertRequest(char *dest, const struct convert_request *request) {
+    putU32(dest, (uint32_t) request->amount);
+    putU32(dest + 4, request->source);
+    putU32(dest + 8, request->dest);
+}
+
+/**
+ * Reads the payload of a DG_CONVERT request
+ * Returns -1 if the payload has the wrong size
+ */
+static inline int readConvertRequest(const char *src, int length, struct convert_request *request) {
+    if (length != CONVERT_REQUEST_SIZE) return -1;
+
+    request->amount = (int32_t) getU32(src);
+    request->source = getU32(src + 4);
+    request->dest = getU32(src + 8);
+    return 0;
+}
+
+/**
+ * Writes one entry of a DG_CONVERT_BATCH request
+ */
+static inline void writeBatchEntry(char *dest, const struct convert_batch_entry *entry) {
+    putU64(dest, (uint64_t) entry->amount);
+    putU32(dest + 8, entry->source);
+    putU32(dest + 12, entry->dest);
+}
+
+/**
+ * Reads one entry of a DG_CONVERT_BATCH request
+ */
+static inline void readBatchEntry(const char *src, struct convert_batch_entry *entry) {
+    entry->amount = (int64_t) getU64(src);
+    entry->source = getU32(src + 8);
+    entry->dest = getU32(src + 12);
+}
+
+/**
+ * Packs a three letter currency code such as "CAD" into an integer
+ * Returns 0 if the code is not exactly three letters long
+ */
+static inline uint32_t packCurrency(const char *code, int len) {
+    if (len != 3) return 0;
+    return ((uint32_t) (uint8_t) code[0] << 16) | ((uint32_t) (uint8_t) code[1] << 8) | (uint8_t) code[2];
+}
+
+#endif
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dictionary.h"
+
+#define TRUE 1
+#define FALSE 0
+
+/**
+ * Hashes a word with 64 bit FNV-1a
+ */
+uint64_t hashWord(const char *word, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t) word[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Returns the tag kept in a bucket for a hash, never 0 since 0 marks an empty bucket
+ */
+uint32_t hashTag(uint64_t hash) {
+    return (uint32_t) (hash >> 32) | 1;
+}
+
+/**
+ * Returns TRUE if a bucket holds words no longer than MAX_WORD_LENGTH that lie inside the string pool
+ * Buckets are checked when they are read rather than when an index is mapped, so startup stays immediate
+ */
+int isValidBucket(const struct dictionary *dict, const struct dictionary_bucket *bucket) {
+    if (bucket->english_length > MAX_WORD_LENGTH || bucket->french_length > MAX_WORD_LENGTH) return FALSE;
+    return bucket->offset <= dict->strings_size &&
+        (uint64_t) bucket->english_length + bucket->french_length + 2 <= dict->strings_size - bucket->offset;
+}
+
+/**
+ * Points the dictionary at the parts of its image
+ * Returns -1 if the image is not a valid index
+ */
+int attachImage(struct dictionary *dict) {
+    const struct dictionary_header *header = (const struct dictionary_header *) dict->image;
+
+    if (dict->size < sizeof(*header) || memcmp(header->magic, DICTIONARY_MAGIC, 8) != 0) return -1;
+    if (header->version != DICTIONARY_VERSION || header->byte_order != DICTIONARY_BYTE_ORDER) return -1;
+    //The table must be a power of 2 and every part must lie inside the image
+    if (header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1)) != 0) return -1;
+    if (header->size != dict->size || header->strings_offset > dict->size) return -1;
+    //Divided rather than multiplied, so a huge bucket count cannot wrap around and pass
+    if (header->buckets_offset > header->strings_offset ||
+            header->bucket_count > (header->strings_offset - header->buckets_offset) / sizeof(struct dictionary_bucket)) return -1;
+
+    dict->header = header;
+    dict->buckets = (const struct dictionary_bucket *) (dict->image + header->buckets_offset);
+    dict->strings = dict->image + header->strings_offset;
+    dict->strings_size = dict->size - header->strings_offset;
+    dict->mask = header->bucket_count - 1;
+
+    return 0;
+}
+
+/**
+ * Finds the next "english<TAB>french" pair of a word list, skipping blank lines and # comments
+ * Returns a pointer past the line, or NULL at the end of the list
+ */
+const char *nextPair(const char *pos, const char *end, const char **english, int *english_length,
+        const char **french, int *french_length) {
+    while (pos < end) {
+        const char *line = pos;
+        const char *newline = memchr(pos, '\n', end - pos);
+        const char *line_end = newline ? newline : end;
+
+        pos = newline ? newline + 1 : end;
+        //Accept word lists saved with Windows line endings
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+        if (line == line_end || line[0] == '#') continue;
+
+        const char *tab = memchr(line, '\t', line_end - line);
+        if (tab == NULL) continue;
+
+        *english = line;
+        *english_length = tab - line;
+        *french = tab + 1;
+        *french_length = line_end - (tab + 1);
+        return pos;
+    }
+    return NULL;
+}
+
+int buildDictionary(const char *path, struct dictionary *dict) {
+    memset(dict, 0, sizeof(*dict));
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    //Map the word list rather than reading it, it may be very large
+    const char *list = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+
+    if (list == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    const char *end = list + st.st_size;
+    const char *pos = list;
+    const char *english, *french;
+    int english_length, french_length;
+    uint64_t pairs = 0, skipped = 0, duplicates = 0;
+    size_t strings_size = 0;
+
+    //First pass sizes the table and the string pool
+    while ((pos = nextPair(pos, end, &english, &english_length, &french, &french_length)) != NULL) {
+        pairs++;
+        strings_size += english_length + french_length + 2;
+    }
+    uint64_t bucket_count = 16;
+    //Keep the table at most half full so probes stay short
+    while (bucket_count < pairs * 2) bucket_count <<= 1;
+
+    size_t buckets_offset = sizeof(struct dictionary_header);
+    size_t strings_offset = buckets_offset + bucket_count * sizeof(struct dictionary_bucket);
+
+    dict->size = strings_offset + strings_size;
+    if ((dict->image = calloc(1, dict->size)) == NULL) {
+        fprintf(stderr, "[ERROR]: Not enough memory for the dictionary!\n");
+        if (list) munmap((void *) list, st.st_size);
+        return -1;
+    }
+    struct dictionary_header *header = (struct dictionary_header *) dict->image;
+    struct dictionary_bucket *buckets = (struct dictionary_bucket *) (dict->image + buckets_offset);
+    char *strings = dict->image + strings_offset;
+    size_t used = 0;
+
+    memcpy(header->magic, DICTIONARY_MAGIC, 8);
+    header->version = DICTIONARY_VERSION;
+    header->byte_order = DICTIONARY_BYTE_ORDER;
+    header->bucket_count = bucket_count;
+    header->buckets_offset = buckets_offset;
+    header->strings_offset = strings_offset;
+
+    //Second pass fills in the table, the first translation of a word wins
+    pos = list;
+    while ((pos = nextPair(pos, end, &english, &english_length, &french, &french_length)) != NULL) {
+        if (english_length == 0 || english_length > MAX_WORD_LENGTH || french_length > MAX_WORD_LENGTH) {
+            skipped++;
+            continue;
+        }
+        uint64_t hash = hashWord(english, english_length);
+        uint32_t tag = hashTag(hash);
+        uint64_t i = hash & (bucket_count - 1);
+        int duplicate = FALSE;
+
+        //Linear probing
+        for (; buckets[i].tag != 0; i = (i + 1) & (bucket_count - 1)) {
+            if (buckets[i].tag == tag && buckets[i].english_length == english_length &&
+                    memcmp(strings + buckets[i].offset, english, english_length) == 0) {
+                duplicate = TRUE;
+                break;
+            }
+        }
+        if (duplicate) {
+            duplicates++;
+            continue;
+        }
+        buckets[i].tag = tag;
+        buckets[i].english_length = english_length;
+        buckets[i].french_length = french_length;
+        buckets[i].offset = used;
+
+        memcpy(strings + used, english, english_length);
+        used += english_length + 1;
+        memcpy(strings + used, french, french_length);
+        used += french_length + 1;
+        header->word_count++;
+    }
+    if (list) munmap((void *) list, st.st_size);
+
+    //Skipped words leave unused room at the end of the pool
+    dict->size = strings_offset + used;
+    header->size = dict->size;
+
+    if (skipped > 0 || duplicates > 0) {
+        fprintf(stderr, "[WARNING]: %s: skipped %lu words that were too long and %lu duplicates\n", path,
+            (unsigned long) skipped, (unsigned long) duplicates);
+    }
+    return attachImage(dict);
+}
+
+int writeDictionary(const struct dictionary *dict, const char *path) {
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fwrite(dict->image, 1, dict->size, file) != dict->size) {
+        perror("fwrite");
+        fclose(file);
+        return -1;
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+int openDictionary(const char *path, struct dictionary *dict) {
+    char magic[8];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    memset(dict, 0, sizeof(*dict));
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    //Anything that does not start with the magic is treated as a word list
+    if (st.st_size < (off_t) sizeof(struct dictionary_header) || read(fd, magic, 8) != 8 || memcmp(magic, DICTIONARY_MAGIC, 8) != 0) {
+        close(fd);
+        return buildDictionary(path, dict);
+    }
+    dict->size = st.st_size;
+    dict->image = mmap(NULL, dict->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (dict->image == MAP_FAILED) {
+        perror("mmap");
+        dict->image = NULL;
+        return -1;
+    }
+    dict->mapped = TRUE;
+
+    if (attachImage(dict) < 0) {
+        fprintf(stderr, "[ERROR]: %s is not a valid dictionary index!\n", path);
+        closeDictionary(dict);
+        return -1;
+    }
+    return 0;
+}
+
+const char *lookupWord(const struct dictionary *dict, const char *word, int len, int *french_length) {
+    uint64_t hash = hashWord(word, len);
+    uint32_t tag = hashTag(hash);
+
+    //The table is never full, so the probe stops at an empty bucket well before it wraps around
+    for (uint64_t i = hash & dict->mask, n = 0; dict->buckets[i].tag != 0 && n <= dict->mask; i = (i + 1) & dict->mask, n++) {
+        const struct dictionary_bucket *bucket = &dict->buckets[i];
+
+        if (bucket->tag != tag || bucket->english_length != len) continue;
+        //Guard against a damaged index pointing outside the string pool or holding words longer than any caller expects
+        if (!isValidBucket(dict, bucket)) return NULL;
+
+        const char *english = dict->strings + bucket->offset;
+        if (memcmp(english, word, len) == 0) {
+            *french_length = bucket->french_length;
+            return english + len + 1;
+        }
+    }
+    return NULL;
+}
+
+int bucketWords(const struct dictionary *dict, uint64_t i, const char **english, const char **french) {
+    const struct dictionary_bucket *bucket = &dict->buckets[i];
+
+    if (bucket->tag == 0 || !isValidBucket(dict, bucket)) return 0;
+
+    *english = dict->strings + bucket->offset;
+    *french = *english + bucket->english_length + 1;
+    return 1;
+}
+
+void closeDictionary(struct dictionary *dict) {
+    if (dict->image != NULL) {
+        if (dict->mapped) {
+            munmap(dict->image, dict->size);
+        } else {
+            free(dict->image);
+        }
+    }
+    memset(dict, 0, sizeof(*dict));
+}
@@ -0,0 +1,98 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hash index of English to French translations used by the translate server
+ *
+ * The index is one flat image: a header, an open addressing table of fixed size buckets and a pool holding
+ * every word. The table is kept at most half full, so a lookup hashes the word once and usually reads a
+ * single bucket, however many words the dictionary holds. Each bucket carries part of the hash as a tag,
+ * which lets a probe skip a bucket without touching the string pool.
+ *
+ * The same image is built in memory from a TSV word list (one "english<TAB>french" pair per line) or
+ * written to an index file with build_dictionary. An index file is mapped rather than read, so startup does
+ * not depend on the size of the dictionary and every process serving it shares the same pages.
+ */
+
+#define DICTIONARY_MAGIC "TRDICT\0\0"
+#define DICTIONARY_VERSION 1
+//Written in host byte order, so an index built on a machine with a different byte order is rejected
+#define DICTIONARY_BYTE_ORDER 0x01020304
+//Words longer than this are skipped when building
+#define MAX_WORD_LENGTH 255
+
+struct dictionary_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    //Number of buckets, a power of 2
+    uint64_t bucket_count;
+    uint64_t word_count;
+    //Offsets from the start of the image
+    uint64_t buckets_offset;
+    uint64_t strings_offset;
+    uint64_t size;
+};
+
+/**
+ * A bucket is empty when its tag is 0
+ * The English word is stored at offset in the string pool, followed by a NUL and the French word
+ */
+struct dictionary_bucket {
+    uint32_t tag;
+    uint16_t english_length;
+    uint16_t french_length;
+    uint64_t offset;
+};
+
+struct dictionary {
+    //The whole image, either mapped from an index file or allocated when built from a word list
+    char *image;
+    size_t size;
+    int mapped;
+    const struct dictionary_header *header;
+    const struct dictionary_bucket *buckets;
+    const char *strings;
+    size_t strings_size;
+    uint64_t mask;
+};
+
+/**
+ * Builds the index of a TSV word list in memory
+ * Returns -1 if the file could not be read
+ */
+int buildDictionary(const char *path, struct dictionary *dict);
+
+/**
+ * Writes an index built with buildDictionary() to a file that openDictionary() can map
+ * Returns -1 if the file could not be written
+ */
+int writeDictionary(const struct dictionary *dict, const char *path);
+
+/**
+ * Opens a dictionary, mapping it if the file is an index file and building the index if it is a TSV word list
+ * Returns -1 if the file could not be read or is a damaged index
+ */
+int openDictionary(const char *path, struct dictionary *dict);
+
+/**
+ * Finds the French translation of an English word
+ * Returns the French word (NUL terminated) and sets french_length, or returns NULL if the word is unknown
+ * The French word is never longer than MAX_WORD_LENGTH, words of a damaged index that are longer count as unknown
+ *
+ * @param word: the English word, not NUL terminated
+ * @param len:  length of the word
+ */
+const char *lookupWord(const struct dictionary *dict, const char *word, int len, int *french_length);
+
+/**
+ * Returns the English and French words held in a bucket, or 0 if the bucket is empty or damaged
+ */
+int bucketWords(const struct dictionary *dict, uint64_t i, const char **english, const char **french);
+
+void closeDictionary(struct dictionary *dict);
+
+#endif
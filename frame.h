@@ -0,0 +1,88 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * Framed protocol spoken between the client and the indirection server over TCP
+ *
+ * A client opts in by sending FRAME_MAGIC as the first bytes on a new connection, and the server
+ * confirms by echoing it back. Every message after that is a frame: a fixed size header followed by
+ * `length` bytes of payload. Requests carry an id chosen by the client, which the server copies into
+ * the matching response, so a client can send many requests without waiting and match the responses
+ * up as they arrive in any order.
+ *
+ * Clients that start with anything else (such as the menu choice of the legacy text protocol) are
+ * served with the legacy protocol instead.
+ */
+
+#define FRAME_MAGIC "FRM1"
+#define FRAME_MAGIC_SIZE 4
+
+//length (4 bytes), request id (4 bytes), opcode (1 byte), status (1 byte), reserved (2 bytes)
+#define FRAME_HEADER_SIZE 12
+//Largest payload a frame may carry, anything larger is a protocol error
+#define MAX_FRAME_PAYLOAD (2048 - FRAME_HEADER_SIZE)
+
+/**
+ * Operations a request frame can ask for, numbered after the options of the client menu
+ */
+enum frame_opcode {
+    OP_TRANSLATE = 1,   //Payload is an English word
+    OP_CURRENCY = 2,    //Payload is a conversion (INT|CUR|CUR)
+    OP_CANDIDATES = 3,  //No payload
+    OP_VOTE = 4,        //Payload is the encrypted candidate id
+    OP_RESULTS = 5,     //No payload
+    OP_KEY = 6,         //No payload, responds with the key for encrypting candidate ids and how many seconds to keep it (KEY|SECONDS)
+    OP_TRANSLATE_TEXT = 7,  //Payload is a sentence or list of words, translated in one request
+    OP_CONVERT_BATCH = 8,   //Payload is binary, the same as a DG_CONVERT_BATCH datagram (see datagram.h)
+    OP_LEADERS = 9,         //Payload is the number of leading candidates to show, or empty for the default
+    OP_ADD_CANDIDATE = 10,  //Payload is a new candidate (ID|NAME)
+    OP_VOTE_BATCH = 11      //Payload is binary, the same as a DG_VOTE_BATCH datagram (see datagram.h)
+};
+
+/**
+ * Outcome of a request, sent back in the status field of the response frame
+ */
+enum frame_status {
+    FRAME_OK = 0,
+    FRAME_ERROR = 1,
+    FRAME_OVERLOADED = 2    //The request was turned away without being handled, it can be sent again later
+};
+
+struct frame_header {
+    uint32_t length;
+    uint32_t request_id;
+    uint8_t opcode;
+    uint8_t status;
+};
+
+/**
+ * Writes a frame header to the first FRAME_HEADER_SIZE bytes of dest
+ */
+static inline void writeFrameHeader(char *dest, const struct frame_header *header) {
+    uint32_t length = htonl(header->length);
+    uint32_t request_id = htonl(header->request_id);
+
+    memcpy(dest, &length, 4);
+    memcpy(dest + 4, &request_id, 4);
+    dest[8] = header->opcode;
+    dest[9] = header->status;
+    dest[10] = dest[11] = 0;
+}
+
+/**
+ * Reads a frame header from the first FRAME_HEADER_SIZE bytes of src
+ */
+static inline void readFrameHeader(const char *src, struct frame_header *header) {
+    memcpy(&header->length, src, 4);
+    memcpy(&header->request_id, src + 4, 4);
+    header->length = ntohl(header->length);
+    header->request_id = ntohl(header->request_id);
+    header->opcode = src[8];
+    header->status = src[9];
+}
+
+#endif
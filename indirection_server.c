@@ -1,181 +1,2705 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/timerfd.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <stddef.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "datagram.h"
+#include "frame.h"
+#include "response_cache.h"
+#include "service_registry.h"
+#include "shm_ring.h"
+#include "udp_loop.h"
+#include "translate_handler.h"
+#include "currency_handler.h"
 
 #define TRUE 1
 #define FALSE 0
 
-#define MAX_BUFFER_SIZE 2048
+#define MAX_BUFFER_SIZE 2048
+
+#define INDIR_SERVER_ADDR "136.159.5.25"
+#define INDIR_SERVER_PORT 9043
+
+//Replicas of each microservice, see service_registry.h
+#define DEFAULT_SERVICES "services.tsv"
+
+//Max number of ready events handled per epoll_wait() call
+#define MAX_EVENTS 1024
+//Sessions are allocated in slabs of this size and recycled through a free list
+#define SESSION_SLAB_SIZE 256
+//Request ids are made of a pending slot index in the low bits and the slot's reuse count in the high bits
+#define REQUEST_SLOT_BITS 20
+#define MAX_PENDING (1 << REQUEST_SLOT_BITS)
+#define NO_SLOT UINT32_MAX
+//Receive buffer of each microservice channel, large enough to absorb a burst of responses
+#define CHANNEL_RCVBUF_SIZE (4 * 1024 * 1024)
+//Max requests a framed client may have in flight before the server stops reading from it
+#define MAX_SESSION_IN_FLIGHT 256
+//Stop reading from a framed client once this many response bytes are waiting to be written to it
+#define MAX_OUT_BACKLOG (64 * 1024)
+//Seconds the voting server's key is handed out to clients before it is fetched again
+#define DEFAULT_KEY_LIFETIME 60
+//Responses each worker caches, and the bytes of requests and responses it holds per entry on average
+#define DEFAULT_CACHE_ENTRIES 65536
+#define CACHE_ENTRY_BYTES 256
+//Seconds cached translations and conversions are served for
+#define DEFAULT_TRANSLATE_TTL 300
+#define DEFAULT_CURRENCY_TTL 60
+//Milliseconds between checks for new rates while conversions are served from the cache
+#define RATES_CHECK_INTERVAL 1000
+//Seconds between two reports of the cache hit rate
+#define CACHE_STATS_INTERVAL 5
+//Milliseconds a microservice has to answer a request before the client is told it is unavailable
+#define DEFAULT_TRANSLATE_DEADLINE 1000
+#define DEFAULT_CURRENCY_DEADLINE 1000
+#define DEFAULT_VOTING_DEADLINE 3000
+//Times a request that can safely be handled twice is sent again while its response is late
+#define DEFAULT_RETRIES 2
+//Microseconds before a request is hedged while the latency of its microservice is unknown, and the least it is hedged after
+#define INITIAL_HEDGE_DELAY 20000
+#define MIN_HEDGE_DELAY 500
+//Latencies are counted in buckets a quarter of a power of 2 apart, up to 2^24 microseconds
+#define LATENCY_BUCKETS 96
+//Responses counted before the percentiles are worked out again and the older latencies fade out
+#define LATENCY_WINDOW 512
+//Milliseconds between health checks of the replicas, and health checks a replica can miss in a row before it is ejected
+#define HEALTH_CHECK_INTERVAL 500
+#define MAX_MISSED_CHECKS 3
+//Requests each worker lets wait on one replica at first, and the range its adaptive limit stays in
+#define INITIAL_CONCURRENCY 256
+#define MIN_CONCURRENCY 8
+#define MAX_CONCURRENCY 8192
+//Responses are not taken as a sign of queueing unless they are this many times slower than the fastest recent
+//one, plus a tenth of the deadline to ride out scheduling noise
+#define LATENCY_TOLERANCE 2
+//Responses the limit is adjusted after, responses after which the fastest one is looked for again, and how
+//far each adjustment moves the limit
+#define LIMIT_SAMPLES 32
+#define LIMIT_WINDOW 1024
+#define LIMIT_SMOOTHING 0.2
+//Failed requests in a row that open the circuit breaker of a replica, and microseconds before it is tried again
+#define BREAKER_FAILURES 5
+#define BREAKER_COOLDOWN 1000000
+//Requests of each class of each microservice that can wait to be sent, beyond which new ones are turned away
+#define QUEUE_CAPACITY 4096
+//Requests each worker sends per turn of its event loop, shared out between the microservices by their shares
+#define DISPATCH_BUDGET 256
+#define DEFAULT_SHARE 1
+//Requests per second each client connection can send before its requests only go out when no one else is waiting
+#define DEFAULT_CLIENT_RATE 1000
+
+/**
+ * Kinds of file descriptors registered with the event loop
+ */
+enum handle_kind {
+    HANDLE_LISTENER,
+    HANDLE_CLIENT,
+    HANDLE_CHANNEL,
+    HANDLE_TIMER,
+    HANDLE_HEALTH,
+    HANDLE_RING
+};
+
+/**
+ * Microservices the indirection server forwards requests to
+ */
+enum service {
+    SERVICE_TRANSLATE,
+    SERVICE_CURRENCY,
+    SERVICE_VOTING,
+    NUM_SERVICES
+};
+
+/**
+ * States of the circuit breaker of a replica
+ */
+enum breaker_state {
+    BREAKER_CLOSED,     //Requests are sent as long as the replica is under its concurrency limit
+    BREAKER_OPEN,       //The replica keeps failing, nothing is sent to it until the cooldown is over
+    BREAKER_HALF_OPEN   //One trial request is out, its outcome closes the breaker or opens it again
+};
+
+/**
+ * Classes of requests waiting to be sent to a microservice, a class is only sent from once the ones before it are empty
+ */
+enum queue_class {
+    CLASS_WITHIN_RATE,  //Requests of clients within their rate
+    CLASS_OVER_RATE,    //Requests of clients that ran out of tokens
+    NUM_CLASSES
+};
+
+/**
+ * Protocols a client session can speak
+ */
+enum session_mode {
+    MODE_NEGOTIATE, //Nothing has been received yet
+    MODE_LEGACY,    //Text protocol where every recv() is taken to be one message
+    MODE_FRAMED     //Length prefixed frames, see frame.h
+};
+
+/**
+ * States a legacy client session moves through while one of its requests is being proxied
+ */
+enum session_state {
+    STATE_CHOICE,   //Waiting for the menu choice from the client
+    STATE_INPUT,    //Waiting for the extra input sent along with choices 1 and 2
+    STATE_KEY,      //Waiting for the voting server to hand out the encryption key
+    STATE_VOTE_ID,  //Waiting for the encrypted candidate id from the client
+    STATE_BACKEND   //Waiting for the microservice response
+};
+
+struct session;
+
+/**
+ * Registered with epoll as the event data so that each event can be routed to its owner
+ */
+struct handle {
+    int kind;
+    struct session *session;
+    int service;
+};
+
+/**
+ * All the state needed to serve one connected client without blocking the event loop
+ */
+struct session {
+    struct handle client_handle;
+    int client_fd;
+    //Events currently registered with epoll for the client socket
+    uint32_t events;
+    int mode;
+    int state;
+    int choice;
+    //Head of the list of pending slots this session is waiting on
+    uint32_t requests;
+    int in_flight;
+    //For the legacy protocol this is the last message received from the client
+    //For the framed protocol it holds received bytes that are not yet a complete frame
+    char buffer[MAX_BUFFER_SIZE];
+    int in_len;
+    //Response bytes that could not be written to the client yet
+    char *out;
+    int out_len, out_off, out_cap;
+    int closed;
+    struct session *next_free;
+    //Token bucket of the client: requests it can still send at its rate, and the monotonic time in microseconds it was last refilled
+    double tokens;
+    int64_t refilled;
+};
+
+/**
+ * Ways of pinning worker threads to cpus
+ */
+enum affinity_mode {
+    AFFINITY_NONE,
+    AFFINITY_CPU,
+    AFFINITY_NUMA
+};
+
+/**
+ * Settings given on the command line
+ */
+struct server_config {
+    int workers;
+    int backlog;
+    int affinity;
+    int key_lifetime;
+    int cache_entries;
+    //Seconds the responses of each microservice are cached for, 0 if they are not cached
+    int ttls[NUM_SERVICES];
+    //Milliseconds each microservice has to answer
+    int deadlines[NUM_SERVICES];
+    int retries;
+    const char *services;
+    //Weight of each microservice when requests are waiting to be sent
+    int shares[NUM_SERVICES];
+    //Requests per second a client connection is given, 0 if clients are not rate limited
+    int client_rate;
+    //File each microservice handled in process loads its data from, NULL for those reached over UDP
+    const char *local_paths[NUM_SERVICES];
+};
+
+/**
+ * A thread running its own event loop on its own listening socket
+ */
+struct worker {
+    int id;
+    pthread_t thread;
+};
+
+/**
+ * A long-lived UDP socket connected to one replica of a microservice, shared by all sessions of a worker
+ * A replica on the same machine can be reached through a shared memory ring instead, and fd is then the eventfd
+ * the replica writes to when a response arrives while the ring sleeps
+ * The handle comes first, so the handle registered with epoll is also the channel
+ */
+struct channel {
+    struct handle handle;
+    int fd;
+    //Id of the channel within its worker, never reused so a request can tell if its replica was removed
+    uint32_t id;
+    struct replica_address address;
+    //Where the replica is, as printed in messages about it
+    char name[MAX_RING_NAME + 8];
+    //Only used if address.ring is set, along with the handle of the ring's socket, which is readable when the
+    //replica answers the handshake or stops serving the ring
+    struct ring_link ring;
+    struct handle ring_handle;
+    //Requests whose last copy was sent to the replica and that are not answered yet
+    int outstanding;
+    //Health checks sent since the replica last answered anything
+    int missed;
+    //The replica stopped answering health checks and is not picked while others are healthy
+    int ejected;
+    //Generation of the rates the replica last converted with, only used for the currency server
+    uint32_t rates_generation;
+    //Most requests that can be outstanding on the replica, adjusted by updateLimit()
+    double limit;
+    //Fastest response lately in microseconds, taken as the latency of the replica when nothing queues,
+    //and the fastest of the current window of responses, which replaces it at the end of the window
+    int64_t min_latency, window_min;
+    int window_samples;
+    //Latencies of the responses since the limit was last adjusted
+    int64_t latency_sum;
+    int latency_samples;
+    int breaker;
+    //Requests in a row that timed out or were refused, and the monotonic time in microseconds the breaker can be tried at
+    int failures;
+    int64_t open_until;
+};
+
+/**
+ * A microservice whose request handler is linked into the indirection server, so it can be handled in process
+ */
+struct local_service {
+    //File the handler loads its data from when -i does not name one
+    const char *default_path;
+    //Returns the context of the handler, or NULL if its data could not be loaded
+    void *(*load)(const char *path);
+    request_handler handler;
+};
+
+/**
+ * The voting server's encryption key, as last fetched by a worker
+ * Clients are given the key from here, so asking for it does not cost a round trip to the voting server
+ */
+struct vote_key {
+    uint32_t key;
+    //Monotonic time in seconds at which the key has to be fetched again, 0 if there is no key yet
+    time_t expires;
+};
+
+/**
+ * A slot in the table of requests waiting on a microservice response
+ */
+struct pending {
+    //Id of the request waiting in this slot, 0 if the slot is free
+    uint32_t id;
+    uint32_t generation;
+    struct session *session;
+    //Id the client gave the request and the operation it asked for, needed to frame the response
+    uint32_t client_id;
+    int opcode;
+    //Cache entry the response is stored in, NO_TICKET if it is not cached
+    uint64_t cache_ticket;
+    //Changes to the votes acknowledged when the request was made, see vote_writes
+    unsigned long writes;
+    //Links the slot into the free list, or into the list of requests of its session
+    uint32_t next, prev;
+    //Slot of the identical request this one waits on instead of being sent, NO_SLOT if it was sent itself
+    uint32_t leader;
+    //Head of the list of requests waiting on this one, linked through next_follower and prev_follower
+    uint32_t followers;
+    uint32_t next_follower, prev_follower;
+    //Monotonic times in microseconds the request was first and last sent, and fails at
+    int64_t first_sent, last_sent, deadline;
+    //Time of the timer currently set for the request, 0 if it has none
+    int64_t due;
+    //Copy of the datagram to send again if the response is late, NULL if the request is never sent again
+    char *datagram;
+    int datagram_length;
+    //Microseconds to wait for the response before sending the request again, and times it was sent again
+    int64_t resend_delay;
+    int resends;
+    int service;
+    //Id of the channel the request was last sent over, 0 if it was not sent itself
+    uint32_t replica;
+    //The request is waiting in the queue of its microservice to be sent
+    int queued;
+};
+
+/**
+ * Ring of the ids of requests waiting to be sent
+ * Requests that are answered or leave while they wait are not taken out, their ids are skipped once they come up
+ */
+struct request_queue {
+    uint32_t *ids;
+    uint32_t head, count;
+};
+
+/**
+ * A point in time a pending request has to be looked at again
+ * Timers are not removed when their request is answered, they are skipped once they are due
+ */
+struct timer {
+    int64_t due;
+    uint32_t request_id;
+};
+
+/**
+ * Recent latencies of a microservice and what became of the requests sent to it
+ */
+struct latency_stats {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t samples;
+    //Latencies in microseconds at the 95th and 99th percentiles, 0 until they have been worked out
+    int64_t p95, p99;
+    unsigned long responses, hedges, retries, timeouts;
+    //Requests turned away because the queue was full, they waited until their deadline or every breaker was open
+    unsigned long shed;
+    //Requests of clients that were over their rate
+    unsigned long throttled;
+};
+
+static struct server_config config;
+//Changes to the votes acknowledged by every worker so far
+//A request for results made before a vote was acknowledged may have missed it, so nobody that saw the acknowledgment waits on it
+static unsigned long vote_writes = 0;
+
+//Each worker owns its event loop and sessions, so none of this is shared between threads
+static __thread int epoll_fd;
+//Descriptor held in reserve, given up to accept and close a connection once the worker runs out of descriptors
+static __thread int spare_fd = -1;
+static __thread struct session *free_sessions = NULL;
+//Sessions closed during the current batch of events, recycled once the batch is done
+static __thread struct session *closed_sessions = NULL;
+static __thread long open_sessions = 0;
+static __thread struct channel channels[NUM_SERVICES][MAX_REPLICAS];
+static __thread int replica_counts[NUM_SERVICES];
+//Version of the registry the channels were opened from
+static __thread unsigned long channels_version = 0;
+static __thread uint32_t next_channel_id = 1;
+//Timer file descriptor that wakes the event loop for the health checks
+static __thread int health_fd;
+static __thread unsigned int random_seed;
+static __thread struct pending *pending = NULL;
+static __thread uint32_t pending_size = 0;
+static __thread uint32_t pending_free = NO_SLOT;
+static __thread struct vote_key vote_key;
+//Translations and conversions answered recently, each worker caches the responses of its own sessions
+static __thread struct response_cache cache;
+//When the currency servers were last asked which rates they convert with
+static __thread int64_t rates_checked = -1;
+//Requests that waited on an identical request in flight instead of being sent
+static __thread unsigned long coalesced = 0;
+//Cache counters at the last report
+static __thread struct cache_stats reported;
+static __thread unsigned long reported_coalesced;
+static __thread int64_t reported_at;
+//Min heap of the timers of pending requests, and the timer file descriptor that wakes the event loop for the first one
+static __thread struct timer *timers = NULL;
+static __thread uint32_t timer_count = 0, timer_capacity = 0;
+static __thread int timer_fd;
+static __thread int64_t timer_armed = 0;
+static __thread struct latency_stats latencies[NUM_SERVICES];
+static __thread struct latency_stats reported_latencies[NUM_SERVICES];
+//Requests waiting to be sent to each microservice, by class
+static __thread struct request_queue queues[NUM_SERVICES][NUM_CLASSES];
+//The last turn of the event loop used up its dispatch budget, so it comes round again without waiting for events
+static __thread int dispatch_waiting = FALSE;
+//Generation of the rates the currency handler last converted with in process
+static __thread uint32_t local_rates_generation = 0;
+static struct handle listener_handle = {HANDLE_LISTENER, NULL, -1};
+static struct handle timer_handle = {HANDLE_TIMER, NULL, -1};
+static struct handle health_handle = {HANDLE_HEALTH, NULL, -1};
+static const char *service_names[NUM_SERVICES] = {"translate", "currency", "voting"};
+//Handlers of the microservices that can be handled in process
+//The voting server is always reached over UDP, its log and counters have to stay in the one process that owns them
+static const struct local_service local_services[NUM_SERVICES] = {
+    {"dictionary.tsv", loadTranslator, handleTranslate},
+    {"rates.tsv", loadConverter, handleConvert},
+    {NULL, NULL, NULL}
+};
+//Context of the handler of each microservice handled in process, NULL for those reached over UDP
+static void *local_contexts[NUM_SERVICES];
+//Sent back for a request that was turned away without being sent, clients of the framed protocol get FRAME_OVERLOADED with it
+static const char overloaded_message[] = "The microservice is overloaded, please try again later.";
+
+/**
+ * Check whether a function has returned an error code and exit the program if necessary
+ * Prints the relevant error to the console
+ */
+int check(int status, char *function_name, int can_exit) {
+    if (status < 0) {
+        fprintf(stderr, "[ERROR]: %s() call has failed!\n", function_name);
+        perror(function_name);
+        if (can_exit) {
+            exit(1);
+        }
+    }
+    return status;
+}
+
+/**
+ * Prints a string buffer and its size in bytes to the console for testing
+ */
+void printBuffer(const char *sender, const char *buffer, int bytes) {
+    printf("%s: %s (%ld bytes)\n", sender, buffer, bytes);
+}
+
+/**
+ * Raises the open file limit as far as the hard limit allows
+ * Every connected client costs one descriptor
+ */
+void raiseFileLimit() {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        check(setrlimit(RLIMIT_NOFILE, &limit), "setrlimit", FALSE);
+    }
+}
+
+/**
+ * Returns the current monotonic time in seconds
+ */
+time_t monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+/**
+ * Returns the current monotonic time in milliseconds
+ */
+int64_t monotonicMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Returns the current monotonic time in microseconds
+ */
+int64_t monotonicMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+/**
+ * Keeps a key just handed out by the voting server for the next key_lifetime seconds
+ */
+void cacheKey(uint32_t key) {
+    vote_key.key = key;
+    vote_key.expires = monotonicSeconds() + config.key_lifetime;
+}
+
+/**
+ * Writes the cached key as the text sent to clients, "key|seconds", where seconds is how much longer a
+ * client can keep using the key before asking for it again
+ * Returns the length of the text, or -1 if there is no key or it has expired
+ */
+int sprintKey(char *text) {
+    time_t left = vote_key.expires - monotonicSeconds();
+
+    //With a lifetime of 0 the key is never served from here
+    if (vote_key.expires == 0 || left <= 0) return -1;
+
+    return sprintf(text, "%u|%ld", vote_key.key, (long) left);
+}
+
+/**
+ * Returns the microservice that serves a given opcode, or -1 if no microservice handles it
+ */
+int serviceForOpcode(int opcode) {
+    if (opcode == OP_TRANSLATE || opcode == OP_TRANSLATE_TEXT) {
+        return SERVICE_TRANSLATE;
+    } else if (opcode == OP_CURRENCY || opcode == OP_CONVERT_BATCH) {
+        return SERVICE_CURRENCY;
+    } else if ((opcode >= OP_CANDIDATES && opcode <= OP_KEY) || opcode == OP_LEADERS || opcode == OP_ADD_CANDIDATE ||
+            opcode == OP_VOTE_BATCH) {
+        return SERVICE_VOTING;
+    }
+    return -1;
+}
+
+/**
+ * Returns TRUE if the response to an opcode only depends on the request, so it can be cached
+ * Voting requests are never cached, their responses change with every vote
+ */
+int isCacheable(int opcode) {
+    return opcode == OP_TRANSLATE || opcode == OP_TRANSLATE_TEXT || opcode == OP_CURRENCY;
+}
+
+/**
+ * Returns TRUE if a request does not change anything, so identical requests in flight at the same time can share one response
+ */
+int isReadOnly(int opcode) {
+    return isCacheable(opcode) || opcode == OP_CANDIDATES || opcode == OP_RESULTS || opcode == OP_LEADERS;
+}
+
+/**
+ * Returns TRUE if a request can be handled twice with the same outcome, so it can be sent again when its response is late
+ */
+int isIdempotent(int opcode) {
+    return isReadOnly(opcode) || opcode == OP_KEY || opcode == OP_CONVERT_BATCH;
+}
+
+/**
+ * Writes the cache key of a request, its opcode followed by the text the client sent
+ * Returns the length of the key, or -1 if the request is neither cached nor shared
+ *
+ * @param key: buffer of MAX_DATAGRAM_SIZE bytes
+ */
+int requestKey(int opcode, const char *text, int len, char *key) {
+    if (!isReadOnly(opcode) || len + 1 > MAX_DATAGRAM_SIZE) return -1;
+
+    key[0] = opcode;
+    memcpy(key + 1, text, len);
+
+    return len + 1;
+}
+
+/**
+ * Returns TRUE if a string holds a single word with no spaces or punctuation around it
+ */
+int isSingleWord(const char *text, int len) {
+    for (int i = 0; i < len; i++) {
+        if (!isalnum((unsigned char) text[i]) && (unsigned char) text[i] < 0x80) return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Splits a string into an array of strings about a given delimitor
+ * Eg. "a|b|c" split about '|' becomes 3 separate strings a, b, c
+ * Returns the number of strings, or -1 if there are more than 5 or one is longer than 9 characters
+ * 
+ * @param source:      the string to split, not NUL terminated
+ * @param len:         length of source
+ * @param dest:        array to hold the split strings
+ * @param delim:       the delimitor character
+ */
+int split(const char *source, int len, char dest[5][10], char delim) {
+	int j = 0, n = 0;
+
+	for (int i = 0; i <= len; i++) {
+        //Keep iterating until we find an occurrence of delim or the end of the string
+		if (i < len && source[i] != delim) {
+			if (j == 9) return -1;
+			dest[n][j++] = source[i];
+		} else {
+            //We found a delim character, so insert the string into dest
+			if (n == 5) return -1;
+			dest[n++][j] = '\0';
+            //Reset counter
+			j = 0;
+		}
+	}
+	return n;
+}
+
+/**
+ * Converts the text a client sent with a request into the typed payload the microservice expects
+ * Returns -1 if the text is not valid input for the request
+ *
+ * @param opcode:  operation the client asked for
+ * @param text:    text sent by the client, not NUL terminated
+ * @param len:     length of text
+ * @param header:  header of the datagram, the opcode and length are filled in
+ * @param payload: buffer of MAX_DATAGRAM_PAYLOAD bytes for the payload
+ */
+int encodeRequest(int opcode, const char *text, int len, struct datagram_header *header, char *payload) {
+    char input[5][10];
+
+    header->length = 0;
+
+    if (opcode == OP_TRANSLATE || opcode == OP_TRANSLATE_TEXT) {
+        //The word or text is sent as it is
+        if (len > MAX_DATAGRAM_PAYLOAD) return -1;
+        header->opcode = opcode == OP_TRANSLATE ? DG_TRANSLATE : DG_TRANSLATE_TEXT;
+        header->length = len;
+        memcpy(payload, text, len);
+    } else if (opcode == OP_CURRENCY) {
+        //Split the conversion string about the '|' char into the amount, source and dest
+        struct convert_request request;
+
+        if (split(text, len, input, '|') != 3) return -1;
+        request.amount = atoi(input[0]);
+        request.source = packCurrency(input[1], strlen(input[1]));
+        request.dest = packCurrency(input[2], strlen(input[2]));
+
+        if (request.source == 0 || request.dest == 0) return -1;
+        header->opcode = DG_CONVERT;
+        header->length = CONVERT_REQUEST_SIZE;
+        writeConvertRequest(payload, &request);
+    } else if (opcode == OP_CONVERT_BATCH) {
+        //Batches are already binary, so they only need checking
+        if (len > MAX_DATAGRAM_PAYLOAD || len % CONVERT_BATCH_ENTRY_SIZE != 0) return -1;
+        header->opcode = DG_CONVERT_BATCH;
+        header->length = len;
+        memcpy(payload, text, len);
+    } else if (opcode == OP_VOTE_BATCH) {
+        //Batches are already binary, so they only need checking
+        if (len > MAX_DATAGRAM_PAYLOAD || len % VOTE_BATCH_ENTRY_SIZE != 0) return -1;
+        header->opcode = DG_VOTE_BATCH;
+        header->length = len;
+        memcpy(payload, text, len);
+    } else if (opcode == OP_VOTE) {
+        //The encrypted id is sent as an integer
+        if (split(text, len, input, '\0') != 1) return -1;
+        header->opcode = DG_VOTE;
+        header->length = 4;
+        putU32(payload, (uint32_t) atoi(input[0]));
+    } else if (opcode == OP_CANDIDATES) {
+        header->opcode = DG_CANDIDATES;
+    } else if (opcode == OP_RESULTS) {
+        header->opcode = DG_RESULTS;
+    } else if (opcode == OP_KEY) {
+        header->opcode = DG_KEY;
+    } else if (opcode == OP_LEADERS) {
+        //The number of leaders is optional, the voting server picks a default without it
+        header->opcode = DG_LEADERS;
+        if (len > 0) {
+            if (split(text, len, input, '\0') != 1 || atoi(input[0]) <= 0) return -1;
+            header->length = 4;
+            putU32(payload, (uint32_t) atoi(input[0]));
+        }
+    } else if (opcode == OP_ADD_CANDIDATE) {
+        //Split the candidate about the first '|' char into the id and the name, names are too long for split()
+        const char *bar = memchr(text, '|', len);
+        if (bar == NULL || bar == text || len - (bar + 1 - text) + 4 > MAX_DATAGRAM_PAYLOAD) return -1;
+
+        header->opcode = DG_ADD_CANDIDATE;
+        header->length = 4 + len - (bar + 1 - text);
+        putU32(payload, (uint32_t) strtoul(text, NULL, 10));
+        memcpy(payload + 4, bar + 1, len - (bar + 1 - text));
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Converts a microservice response into the text sent back to the client
+ * Returns the length of the text
+ */
+int decodeResponse(const struct datagram_header *header, const char *payload, char *text) {
+    if (header->status == DG_OK && header->opcode == DG_CONVERT && header->length >= 8) {
+        //The converted amount comes back as a whole number of hundredths
+        uint64_t hundredths = getU64(payload);
+        return sprintf(text, "%llu.%02llu", (unsigned long long) (hundredths / 100), (unsigned long long) (hundredths % 100));
+    } else if (header->status == DG_OK && header->opcode == DG_KEY && header->length == 4) {
+        //Tell the client how long it can keep using the key
+        return sprintf(text, "%u|%d", getU32(payload), config.key_lifetime);
+    }
+    //Everything else is text, except batch results which are passed on to the client as they are
+    memcpy(text, payload, header->length);
+    text[header->length] = '\0';
+
+    return header->length;
+}
+
+/**
+ * Starts attaching a channel to the ring of its replica, the handshake is finished by settleRing()
+ * Nothing is sent over the ring until then
+ */
+void connectChannelRing(struct channel *channel) {
+    struct epoll_event event;
+
+    if (connectRing(channel->address.ring, channel->fd, &channel->ring) < 0) return;
+
+    event.events = EPOLLIN;
+    event.data.ptr = &channel->ring_handle;
+    if (check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, channel->ring.socket_fd, &event), "epoll_ctl", FALSE) < 0) detachRing(&channel->ring);
+}
+
+/**
+ * Handles the socket of a ring channel becoming readable: the replica answered the handshake, or it stopped
+ * serving the ring. A replica is ejected until it is attached, and as soon as it leaves.
+ */
+void settleRing(struct channel *channel) {
+    const char *service = service_names[channel->handle.service];
+
+    if (channel->ring.segment == NULL) {
+        if (finishRing(&channel->ring) != 0) return;
+
+        channel->missed = 0;
+        channel->ejected = FALSE;
+        printf("[%s]: Replica %s is attached\n", service, channel->name);
+        fflush(stdout);
+        return;
+    }
+    //Requests still in the ring are answered by their deadline, or by another replica if they are sent again
+    detachRing(&channel->ring);
+    channel->missed = MAX_MISSED_CHECKS;
+    channel->ejected = TRUE;
+    printf("[%s]: Replica %s stopped serving its ring and is ejected\n", service, channel->name);
+    fflush(stdout);
+}
+
+/**
+ * Opens a channel to a ring served by a replica on the same machine, see shm_ring.h
+ * The channel is ejected until the replica answers the handshake, which checkHealth() starts again if it does
+ * not serve the ring yet
+ * Returns -1 if the eventfd could not be made
+ */
+int openRingChannel(struct channel *channel) {
+    struct epoll_event event;
+
+    channel->ring.socket_fd = -1;
+    channel->ring.service_fd = -1;
+    channel->ring_handle.kind = HANDLE_RING;
+    channel->ring_handle.session = NULL;
+    channel->ring_handle.service = channel->handle.service;
+    channel->missed = MAX_MISSED_CHECKS;
+    channel->ejected = TRUE;
+
+    if (check((channel->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), "eventfd", FALSE) < 0) return -1;
+
+    event.events = EPOLLIN;
+    event.data.ptr = &channel->handle;
+
+    if (check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, channel->fd, &event), "epoll_ctl", FALSE) < 0) {
+        close(channel->fd);
+        return -1;
+    }
+    connectChannelRing(channel);
+    return 0;
+}
+
+/**
+ * Opens a UDP socket to a replica of a microservice and registers it with the event loop of the calling worker
+ * The socket is connected, so the kernel only delivers datagrams coming from that replica
+ * Returns -1 if the socket could not be opened
+ */
+int openChannel(struct channel *channel, int service, const struct replica_address *address) {
+    //Specify microservice server info
+    struct sockaddr_in micro;
+    memset(&micro, 0, sizeof(micro));
+    micro.sin_family = AF_INET;
+    micro.sin_port = htons(address->port);
+    micro.sin_addr.s_addr = inet_addr(address->host);
+
+    memset(channel, 0, sizeof(*channel));
+    channel->handle.kind = HANDLE_CHANNEL;
+    channel->handle.session = NULL;
+    channel->handle.service = service;
+    channel->id = next_channel_id++;
+    channel->address = *address;
+    channel->limit = INITIAL_CONCURRENCY;
+    channel->breaker = BREAKER_CLOSED;
+
+    if (address->ring[0] != '\0') {
+        snprintf(channel->name, sizeof(channel->name), "ring %s", address->ring);
+        return openRingChannel(channel);
+    }
+    snprintf(channel->name, sizeof(channel->name), "%s:%d", address->host, address->port);
+
+    if (check((channel->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP)), "socket", FALSE) < 0) return -1;
+    check(setsockopt(channel->fd, SOL_SOCKET, SO_RCVBUF, &(int){CHANNEL_RCVBUF_SIZE}, sizeof(int)), "setsockopt", FALSE);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &channel->handle;
+
+    if (check(connect(channel->fd, (struct sockaddr *) &micro, sizeof(micro)), "connect", FALSE) < 0 ||
+            check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, channel->fd, &event), "epoll_ctl", FALSE) < 0) {
+        close(channel->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Closes the channel of a replica that was removed
+ */
+void closeChannel(struct channel *channel) {
+    if (channel->address.ring[0] != '\0') detachRing(&channel->ring);
+    close(channel->fd);
+}
+
+/**
+ * Sends a datagram to a replica over its channel
+ * Returns -1 with errno set if it could not be sent
+ */
+int sendDatagram(struct channel *channel, const char *datagram, int length) {
+    if (channel->address.ring[0] != '\0') return sendRing(&channel->ring, datagram, length);
+    return send(channel->fd, datagram, length, 0);
+}
+
+/**
+ * Receives the next datagram waiting on a channel
+ * Returns -1 with errno set to EAGAIN if there is none
+ *
+ * @param datagram: buffer of MAX_DATAGRAM_SIZE bytes
+ */
+int receiveDatagram(struct channel *channel, char *datagram) {
+    if (channel->address.ring[0] != '\0') return receiveRing(&channel->ring, datagram);
+    return recv(channel->fd, datagram, MAX_DATAGRAM_SIZE, 0);
+}
+
+/**
+ * Opens a channel to every replica in the registry, the first time it is called and whenever the registry is reloaded
+ * Replicas that are still listed keep their channel, along with its health and outstanding requests, and the
+ * channels of replicas that were removed are closed. Requests still waiting on a removed replica are answered
+ * by their deadline, or by another replica if they are sent again.
+ * Only called between batches of events, since channels move in the table and epoll is given their new place
+ * Microservices handled in process get no channels
+ */
+void syncChannels() {
+    struct service_registry registry;
+
+    if (registryVersion() == channels_version) return;
+    channels_version = copyRegistry(&registry);
+
+    for (int i = 0; i < NUM_SERVICES; i++) {
+        struct channel old[MAX_REPLICAS];
+        int old_count = replica_counts[i], count = 0;
+
+        //Replicas of a microservice handled in process are never sent anything
+        if (local_contexts[i] != NULL) continue;
+
+        memcpy(old, channels[i], old_count * sizeof(struct channel));
+
+        for (int r = 0; r < registry.counts[i]; r++) {
+            const struct replica_address *address = &registry.replicas[i][r];
+            struct channel *channel = &channels[i][count];
+            int kept = -1;
+
+            for (int k = 0; k < old_count && kept < 0; k++) {
+                if (old[k].fd >= 0 && old[k].address.port == address->port && strcmp(old[k].address.host, address->host) == 0 &&
+                        strcmp(old[k].address.ring, address->ring) == 0) kept = k;
+            }
+            if (kept >= 0) {
+                struct epoll_event event;
+
+                *channel = old[kept];
+                old[kept].fd = -1;
+                event.events = EPOLLIN;
+                event.data.ptr = &channel->handle;
+                check(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, channel->fd, &event), "epoll_ctl", FALSE);
+                if (channel->address.ring[0] != '\0' && channel->ring.socket_fd >= 0) {
+                    event.data.ptr = &channel->ring_handle;
+                    check(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, channel->ring.socket_fd, &event), "epoll_ctl", FALSE);
+                }
+                count++;
+            } else if (openChannel(channel, i, address) == 0) {
+                count++;
+            }
+        }
+        for (int k = 0; k < old_count; k++) {
+            if (old[k].fd >= 0) closeChannel(&old[k]);
+        }
+        replica_counts[i] = count;
+    }
+}
+
+/**
+ * Returns the channel of a microservice with the given id, or NULL if its replica was removed
+ */
+struct channel *findChannel(int service, uint32_t id) {
+    for (int i = 0; i < replica_counts[service]; i++) {
+        if (channels[service][i].id == id) return &channels[service][i];
+    }
+    return NULL;
+}
+
+/**
+ * Returns TRUE if a replica takes another request: it is under its concurrency limit, or its breaker is due a trial
+ */
+int isAdmitting(const struct channel *channel, int64_t now) {
+    if (channel->breaker != BREAKER_CLOSED) return now >= channel->open_until;
+
+    return channel->outstanding < (int) channel->limit;
+}
+
+/**
+ * Picks the replica of a microservice to send a request to, with the power of two choices: of two healthy
+ * replicas picked at random, the one with fewer outstanding requests. This spreads the load about as well as
+ * always taking the least loaded replica, without every worker piling onto the same one.
+ * Ejected replicas are only picked when no replica is healthy, so a request still has somewhere to go, but
+ * replicas at their concurrency limit or with their breaker open are never picked.
+ * Returns NULL if no replica takes the request
+ *
+ * @param avoid: id of a channel not to pick unless it is the only one, such as the one a late request was sent over
+ */
+struct channel *pickReplica(int service, uint32_t avoid) {
+    int candidates[MAX_REPLICAS], count = 0;
+    int64_t now = monotonicMicros();
+
+    for (int pass = 0; pass < 3 && count == 0; pass++) {
+        //Healthy replicas first, then any other replica, then the one to avoid
+        for (int i = 0; i < replica_counts[service]; i++) {
+            const struct channel *channel = &channels[service][i];
+
+            if (!isAdmitting(channel, now)) continue;
+            if ((pass == 0 && !channel->ejected && channel->id != avoid) || (pass == 1 && channel->id != avoid) || pass == 2) {
+                candidates[count++] = i;
+            }
+        }
+    }
+    if (count == 0) return NULL;
+    if (count == 1) return &channels[service][candidates[0]];
+
+    int a = rand_r(&random_seed) % count, b = rand_r(&random_seed) % (count - 1);
+    struct channel *first = &channels[service][candidates[a]];
+    struct channel *second = &channels[service][candidates[b < a ? b : b + 1]];
+
+    return second->outstanding < first->outstanding ? second : first;
+}
+
+/**
+ * Counts a request against the replica it was just sent to, rather than the one it was sent to before
+ */
+void countReplica(struct pending *p, struct channel *channel) {
+    struct channel *previous = p->replica == 0 ? NULL : findChannel(p->service, p->replica);
+
+    if (previous != NULL) previous->outstanding--;
+    channel->outstanding++;
+    p->replica = channel->id;
+
+    //A replica whose breaker is not closed only gets this one trial until it answers or the cooldown is over again
+    if (channel->breaker != BREAKER_CLOSED) {
+        channel->breaker = BREAKER_HALF_OPEN;
+        channel->open_until = monotonicMicros() + BREAKER_COOLDOWN;
+    }
+}
+
+/**
+ * Adjusts the concurrency limit of a replica to the latency of its responses, following the gradient algorithm
+ * Responses much slower than the fastest recent one mean requests are queueing at the replica, and the limit
+ * shrinks in proportion. While responses are about as fast, the limit grows as long as at least half of it is used.
+ * The limit moves once every LIMIT_SAMPLES responses, by their average latency, so a single slow burst does not
+ * shut the replica out.
+ *
+ * @param latency: microseconds the response took since the request was last sent to the replica
+ */
+void updateLimit(struct channel *channel, int64_t latency) {
+    if (channel->window_samples == 0 || latency < channel->window_min) channel->window_min = latency;
+    if (channel->min_latency == 0 || latency < channel->min_latency) channel->min_latency = latency;
+    //Start over from the current window now and then, so a replica that got slower for good is not held to its old latency
+    if (++channel->window_samples == LIMIT_WINDOW) {
+        channel->min_latency = channel->window_min;
+        channel->window_samples = 0;
+    }
+    channel->latency_sum += latency;
+    if (++channel->latency_samples < LIMIT_SAMPLES) return;
+
+    int64_t average = channel->latency_sum / channel->latency_samples;
+    int64_t slack = config.deadlines[channel->handle.service] * 100LL;
+    double gradient = (double) (channel->min_latency * LATENCY_TOLERANCE + slack) / (average > 0 ? average : 1);
+
+    channel->latency_sum = 0;
+    channel->latency_samples = 0;
+    if (gradient > 1) gradient = 1;
+    if (gradient < 0.5) gradient = 0.5;
+    if (gradient == 1 && channel->outstanding < channel->limit / 2) return;
+
+    //Leave room for a few requests to queue, so the limit can grow while there is no queueing
+    double target = channel->limit * gradient + channel->limit / 8 + 1;
+
+    channel->limit = channel->limit * (1 - LIMIT_SMOOTHING) + target * LIMIT_SMOOTHING;
+    if (channel->limit < MIN_CONCURRENCY) channel->limit = MIN_CONCURRENCY;
+    if (channel->limit > MAX_CONCURRENCY) channel->limit = MAX_CONCURRENCY;
+}
+
+/**
+ * Counts a request to a replica that timed out or was refused, opening its breaker after BREAKER_FAILURES in a row
+ * or if the failed request was its trial
+ */
+void noteFailure(struct channel *channel) {
+    channel->failures++;
+
+    if (channel->breaker == BREAKER_HALF_OPEN || (channel->breaker == BREAKER_CLOSED && channel->failures >= BREAKER_FAILURES)) {
+        if (channel->breaker == BREAKER_CLOSED) {
+            printf("[%s]: Replica %s failed %d requests in a row, its circuit breaker is open\n",
+                service_names[channel->handle.service], channel->name, channel->failures);
+            fflush(stdout);
+        }
+        channel->breaker = BREAKER_OPEN;
+        channel->open_until = monotonicMicros() + BREAKER_COOLDOWN;
+    }
+}
+
+/**
+ * Counts a datagram a replica answered, which closes its breaker
+ */
+void noteSuccess(struct channel *channel) {
+    if (channel->breaker != BREAKER_CLOSED) {
+        printf("[%s]: Replica %s answered, its circuit breaker is closed\n", service_names[channel->handle.service],
+            channel->name);
+        fflush(stdout);
+    }
+    channel->breaker = BREAKER_CLOSED;
+    channel->failures = 0;
+}
+
+/**
+ * Reserves a pending slot for a request a session is about to send to a microservice
+ * Returns the id of the request, or 0 if too many requests are already in flight
+ *
+ * @param s:         session waiting on the response
+ * @param client_id: id the client gave the request, only used by the framed protocol
+ * @param opcode:    operation the client asked for
+ */
+uint32_t allocRequest(struct session *s, uint32_t client_id, int opcode) {
+    if (pending_free == NO_SLOT) {
+        //Double the table, the slots already in use keep their index
+        uint32_t size = pending_size == 0 ? 1024 : pending_size * 2;
+
+        if (size > MAX_PENDING) return 0;
+
+        struct pending *table = realloc(pending, size * sizeof(struct pending));
+
+        if (table == NULL) return 0;
+
+        for (uint32_t i = size; i-- > pending_size;) {
+            table[i].id = 0;
+            table[i].generation = 0;
+            table[i].next = pending_free;
+            pending_free = i;
+        }
+        pending = table;
+        pending_size = size;
+    }
+    uint32_t slot = pending_free;
+    struct pending *p = &pending[slot];
+    pending_free = p->next;
+
+    //Bump the generation so a late response for the slot's previous request is not mistaken for this one
+    p->generation = p->generation % ((1 << (32 - REQUEST_SLOT_BITS)) - 1) + 1;
+    p->id = (p->generation << REQUEST_SLOT_BITS) | slot;
+    p->session = s;
+    p->client_id = client_id;
+    p->opcode = opcode;
+    p->cache_ticket = NO_TICKET;
+    p->writes = __atomic_load_n(&vote_writes, __ATOMIC_ACQUIRE);
+    p->leader = NO_SLOT;
+    p->followers = NO_SLOT;
+    p->due = 0;
+    p->datagram = NULL;
+    p->replica = 0;
+
+    //Link the slot into the list of the session, so the session can drop its requests when it closes
+    p->prev = NO_SLOT;
+    p->next = s->requests;
+    if (s->requests != NO_SLOT) pending[s->requests].prev = slot;
+    s->requests = slot;
+    s->in_flight++;
+
+    return p->id;
+}
+
+/**
+ * Returns the pending slot of a request, or NULL if the request is unknown or no longer pending
+ */
+struct pending *findRequest(uint32_t id) {
+    uint32_t slot = id & (MAX_PENDING - 1);
+
+    if (id == 0 || slot >= pending_size || pending[slot].id != id) return NULL;
+    return &pending[slot];
+}
+
+/**
+ * Frees the pending slot of a request
+ * A request that others are waiting on only leaves its session, and stays pending until they are answered
+ */
+void releaseRequest(uint32_t id) {
+    struct pending *p = findRequest(id);
+    uint32_t slot = id & (MAX_PENDING - 1);
+
+    if (p == NULL) return;
+
+    if (p->session != NULL) {
+        //Unlink the slot from the list of its session
+        if (p->prev != NO_SLOT) pending[p->prev].next = p->next;
+        else p->session->requests = p->next;
+        if (p->next != NO_SLOT) pending[p->next].prev = p->prev;
+        p->session->in_flight--;
+        p->session = NULL;
+    }
+    if (p->leader != NO_SLOT) {
+        struct pending *leader = &pending[p->leader];
+
+        //Unlink the slot from the requests waiting on its leader
+        if (p->prev_follower != NO_SLOT) pending[p->prev_follower].next_follower = p->next_follower;
+        else leader->followers = p->next_follower;
+        if (p->next_follower != NO_SLOT) pending[p->next_follower].prev_follower = p->prev_follower;
+        p->leader = NO_SLOT;
+
+        //The leader was only kept for the requests waiting on it
+        if (leader->session == NULL && leader->followers == NO_SLOT) releaseRequest(leader->id);
+    }
+    if (p->followers != NO_SLOT) return;
+
+    //The replica is no longer waited on for this request
+    struct channel *channel = p->replica == 0 ? NULL : findChannel(p->service, p->replica);
+    if (channel != NULL) channel->outstanding--;
+
+    free(p->datagram);
+    p->datagram = NULL;
+    p->id = 0;
+    p->next = pending_free;
+    pending_free = slot;
+}
+
+/**
+ * Makes a new request wait on the response to an identical request already sent, rather than sending it too
+ * Returns the id of the new request, or 0 if too many requests are already in flight
+ *
+ * @param leader: id of the request already sent
+ */
+uint32_t joinRequest(struct session *s, uint32_t client_id, int opcode, uint32_t leader) {
+    uint32_t id = allocRequest(s, client_id, opcode);
+    uint32_t leader_slot = leader & (MAX_PENDING - 1), slot = id & (MAX_PENDING - 1);
+
+    if (id == 0) return 0;
+
+    //Taking a slot can move the table, so the leader is only looked up now
+    struct pending *p = &pending[slot];
+    p->leader = leader_slot;
+    p->prev_follower = NO_SLOT;
+    p->next_follower = pending[leader_slot].followers;
+    if (p->next_follower != NO_SLOT) pending[p->next_follower].prev_follower = slot;
+    pending[leader_slot].followers = slot;
+    coalesced++;
+
+    return id;
+}
+
+/**
+ * Returns the bucket a latency in microseconds is counted in
+ */
+int latencyBucket(int64_t micros) {
+    if (micros < 4) return micros < 0 ? 0 : micros;
+
+    int power = 63 - __builtin_clzll(micros);
+    int bucket = power * 4 + ((micros >> (power - 2)) & 3);
+
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/**
+ * Returns the largest latency in microseconds counted in a bucket
+ */
+int64_t bucketLimit(int bucket) {
+    if (bucket < 4) return bucket;
+
+    return ((int64_t) (5 + bucket % 4) << (bucket / 4 - 2)) - 1;
+}
+
+/**
+ * Counts the latency of a response, working out the percentiles again once every LATENCY_WINDOW responses
+ */
+void recordLatency(struct latency_stats *stats, int64_t micros) {
+    stats->buckets[latencyBucket(micros)]++;
+    stats->responses++;
+
+    if (++stats->samples < LATENCY_WINDOW) return;
+
+    uint32_t total = 0, seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) total += stats->buckets[i];
+
+    stats->p95 = stats->p99 = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (stats->p95 == 0 && seen * 100ULL >= total * 95ULL) stats->p95 = bucketLimit(i);
+        if (stats->p99 == 0 && seen * 100ULL >= total * 99ULL) stats->p99 = bucketLimit(i);
+        //Halve every count, so the latencies of the last few windows weigh the most
+        stats->buckets[i] /= 2;
+    }
+    stats->samples = 0;
+}
+
+/**
+ * Returns the microseconds a request to a microservice waits for its response before it is hedged
+ */
+int64_t hedgeDelay(int service) {
+    int64_t p95 = latencies[service].p95;
+
+    if (p95 == 0) return INITIAL_HEDGE_DELAY;
+    return p95 > MIN_HEDGE_DELAY ? p95 : MIN_HEDGE_DELAY;
+}
+
+/**
+ * Makes sure the timer file descriptor wakes the event loop in time for the first timer
+ */
+void armTimers() {
+    if (timer_count == 0 || (timer_armed != 0 && timer_armed <= timers[0].due)) return;
+
+    struct itimerspec when = {{0, 0}, {timers[0].due / 1000000, timers[0].due % 1000000 * 1000}};
+
+    timer_armed = timers[0].due;
+    check(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &when, NULL), "timerfd_settime", FALSE);
+}
+
+/**
+ * Sets the timer of a pending request, replacing any timer it had
+ * Returns -1 if the heap could not be grown
+ */
+int setTimer(struct pending *p, int64_t due) {
+    if (timer_count == timer_capacity) {
+        uint32_t capacity = timer_capacity == 0 ? 1024 : timer_capacity * 2;
+        struct timer *heap = realloc(timers, capacity * sizeof(struct timer));
+
+        if (heap == NULL) return check(-1, "realloc", FALSE);
+        timers = heap;
+        timer_capacity = capacity;
+    }
+    //The old timer stays in the heap, it no longer matches the request once it is due
+    p->due = due;
+
+    uint32_t i = timer_count++;
+    while (i > 0 && timers[(i - 1) / 2].due > due) {
+        timers[i] = timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    timers[i].due = due;
+    timers[i].request_id = p->id;
+
+    armTimers();
+    return 0;
+}
+
+/**
+ * Removes the first timer from the heap
+ */
+struct timer popTimer() {
+    struct timer first = timers[0], last = timers[--timer_count];
+    uint32_t i = 0;
+
+    while (2 * i + 1 < timer_count) {
+        uint32_t child = 2 * i + 1;
+
+        if (child + 1 < timer_count && timers[child + 1].due < timers[child].due) child++;
+        if (last.due <= timers[child].due) break;
+        timers[i] = timers[child];
+        i = child;
+    }
+    timers[i] = last;
+
+    return first;
+}
+
+/**
+ * Sets the timer of a request for when it should next be sent again, or for its deadline
+ */
+void scheduleRequest(struct pending *p) {
+    int64_t due = p->deadline;
+
+    if (p->datagram != NULL && p->resends < config.retries && p->last_sent + p->resend_delay < due) {
+        due = p->last_sent + p->resend_delay;
+    }
+    setTimer(p, due);
+}
+
+/**
+ * Puts a request in the queue of its microservice, to be sent once it is its turn and a replica has room for it
+ * The request fails at the deadline of its microservice, which runs from now so the wait counts against it
+ * Returns -1 if the queue is full
+ *
+ * @param datagram: the datagram to send
+ * @param length:   length of the datagram
+ * @param class:    class of the request, see enum queue_class
+ */
+int queueRequest(struct pending *p, int service, const char *datagram, int length, int class) {
+    struct request_queue *queue = &queues[service][class];
+
+    //Make room by dropping the requests at the front that are no longer waiting, which the deadline takes first
+    while (queue->count > 0) {
+        struct pending *first = findRequest(queue->ids[queue->head]);
+
+        if (first != NULL && first->queued) break;
+        queue->head = (queue->head + 1) % QUEUE_CAPACITY;
+        queue->count--;
+    }
+    if (queue->count == QUEUE_CAPACITY || (p->datagram = malloc(length)) == NULL) return -1;
+
+    memcpy(p->datagram, datagram, length);
+    p->datagram_length = length;
+    p->service = service;
+    p->deadline = monotonicMicros() + config.deadlines[service] * 1000LL;
+    p->queued = TRUE;
+    queue->ids[(queue->head + queue->count++) % QUEUE_CAPACITY] = p->id;
+
+    return setTimer(p, p->deadline);
+}
+
+/**
+ * Returns the first request of a queue that is still waiting to be sent, or NULL if there is none
+ * Takes it out of the queue if take is TRUE
+ */
+struct pending *firstQueued(struct request_queue *queue, int take) {
+    while (queue->count > 0) {
+        struct pending *p = findRequest(queue->ids[queue->head]);
+
+        if (p != NULL && p->queued && !take) return p;
+        queue->head = (queue->head + 1) % QUEUE_CAPACITY;
+        queue->count--;
+        if (p != NULL && p->queued) return p;
+    }
+    return NULL;
+}
+
+/**
+ * Sends a request that waited its turn to a replica, and starts the clock for sending it again while its response is late
+ * Only requests that can safely be handled twice keep their datagram for that
+ * Returns -1 if it could not be sent
+ */
+int sendQueued(struct pending *p, struct channel *channel) {
+    p->queued = FALSE;
+
+    //Only the bytes actually used go on the wire
+    if (check(sendDatagram(channel, p->datagram, p->datagram_length), "send", FALSE) < 0) return -1;
+    countReplica(p, channel);
+
+    p->first_sent = p->last_sent = monotonicMicros();
+    p->resends = 0;
+    //Hedge once the response is later than 95% of the recent ones, then retry backing off
+    p->resend_delay = hedgeDelay(p->service);
+
+    if (!isIdempotent(p->opcode) || config.retries == 0) {
+        free(p->datagram);
+        p->datagram = NULL;
+    }
+    scheduleRequest(p);
+    return 0;
+}
+
+/**
+ * Takes a session from the free list, allocating a new slab of sessions if the list is empty
+ */
+struct session *allocSession() {
+    if (free_sessions == NULL) {
+        struct session *slab = calloc(SESSION_SLAB_SIZE, sizeof(struct session));
+
+        if (slab == NULL) return NULL;
+
+        for (int i = 0; i < SESSION_SLAB_SIZE; i++) {
+            slab[i].next_free = free_sessions;
+            free_sessions = &slab[i];
+        }
+    }
+    struct session *s = free_sessions;
+    free_sessions = s->next_free;
+    open_sessions++;
+
+    return s;
+}
+
+/**
+ * Updates the events the event loop watches for on the client socket based on the session state
+ * A legacy client is only read while the session is expecting input, so it can never get ahead of the protocol
+ * A framed client is read until it has too many requests in flight or too many unread responses
+ */
+void updateClientEvents(struct session *s) {
+    struct epoll_event event;
+    event.events = EPOLLRDHUP;
+    event.data.ptr = &s->client_handle;
+
+    if (s->out_len > s->out_off) {
+        event.events |= EPOLLOUT;
+    }
+    if (s->mode == MODE_FRAMED) {
+        if (s->in_flight < MAX_SESSION_IN_FLIGHT && s->out_len - s->out_off < MAX_OUT_BACKLOG && s->in_len < MAX_BUFFER_SIZE) {
+            event.events |= EPOLLIN;
+        }
+    } else if (s->out_len == s->out_off && (s->state == STATE_CHOICE || s->state == STATE_INPUT || s->state == STATE_VOTE_ID)) {
+        event.events |= EPOLLIN;
+    }
+    //Skip the system call if nothing changed
+    if (event.events != s->events) {
+        s->events = event.events;
+        check(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->client_fd, &event), "epoll_ctl", FALSE);
+    }
+}
+
+/**
+ * Ends a client connection
+ * The session is only recycled after the current batch, since later events in the batch may still point at it
+ */
+void closeSession(struct session *s) {
+    if (s->closed) return;
+
+    //Responses that arrive after the client left are dropped
+    while (s->requests != NO_SLOT) {
+        releaseRequest(pending[s->requests].id);
+    }
+    close(s->client_fd);
+    free(s->out);
+    s->out = NULL;
+
+    s->closed = TRUE;
+    s->next_free = closed_sessions;
+    closed_sessions = s;
+    open_sessions--;
+}
+
+/**
+ * Returns the sessions closed during the last batch of events to the free list
+ */
+void recycleSessions() {
+    while (closed_sessions != NULL) {
+        struct session *s = closed_sessions;
+        closed_sessions = s->next_free;
+        s->next_free = free_sessions;
+        free_sessions = s;
+    }
+}
+
+/**
+ * Turns away the next pending connection while the worker is out of descriptors, using the spare one to accept it
+ * Otherwise the connection would stay pending, and the listener readable, until a descriptor is freed
+ * Returns -1 if there is no connection to turn away, or no spare descriptor to do it with
+ */
+int turnAwayClient(int server_fd) {
+    if (spare_fd < 0 && (spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) return -1;
+
+    close(spare_fd);
+    int client_fd = accept4(server_fd, NULL, NULL, 0);
+    int saved_errno = errno;
+
+    if (client_fd >= 0) close(client_fd);
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    errno = saved_errno;
+
+    return client_fd < 0 ? -1 : 0;
+}
+
+/**
+ * Accepts every pending connection on the listening socket and registers each one with the event loop
+ */
+void acceptClients(int server_fd) {
+    struct sockaddr_in client_in;
+    socklen_t sock_len = sizeof(struct sockaddr_in);
+    int client_fd, turned_away = 0;
+
+    while (TRUE) {
+        if ((client_fd = accept4(server_fd, (struct sockaddr *) &client_in, &sock_len, SOCK_NONBLOCK)) < 0) {
+            if ((errno != EMFILE && errno != ENFILE) || turnAwayClient(server_fd) < 0) break;
+            turned_away++;
+            continue;
+        }
+        struct session *s = allocSession();
+
+        if (s == NULL) {
+            //Out of memory, drop the connection rather than the whole server
+            fprintf(stderr, "[ERROR]: Could not set up a session for a new client!\n");
+            close(client_fd);
+            continue;
+        }
+        memset(s, 0, sizeof(struct session));
+        s->client_handle.kind = HANDLE_CLIENT;
+        s->client_handle.session = s;
+        s->client_fd = client_fd;
+        s->mode = MODE_NEGOTIATE;
+        s->state = STATE_CHOICE;
+        s->requests = NO_SLOT;
+        s->events = EPOLLIN | EPOLLRDHUP;
+        //A new client can send a second's worth of requests at once
+        s->tokens = config.client_rate;
+        s->refilled = monotonicMicros();
+
+        struct epoll_event event;
+        event.events = s->events;
+        event.data.ptr = &s->client_handle;
+
+        if (check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event), "epoll_ctl", FALSE) < 0) {
+            closeSession(s);
+        }
+        sock_len = sizeof(struct sockaddr_in);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) check(-1, "accept", FALSE);
+    //Clients are closed at once rather than left pending, so the listener does not wake the loop again for them
+    if (turned_away > 0) fprintf(stderr, "[WARNING]: Out of file descriptors, turned away %d new client(s)\n", turned_away);
+}
+
+/**
+ * Writes as much of the pending response bytes as the client socket accepts
+ * Returns -1 if the client connection has failed
+ */
+int flushClient(struct session *s) {
+    while (s->out_off < s->out_len) {
+        int bytes = send(s->client_fd, s->out + s->out_off, s->out_len - s->out_off, MSG_NOSIGNAL);
+
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return check(-1, "send", FALSE);
+        }
+        s->out_off += bytes;
+    }
+    if (s->out_off == s->out_len) {
+        s->out_len = s->out_off = 0;
+    }
+    updateClientEvents(s);
+
+    return 0;
+}
+
+/**
+ * Appends bytes to the data waiting to be written to the client, growing the buffer if needed
+ * Returns -1 if the buffer could not be grown
+ */
+int appendOut(struct session *s, const char *data, int len) {
+    if (s->out_len + len > s->out_cap && s->out_off > 0) {
+        //Move the unwritten bytes to the front before deciding to grow the buffer
+        memmove(s->out, s->out + s->out_off, s->out_len - s->out_off);
+        s->out_len -= s->out_off;
+        s->out_off = 0;
+    }
+    if (s->out_len + len > s->out_cap) {
+        int cap = s->out_cap == 0 ? MAX_BUFFER_SIZE : s->out_cap;
+
+        while (cap < s->out_len + len) cap *= 2;
+
+        char *out = realloc(s->out, cap);
+
+        if (out == NULL) return check(-1, "realloc", FALSE);
+        s->out = out;
+        s->out_cap = cap;
+    }
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+
+    return 0;
+}
+
+/**
+ * Queues a response of the legacy protocol for the client and starts writing it
+ */
+int sendToClient(struct session *s, const char *data) {
+    if (appendOut(s, data, strlen(data)) < 0) return -1;
+
+    return flushClient(s);
+}
+
+/**
+ * Queues a response frame for the client, it is written out by the caller
+ */
+int queueFrame(struct session *s, uint32_t client_id, int opcode, int status, const char *payload, int length) {
+    char header_bytes[FRAME_HEADER_SIZE];
+    struct frame_header header;
+
+    header.length = length;
+    header.request_id = client_id;
+    header.opcode = opcode;
+    header.status = status;
+    writeFrameHeader(header_bytes, &header);
+
+    if (appendOut(s, header_bytes, FRAME_HEADER_SIZE) < 0) return -1;
+
+    return appendOut(s, payload, header.length);
+}
+
+/**
+ * Takes a token from the bucket of a client, refilling it at the client rate for the time since it was last refilled
+ * Returns FALSE if the client is over its rate
+ */
+int takeToken(struct session *s) {
+    int64_t now = monotonicMicros();
+
+    if (config.client_rate == 0) return TRUE;
+
+    s->tokens += (now - s->refilled) * (double) config.client_rate / 1000000;
+    s->refilled = now;
+    if (s->tokens > config.client_rate) s->tokens = config.client_rate;
+
+    if (s->tokens < 1) return FALSE;
+    s->tokens--;
+
+    return TRUE;
+}
+
+/**
+ * Returns TRUE if the circuit breaker of every replica of a microservice is open, so a request would only wait for nothing
+ */
+int isBroken(int service) {
+    int64_t now = monotonicMicros();
+
+    for (int i = 0; i < replica_counts[service]; i++) {
+        const struct channel *channel = &channels[service][i];
+
+        if (channel->breaker == BREAKER_CLOSED || now >= channel->open_until) return FALSE;
+    }
+    return replica_counts[service] > 0;
+}
+
+/**
+ * Queues a client request to be sent to a replica of the microservice that handles it, see dispatchRequests()
+ * Returns NULL if the request was queued, or the message to send back to the client if it was not
+ *
+ * @param s:         session waiting on the response
+ * @param client_id: id the client gave the request, only used by the framed protocol
+ * @param opcode:    operation the client asked for
+ * @param text:      text the client sent along with the request, not NUL terminated
+ * @param len:       length of text
+ */
+const char *sendRequest(struct session *s, uint32_t client_id, int opcode, const char *text, int len) {
+    char datagram[MAX_DATAGRAM_SIZE];
+    char key[MAX_DATAGRAM_SIZE];
+    struct datagram_header header;
+    int service = serviceForOpcode(opcode);
+
+    if (service < 0) return "Invalid request, please try again.";
+    if (encodeRequest(opcode, text, len, &header, datagram + DATAGRAM_HEADER_SIZE) < 0) return "Invalid input, please try again.";
+
+    int key_length = requestKey(opcode, text, len, key);
+    uint32_t flight = key_length < 0 ? 0 : findFlight(&cache, service, key, key_length);
+    struct pending *leader = findRequest(flight);
+
+    //Wait on an identical request that is already out, unless it was made before a vote this session may have seen acknowledged
+    if (leader != NULL && (service != SERVICE_VOTING || leader->writes == __atomic_load_n(&vote_writes, __ATOMIC_ACQUIRE))) {
+        if (joinRequest(s, client_id, opcode, flight) == 0) {
+            fprintf(stderr, "[ERROR]: Too many requests in flight!\n");
+            return "The microservice is unavailable, please try again later.";
+        }
+        return NULL;
+    }
+    if (replica_counts[service] == 0 && local_contexts[service] == NULL) return "The microservice is unavailable, please try again later.";
+
+    //Turn the request away now rather than let it wait on replicas that keep failing
+    if (isBroken(service)) {
+        latencies[service].shed++;
+        return overloaded_message;
+    }
+    header.version = DATAGRAM_VERSION;
+    header.status = DG_OK;
+
+    if ((header.request_id = allocRequest(s, client_id, opcode)) == 0) {
+        fprintf(stderr, "[ERROR]: Too many requests in flight!\n");
+        return "The microservice is unavailable, please try again later.";
+    }
+    writeDatagramHeader(datagram, &header);
+    struct pending *p = findRequest(header.request_id);
+    int class = CLASS_WITHIN_RATE;
+
+    //A client over its rate is still served, but only once no other client is waiting on the microservice
+    if (!takeToken(s)) {
+        class = CLASS_OVER_RATE;
+        latencies[service].throttled++;
+    }
+    if (queueRequest(p, service, datagram, DATAGRAM_HEADER_SIZE + header.length, class) < 0) {
+        releaseRequest(header.request_id);
+        latencies[service].shed++;
+        return overloaded_message;
+    }
+    //Keep an entry for the response, so identical requests wait on this one and later ones are answered from the cache
+    if (key_length >= 0) p->cache_ticket = reserveCached(&cache, service, key, key_length, header.request_id);
+
+    return NULL;
+}
+
+/**
+ * Forwards a microservice response back to a legacy session that is waiting on it
+ * Returns -1 if the session should be closed
+ */
+int handleResponse(struct session *s, int status, const char *message) {
+    if (s->state == STATE_KEY && status == FRAME_OK) {
+        //Forward the key over to client, then wait for the encrypted id
+        s->state = STATE_VOTE_ID;
+    } else {
+        //We are finished communicating with the microserver
+        s->state = STATE_CHOICE;
+    }
+    return sendToClient(s, message);
+}
+
+/**
+ * Drops every cached conversion once a currency server replica starts using new rates
+ * Each replica counts its own generations, so they are only compared with what the same replica said before
+ *
+ * @param known:   generation the replica, or the currency handler in process, last converted with
+ * @param header:  header of a response, only rates and conversions carry a generation
+ * @param payload: payload of the response
+ */
+void noteRates(uint32_t *known, const struct datagram_header *header, const char *payload) {
+    if (header->status != DG_OK || !((header->opcode == DG_RATES && header->length == 4) ||
+            (header->opcode == DG_CONVERT && header->length == 12))) return;
+
+    uint32_t generation = getU32(payload + header->length - 4);
+
+    if (generation != *known) {
+        invalidateCached(&cache, SERVICE_CURRENCY);
+        *known = generation;
+    }
+    rates_checked = monotonicMillis();
+}
+
+/**
+ * Asks every currency server replica which rates it converts with, at most once every RATES_CHECK_INTERVAL
+ * The answers are handled by noteRates(), cached conversions keep being served until they come back
+ * When conversions are handled in process the handler is asked straight away
+ */
+void checkRates(int64_t now) {
+    char datagram[DATAGRAM_HEADER_SIZE];
+    char response[MAX_DATAGRAM_SIZE];
+    //The answer is not for any session, so it does not need a pending slot
+    struct datagram_header header = {DATAGRAM_VERSION, DG_RATES, DG_OK, 0, 0}, answer;
+    int bytes;
+
+    if (rates_checked >= 0 && now - rates_checked < RATES_CHECK_INTERVAL) return;
+    rates_checked = now;
+
+    if (local_contexts[SERVICE_CURRENCY] != NULL) {
+        bytes = local_services[SERVICE_CURRENCY].handler(&header, "", response, local_contexts[SERVICE_CURRENCY]);
+        if (readDatagramHeader(response, bytes, &answer) == 0) {
+            noteRates(&local_rates_generation, &answer, response + DATAGRAM_HEADER_SIZE);
+        }
+        return;
+    }
+    writeDatagramHeader(datagram, &header);
+    for (int i = 0; i < replica_counts[SERVICE_CURRENCY]; i++) {
+        sendDatagram(&channels[SERVICE_CURRENCY][i], datagram, DATAGRAM_HEADER_SIZE);
+    }
+}
+
+/**
+ * Answers a request with the response cached for it, if there is a fresh one
+ * Returns 1 if the request was answered, 0 if it has to be sent to the microservice, or -1 if the session should be closed
+ */
+int answerFromCache(struct session *s, uint32_t client_id, int opcode, const char *text, int len) {
+    char key[MAX_DATAGRAM_SIZE];
+    int key_length = requestKey(opcode, text, len, key), service = serviceForOpcode(opcode);
+    int64_t now = monotonicMillis();
+    const struct cache_entry *entry;
+
+    if (!isCacheable(opcode) || config.ttls[service] == 0 || key_length < 0) return 0;
+    if ((entry = findCached(&cache, service, key, key_length, now)) == NULL) return 0;
+
+    const char *response = entry->data + entry->key_length;
+    if (service == SERVICE_CURRENCY) checkRates(now);
+
+    if (s->mode == MODE_FRAMED) {
+        return queueFrame(s, client_id, opcode, entry->status, response, entry->value_length) < 0 ? -1 : 1;
+    }
+    return handleResponse(s, entry->status, response) < 0 ? -1 : 1;
+}
+
+/**
+ * Advances the state machine of a legacy session with the next message received from the client
+ * Returns -1 if the session should be closed
+ */
+int handleLegacy(struct session *s, char *message, int bytes) {
+    const char *error;
+    char key[32];
+    int opcode, cached;
 
-#define INDIR_SERVER_ADDR "136.159.5.25"
-#define INDIR_SERVER_PORT 9043
+    if (s->state == STATE_CHOICE) {
+        //Receive choice data from the client
+        s->choice = atoi(message);
 
-#define TRAN_SERVER_ADDR "136.159.5.25"
-#define TRAN_SERVER_PORT 9044
+        if (s->choice < 1 || s->choice > 5) {
+            return sendToClient(s, "Invalid choice, please try again.");
+        }
+        if (s->choice == 1 || s->choice == 2) {
+            //The user will send additional info on top of the choice
+            s->state = STATE_INPUT;
+            updateClientEvents(s);
+            return 0;
+        }
+        if (s->choice == 4 && sprintKey(key) >= 0) {
+            //User has chosen to vote for a candidate, send them the key straight away and wait for the encrypted id
+            s->state = STATE_VOTE_ID;
+            return sendToClient(s, key);
+        }
+        if (s->choice == 4) {
+            //The key has expired, so request it from the voting server again
+            opcode = OP_KEY;
+            s->state = STATE_KEY;
+        } else {
+            //Choices 3 and 5 are forwarded to the voting server as they are
+            opcode = s->choice;
+            s->state = STATE_BACKEND;
+        }
+    } else {
+        //The user sent the extra input or the encrypted id, forward it to the microserver
+        opcode = s->state == STATE_VOTE_ID ? OP_VOTE : s->choice;
+        //Whole sentences are translated in one request
+        if (opcode == OP_TRANSLATE && !isSingleWord(message, bytes)) opcode = OP_TRANSLATE_TEXT;
+        s->state = STATE_BACKEND;
 
-#define CURR_SERVER_ADDR "136.159.5.25"
-#define CURR_SERVER_PORT 9045
+        if ((cached = answerFromCache(s, 0, opcode, message, bytes)) != 0) return cached < 0 ? -1 : 0;
+    }
+    if ((error = sendRequest(s, 0, opcode, message, bytes)) != NULL) {
+        s->state = STATE_CHOICE;
+        return sendToClient(s, error);
+    }
+    updateClientEvents(s);
 
-#define VOTE_SERVER_ADDR "136.159.5.25"
-#define VOTE_SERVER_PORT 9046
+    return 0;
+}
 
 /**
- * Check whether a function has returned an error code and exit the program if necessary
- * Prints the relevant error to the console
+ * Forwards the request in one frame to the microservice that handles its opcode
+ * Returns -1 if the session should be closed
  */
-int check(int status, char *function_name, int can_exit) {
+int handleFrame(struct session *s, const struct frame_header *header, const char *payload) {
+    char key[32];
+    int length, cached;
+
+    //Clients ask for the key once and keep it, and it is answered from the cache while it is fresh
+    if (header->opcode == OP_KEY && (length = sprintKey(key)) >= 0) {
+        return queueFrame(s, header->request_id, header->opcode, FRAME_OK, key, length);
+    }
+    if ((cached = answerFromCache(s, header->request_id, header->opcode, payload, header->length)) != 0) {
+        return cached < 0 ? -1 : 0;
+    }
+    const char *error = sendRequest(s, header->request_id, header->opcode, payload, header->length);
+
+    if (error != NULL) {
+        int status = error == overloaded_message ? FRAME_OVERLOADED : FRAME_ERROR;
+
+        return queueFrame(s, header->request_id, header->opcode, status, error, strlen(error));
+    }
+    return 0;
+}
+
+/**
+ * Forwards every complete frame in the input buffer of a framed session
+ * Frames stay buffered while the session is at its in-flight limit, and are picked up again as responses come back
+ * Returns -1 if the session should be closed
+ */
+int handleFrames(struct session *s) {
+    struct frame_header header;
+    int offset = 0;
+
+    while (s->in_len - offset >= FRAME_HEADER_SIZE && s->in_flight < MAX_SESSION_IN_FLIGHT) {
+        readFrameHeader(s->buffer + offset, &header);
+
+        //A frame that can never fit in the buffer means the client is not speaking the protocol
+        if (header.length > MAX_FRAME_PAYLOAD) return -1;
+        //Wait for the rest of the frame
+        if (s->in_len - offset < FRAME_HEADER_SIZE + (int) header.length) break;
+
+        if (handleFrame(s, &header, s->buffer + offset + FRAME_HEADER_SIZE) < 0) return -1;
+        offset += FRAME_HEADER_SIZE + header.length;
+    }
+    s->in_len -= offset;
+    memmove(s->buffer, s->buffer + offset, s->in_len);
+
+    return flushClient(s);
+}
+
+/**
+ * Reads whatever the client has sent and hands it to the protocol the session speaks
+ * A new session speaks the framed protocol if it starts with FRAME_MAGIC, and the legacy protocol otherwise
+ * Returns -1 if the session should be closed
+ */
+int handleClient(struct session *s) {
+    char *message = s->buffer;
+    int bytes;
+
+    if (s->mode == MODE_FRAMED) {
+        bytes = recv(s->client_fd, s->buffer + s->in_len, MAX_BUFFER_SIZE - s->in_len, 0);
+    } else {
+        if (s->mode == MODE_LEGACY) memset(s->buffer, 0, MAX_BUFFER_SIZE);
+        bytes = recv(s->client_fd, s->buffer + s->in_len, MAX_BUFFER_SIZE - 1 - s->in_len, 0);
+    }
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    //The user is no longer sending data, so we can end this session
+    if (bytes <= 0) return -1;
+
+    if (s->mode == MODE_FRAMED) {
+        s->in_len += bytes;
+        return handleFrames(s);
+    }
+    if (s->mode == MODE_NEGOTIATE) {
+        s->in_len += bytes;
+
+        if (message[0] != FRAME_MAGIC[0]) {
+            //A legacy client, the bytes received so far are its first message
+            s->mode = MODE_LEGACY;
+            bytes = s->in_len;
+            s->in_len = 0;
+        } else if (s->in_len < FRAME_MAGIC_SIZE) {
+            //Wait for the rest of the magic
+            return 0;
+        } else if (memcmp(message, FRAME_MAGIC, FRAME_MAGIC_SIZE) != 0) {
+            return -1;
+        } else {
+            //Confirm the framed protocol and treat anything after the magic as frames
+            s->mode = MODE_FRAMED;
+            s->in_len -= FRAME_MAGIC_SIZE;
+            memmove(s->buffer, message + FRAME_MAGIC_SIZE, s->in_len);
+
+            if (appendOut(s, FRAME_MAGIC, FRAME_MAGIC_SIZE) < 0) return -1;
+            return handleFrames(s);
+        }
+    }
+    return handleLegacy(s, message, bytes);
+}
+
+/**
+ * Sends a microservice response to the session that made a request, and frees the request
+ */
+void answerRequest(uint32_t id, int status, const char *text, int length) {
+    struct pending *p = findRequest(id);
+
+    if (p == NULL) return;
+
+    struct session *s = p->session;
+    uint32_t client_id = p->client_id;
+    int opcode = p->opcode;
+    releaseRequest(id);
+
+    //The session left, the request was only kept for the requests waiting on it
+    if (s == NULL) return;
+
+    if (s->mode == MODE_FRAMED) {
+        //Responses go out in the order they come back, the client matches them up by id
+        status = queueFrame(s, client_id, opcode, status, text, length);
+        //Pick up any frames that were held back by the in-flight limit
+        if (status == 0) status = handleFrames(s);
+    } else {
+        status = handleResponse(s, status, text);
+    }
     if (status < 0) {
-        fprintf(stderr, "[ERROR]: %s() call has failed!\n", function_name);
-        perror(function_name);
-        if (can_exit) {
-            exit(1);
+        closeSession(s);
+    }
+}
+
+/**
+ * Sends a response to every request waiting on a request sent to a microservice, then to the request itself
+ */
+void answerFlight(uint32_t id, int status, const char *text, int length) {
+    struct pending *p;
+
+    while ((p = findRequest(id)) != NULL && p->followers != NO_SLOT) {
+        answerRequest(pending[p->followers].id, status, text, length);
+    }
+    answerRequest(id, status, text, length);
+}
+
+/**
+ * Records and caches the response to a request, then answers the request and every request waiting on it
+ *
+ * @param header:  header of the response
+ * @param payload: payload of the response
+ * @param now:     monotonic time in microseconds the response came back
+ */
+void completeRequest(struct pending *p, const struct datagram_header *header, const char *payload, int64_t now) {
+    char text[MAX_DATAGRAM_SIZE];
+    int ttl = config.ttls[p->service], length, status;
+
+    if (header->status == DG_OK && header->opcode == DG_KEY && header->length == 4) {
+        cacheKey(getU32(payload));
+    }
+    if (header->status == DG_OK && (header->opcode == DG_VOTE || header->opcode == DG_VOTE_BATCH || header->opcode == DG_ADD_CANDIDATE)) {
+        __atomic_add_fetch(&vote_writes, 1, __ATOMIC_RELEASE);
+    }
+    recordLatency(&latencies[p->service], now - p->first_sent);
+    length = decodeResponse(header, payload, text);
+    status = header->status == DG_OK ? FRAME_OK : FRAME_ERROR;
+    fillCached(&cache, p->cache_ticket, status, text, length, ttl == 0 ? 0 : monotonicMillis() + ttl * 1000LL);
+
+    answerFlight(header->request_id, status, text, length);
+}
+
+/**
+ * Drains every response waiting on a microservice channel and routes each one to its session
+ */
+void handleChannel(struct channel *channel) {
+    char datagram[MAX_DATAGRAM_SIZE];
+    struct datagram_header header;
+    int bytes;
+
+    while (TRUE) {
+        if ((bytes = receiveDatagram(channel, datagram)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            //A refused datagram only means the replica is down, the waiting clients will time out
+            if (errno == ECONNREFUSED) noteFailure(channel);
+            continue;
+        }
+        if (readDatagramHeader(datagram, bytes, &header) < 0) continue;
+
+        //Anything the replica sends shows it is up and working through what was sent to it
+        channel->missed = 0;
+        noteSuccess(channel);
+        if (channel->ejected) {
+            channel->ejected = FALSE;
+            printf("[%s]: Replica %s is back\n", service_names[channel->handle.service], channel->name);
+            fflush(stdout);
         }
+        //Every conversion says which rates it was made with, so new rates are noticed without asking
+        noteRates(&channel->rates_generation, &header, datagram + DATAGRAM_HEADER_SIZE);
+
+        struct pending *p = findRequest(header.request_id);
+
+        //The client has left or the response is a duplicate
+        if (p == NULL) continue;
+
+        int64_t now = monotonicMicros();
+
+        //Only a response from the replica the request was last sent to says how long that replica took
+        if (p->replica == channel->id) updateLimit(channel, now - p->last_sent);
+        completeRequest(p, &header, datagram + DATAGRAM_HEADER_SIZE, now);
     }
-    return status;
 }
 
 /**
- * Prints a string buffer and its size in bytes to the console for testing
+ * Handles a request that waited its turn with the handler of its microservice, on the worker's own thread, and answers it
+ * Nothing goes over the network, so there is no datagram to lose and the request is never sent again
  */
-void printBuffer(const char *sender, const char *buffer, int bytes) {
-    printf("%s: %s (%ld bytes)\n", sender, buffer, bytes);
+void handleLocal(struct pending *p) {
+    const char *invalid = "Invalid request, please try again.";
+    char response[MAX_DATAGRAM_SIZE];
+    struct datagram_header header, answer;
+    int bytes;
+
+    p->queued = FALSE;
+    p->first_sent = p->last_sent = monotonicMicros();
+
+    if (readDatagramHeader(p->datagram, p->datagram_length, &header) < 0 ||
+            (bytes = local_services[p->service].handler(&header, p->datagram + DATAGRAM_HEADER_SIZE, response, local_contexts[p->service])) < 0 ||
+            readDatagramHeader(response, bytes, &answer) < 0) {
+        answerFlight(p->id, FRAME_ERROR, invalid, strlen(invalid));
+        return;
+    }
+    if (p->service == SERVICE_CURRENCY) noteRates(&local_rates_generation, &answer, response + DATAGRAM_HEADER_SIZE);
+
+    completeRequest(p, &answer, response + DATAGRAM_HEADER_SIZE, monotonicMicros());
+}
+
+/**
+ * Sends again or fails every request whose timer is due
+ * A request past its deadline is answered with an error, along with every request waiting on it
+ */
+void runTimers() {
+    const char *expired = "The microservice did not respond in time, please try again later.";
+    uint64_t expirations;
+    int64_t now = monotonicMicros();
+
+    //Only drains the descriptor, the heap says what is due
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) check(-1, "read", FALSE);
+    timer_armed = 0;
+
+    while (timer_count > 0 && timers[0].due <= now) {
+        struct timer timer = popTimer();
+        struct pending *p = findRequest(timer.request_id);
+
+        //The request was answered, or has a later timer
+        if (p == NULL || p->due != timer.due) continue;
+        p->due = 0;
+
+        if (now >= p->deadline && p->queued) {
+            //No replica had room for the request in all that time
+            latencies[p->service].shed++;
+            answerFlight(timer.request_id, FRAME_OVERLOADED, overloaded_message, strlen(overloaded_message));
+            continue;
+        }
+        if (now >= p->deadline) {
+            struct channel *channel = p->replica == 0 ? NULL : findChannel(p->service, p->replica);
+
+            //A request that timed out took at least the whole deadline, which shrinks the limit as far as it goes
+            if (channel != NULL) {
+                updateLimit(channel, config.deadlines[p->service] * 1000LL);
+                noteFailure(channel);
+            }
+            latencies[p->service].timeouts++;
+            answerFlight(timer.request_id, FRAME_ERROR, expired, strlen(expired));
+            continue;
+        }
+        //The response is late, the datagram is sent again with the same id and whichever copy answers first is used
+        //The copy goes to another replica if there is one, in case the replica it was sent to is the one that is slow
+        //It is not sent if every replica is at its limit, so retries do not add to an overload
+        struct channel *channel = pickReplica(p->service, p->replica);
+
+        if (channel != NULL) {
+            sendDatagram(channel, p->datagram, p->datagram_length);
+            countReplica(p, channel);
+
+            if (p->resends == 0) {
+                latencies[p->service].hedges++;
+            } else {
+                latencies[p->service].retries++;
+            }
+            p->last_sent = now;
+        }
+        //A copy that could not be sent still uses up an attempt
+        p->resends++;
+        p->resend_delay *= 2;
+        scheduleRequest(p);
+    }
+    armTimers();
+}
+
+/**
+ * Sends the requests waiting in the queues, as many as DISPATCH_BUDGET per turn of the event loop
+ * The microservices take turns by weighted round robin: each turn a microservice sends as many requests as its
+ * share, so a busy microservice cannot take the capacity of the others and each gets its share while they all
+ * have requests waiting. Every request costs the worker about the same to send, so counting requests is as fair
+ * as counting bytes. A microservice whose replicas are all at their limit is skipped until responses make room.
+ * Requests for a microservice handled in process are handled and answered on their turn.
+ */
+void dispatchRequests() {
+    const char *unavailable = "The microservice is unavailable, please try again later.";
+    int budget = DISPATCH_BUDGET, progress = TRUE;
+
+    while (budget > 0 && progress) {
+        progress = FALSE;
+
+        for (int i = 0; i < NUM_SERVICES && budget > 0; i++) {
+            for (int sent = 0; sent < config.shares[i] && budget > 0; sent++) {
+                struct request_queue *queue = &queues[i][CLASS_WITHIN_RATE];
+                struct channel *channel = NULL;
+                struct pending *p;
+
+                if (firstQueued(queue, FALSE) == NULL) queue = &queues[i][CLASS_OVER_RATE];
+                if (firstQueued(queue, FALSE) == NULL) break;
+                if (local_contexts[i] == NULL && (channel = pickReplica(i, 0)) == NULL) break;
+
+                p = firstQueued(queue, TRUE);
+                if (channel == NULL) {
+                    handleLocal(p);
+                } else if (sendQueued(p, channel) < 0) {
+                    answerFlight(p->id, FRAME_ERROR, unavailable, strlen(unavailable));
+                }
+                budget--;
+                progress = TRUE;
+            }
+        }
+    }
+    dispatch_waiting = budget == 0;
+}
+
+/**
+ * Sends a health check to every replica, and ejects the replicas that missed MAX_MISSED_CHECKS in a row
+ * An ejected replica keeps being checked, and is picked again as soon as it answers anything
+ */
+void checkHealth() {
+    char datagram[DATAGRAM_HEADER_SIZE];
+    //The answers are not for any session, so they do not need a pending slot
+    struct datagram_header header = {DATAGRAM_VERSION, DG_PING, DG_OK, 0, 0};
+    uint64_t expirations;
+
+    if (read(health_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) check(-1, "read", FALSE);
+    writeDatagramHeader(datagram, &header);
+
+    for (int i = 0; i < NUM_SERVICES; i++) {
+        for (int r = 0; r < replica_counts[i]; r++) {
+            struct channel *channel = &channels[i][r];
+
+            if (channel->missed >= MAX_MISSED_CHECKS && !channel->ejected) {
+                channel->ejected = TRUE;
+                printf("[%s]: Replica %s missed %d health checks and is ejected\n", service_names[i], channel->name,
+                    channel->missed);
+                fflush(stdout);
+            }
+            //A replica that is not serving its ring is asked again, and a handshake it has not answered since the
+            //last check is given up on
+            if (channel->address.ring[0] != '\0' && channel->ring.segment == NULL) {
+                detachRing(&channel->ring);
+                connectChannelRing(channel);
+            }
+            channel->missed++;
+            sendDatagram(channel, datagram, DATAGRAM_HEADER_SIZE);
+        }
+    }
+}
+
+/**
+ * Handles the responses waiting on ring channels, which epoll only reports while a ring sleeps
+ * If the worker is about to wait for events, every ring is marked as sleeping first, so the replica wakes it with
+ * the next response. While the worker is busy the rings are left awake and cost no system calls.
+ * Returns TRUE if a response arrived while the rings were being put to sleep, so the worker should not wait
+ */
+int pollRings(int idle) {
+    int waiting = FALSE;
+
+    for (int i = 0; i < NUM_SERVICES; i++) {
+        for (int r = 0; r < replica_counts[i]; r++) {
+            struct channel *channel = &channels[i][r];
+
+            if (channel->address.ring[0] == '\0' || channel->ring.segment == NULL) continue;
+            if (idle && sleepRing(&channel->ring) == 0) continue;
+
+            handleChannel(channel);
+            if (idle && sleepRing(&channel->ring) < 0) waiting = TRUE;
+        }
+    }
+    return waiting;
+}
+
+/**
+ * Prints the hit rate and memory use of the worker's cache, and the latencies of each microservice, once every
+ * CACHE_STATS_INTERVAL seconds
+ * Intervals without any traffic are not reported
+ */
+void reportStats(int worker_id) {
+    int64_t now = monotonicMillis();
+
+    if (now - reported_at < CACHE_STATS_INTERVAL * 1000) return;
+
+    unsigned long hits = cache.stats.hits - reported.hits;
+    unsigned long lookups = hits + cache.stats.misses - reported.misses;
+
+    if (cache.capacity > 0 && (lookups > 0 || coalesced > reported_coalesced)) {
+        printf("[CACHE %d]: %.1f%% of %lu lookups hit, %lu requests waited on one in flight, %u entries in %zu KB, "
+            "%lu evicted, %lu expired, %lu invalidations\n", worker_id, lookups > 0 ? 100.0 * hits / lookups : 0.0,
+            lookups, coalesced - reported_coalesced, cache.count, cacheMemory(&cache) / 1024,
+            cache.stats.evictions - reported.evictions, cache.stats.expired - reported.expired,
+            cache.stats.invalidations - reported.invalidations);
+        fflush(stdout);
+    }
+    for (int i = 0; i < NUM_SERVICES; i++) {
+        const struct latency_stats *stats = &latencies[i], *last = &reported_latencies[i];
+
+        char where[32];
+        int limit = 0;
+
+        if (stats->responses == last->responses && stats->timeouts == last->timeouts && stats->shed == last->shed) continue;
+        for (int r = 0; r < replica_counts[i]; r++) limit += (int) channels[i][r].limit;
+
+        if (local_contexts[i] != NULL) {
+            strcpy(where, "in process");
+        } else {
+            sprintf(where, "limit %d", limit);
+        }
+        printf("[%s %d]: %lu responses, p95 %ld usec, p99 %ld usec, %lu hedged, %lu retried, %lu timed out, %lu shed, "
+            "%lu over their client's rate, %s\n", service_names[i], worker_id, stats->responses - last->responses,
+            (long) stats->p95, (long) stats->p99, stats->hedges - last->hedges, stats->retries - last->retries,
+            stats->timeouts - last->timeouts, stats->shed - last->shed, stats->throttled - last->throttled, where);
+        fflush(stdout);
+    }
+    reported = cache.stats;
+    reported_coalesced = coalesced;
+    memcpy(reported_latencies, latencies, sizeof(latencies));
+    reported_at = now;
+}
+
+/**
+ * Fills a cpu set from a list in the kernel's sysfs format, eg. "0-3,8,10-11"
+ * Returns the number of entries added to the set
+ */
+int parseCpuList(const char *list, cpu_set_t *set) {
+    int count = 0;
+    char *end;
+
+    CPU_ZERO(set);
+
+    while (*list != '\0' && *list != '\n') {
+        int first = strtol(list, &end, 10), last = first;
+
+        if (end == list) break;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        for (int i = first; i <= last && i < CPU_SETSIZE; i++, count++) {
+            CPU_SET(i, set);
+        }
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+/**
+ * Reads a cpu list from a sysfs file such as /sys/devices/system/node/online
+ * Returns -1 if the file could not be read
+ */
+int readCpuList(const char *path, cpu_set_t *set) {
+    char list[1024];
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) return -1;
+
+    if (fgets(list, sizeof(list), file) == NULL) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    return parseCpuList(list, set);
+}
+
+/**
+ * Returns the index of the nth cpu in a set, wrapping around if there are fewer than n cpus
+ */
+int nthCpu(cpu_set_t *set, int n) {
+    int count = CPU_COUNT(set);
+
+    if (count == 0) return -1;
+    n %= count;
+
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, set) && n-- == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Pins the calling worker thread according to the affinity mode
+ * AFFINITY_CPU gives each worker its own core, AFFINITY_NUMA spreads workers round robin over the NUMA nodes
+ * Returns the cpu the worker was pinned to, or -1 if it was not pinned to a single cpu
+ */
+int pinWorker(int worker_id, int affinity) {
+    cpu_set_t allowed, pinned;
+    int cpu = -1;
+
+    if (affinity == AFFINITY_NONE) return -1;
+
+    if (affinity == AFFINITY_CPU) {
+        //Only hand out the cpus this process is allowed to run on
+        check(sched_getaffinity(0, sizeof(allowed), &allowed), "sched_getaffinity", TRUE);
+
+        if ((cpu = nthCpu(&allowed, worker_id)) < 0) return -1;
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+    } else {
+        //Bind the worker to every cpu of one NUMA node, so its sessions stay in that node's memory
+        cpu_set_t nodes;
+        char path[64];
+
+        if (readCpuList("/sys/devices/system/node/online", &nodes) <= 0) {
+            fprintf(stderr, "[ERROR]: Could not read the NUMA node list, worker %d is not pinned\n", worker_id);
+            return -1;
+        }
+        int node = nthCpu(&nodes, worker_id);
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+
+        if (readCpuList(path, &pinned) <= 0) {
+            fprintf(stderr, "[ERROR]: Could not read the cpus of NUMA node %d\n", node);
+            return -1;
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned) != 0) {
+        fprintf(stderr, "[ERROR]: Could not pin worker %d\n", worker_id);
+        return -1;
+    }
+    return cpu;
 }
 
 /**
  * Initializes and returns a server socket for communicating with the client
+ * Every worker binds its own socket to the same port, and the kernel spreads new connections across them
+ *
+ * @param server_port: port to listen on
+ * @param backlog:     max number of connections waiting to be accepted
+ * @param cpu:         cpu the calling worker is pinned to, or -1
  */
-int initServer(int server_port) {
+int initServer(int server_port, int backlog, int cpu) {
 	//Specify indirection server info
 	struct sockaddr_in server;
 	memset(&server, 0, sizeof(server));
 	server.sin_family = AF_INET;
 	server.sin_port = htons(server_port);
 	server.sin_addr.s_addr = htonl(INADDR_ANY);
-	
+
 	int server_fd;
-	
+
 	//Create server socket and bind it to the server info
-	check((server_fd = socket(PF_INET, SOCK_STREAM, 0)), "socket", TRUE);
+	check((server_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)), "socket", TRUE);
 	//Allow address to be reused
 	check(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)), "setsockopt", TRUE);
+	//Let each worker have its own listening socket on the same port
+	check(setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)), "setsockopt", TRUE);
+	if (cpu >= 0) {
+		//Prefer handing this socket the connections whose packets are processed on the worker's own cpu
+		check(setsockopt(server_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(int)), "setsockopt", FALSE);
+	}
 	check(bind(server_fd, (struct sockaddr *) &server, sizeof(struct sockaddr_in)), "bind", TRUE);
 	//Start listening for incoming connections
-	check(listen(server_fd, 5), "listen", TRUE);
-	
+	check(listen(server_fd, backlog), "listen", TRUE);
+
 	return server_fd;
 }
 
-int main() {
-	int server_fd = initServer(INDIR_SERVER_PORT);
+/**
+ * Runs the event loop of one worker, which owns its listening socket and all the clients accepted on it
+ */
+void *runWorker(void *arg) {
+	struct worker *worker = arg;
+	int cpu = pinWorker(worker->id, config.affinity);
+	int server_fd = initServer(INDIR_SERVER_PORT, config.backlog, cpu);
 
-	printf("[SERVER]: Listening for connections...\n");
+	//All client sockets and microservice exchanges of this worker are driven by one epoll instance
+	check((epoll_fd = epoll_create1(0)), "epoll_create1", TRUE);
+	check((spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)), "open", TRUE);
 
-	//Variables for dealing with a client
-	int client_fd;
-    struct sockaddr_in client_in;
-	int sock_len = sizeof(struct sockaddr_in);
-	int pid;
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = &listener_handle;
+	check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event), "epoll_ctl", TRUE);
+
+	//Sessions of this worker share one socket per replica of each microservice
+	random_seed = time(NULL) ^ worker->id;
+	syncChannels();
+
+	//Wakes the event loop when the first request timer is due
+	check((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)), "timerfd_create", TRUE);
+	event.events = EPOLLIN;
+	event.data.ptr = &timer_handle;
+	check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event), "epoll_ctl", TRUE);
+
+	//Wakes the event loop for every round of health checks
+	struct itimerspec interval = {{HEALTH_CHECK_INTERVAL / 1000, HEALTH_CHECK_INTERVAL % 1000 * 1000000}, {HEALTH_CHECK_INTERVAL / 1000, HEALTH_CHECK_INTERVAL % 1000 * 1000000}};
+	check((health_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)), "timerfd_create", TRUE);
+	check(timerfd_settime(health_fd, 0, &interval, NULL), "timerfd_settime", TRUE);
+	event.events = EPOLLIN;
+	event.data.ptr = &health_handle;
+	check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, health_fd, &event), "epoll_ctl", TRUE);
+
+	for (int i = 0; i < NUM_SERVICES; i++) {
+		for (int c = 0; c < NUM_CLASSES; c++) {
+			if ((queues[i][c].ids = malloc(QUEUE_CAPACITY * sizeof(uint32_t))) == NULL) check(-1, "malloc", TRUE);
+		}
+	}
+	if (config.cache_entries > 0 && initCache(&cache, config.cache_entries, (size_t) config.cache_entries * CACHE_ENTRY_BYTES) < 0) {
+		fprintf(stderr, "[ERROR]: Not enough memory for the response cache!\n");
+		exit(1);
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	int n;
 
 	while (TRUE) {
-		//Found a new connection request
-		check((client_fd = accept(server_fd, (struct sockaddr *) &client_in, (socklen_t *) &sock_len)), "accept", TRUE);
-
-		pid = fork();
-
-		if (pid == 0) {
-			//Run the client connection on a new thread
-			//Close the server sock since we don't need it in this thread
-			close(server_fd);
-
-			//Specify microservice server info
-			struct sockaddr_in micro;
-			memset(&micro, 0, sizeof(micro));
-			micro.sin_family = AF_INET;
-
-			//String for holding incoming/outgoing network data
-			char buffer[MAX_BUFFER_SIZE];
-			memset(&buffer, 0, MAX_BUFFER_SIZE);
-
-			int done, bytes;
-
-			while (!done) {
-				memset(&buffer, 0, MAX_BUFFER_SIZE);
-
-				if ((bytes = recv(client_fd, buffer, MAX_BUFFER_SIZE, 0)) > 0) {
-					// Receive choice data from the client
-					int choice = atoi(buffer);
-					int getInput = TRUE;
-
-					//Create socket for connecting to microserver
-					int micro_fd;
-					check((micro_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)), "socket", TRUE);
-
-					//Set the microservice IP based on the service selected by the user
-					if (choice == 1) {
-						//User selected choice 1, the translation microservice
-						micro.sin_port = htons(TRAN_SERVER_PORT);
-						micro.sin_addr.s_addr = inet_addr(TRAN_SERVER_ADDR);
-					} else if (choice == 2) {
-						//User selected choice 2, currency microservice
-						micro.sin_port = htons(CURR_SERVER_PORT);
-						micro.sin_addr.s_addr = inet_addr(CURR_SERVER_ADDR);
-					} else if (choice >= 3 && choice <= 5) {
-						//User selected the voting microservice
-						micro.sin_port = htons(VOTE_SERVER_PORT);
-						micro.sin_addr.s_addr = inet_addr(VOTE_SERVER_ADDR);
-						getInput = FALSE;
-
-						if (choice == 4) {
-							//User has chosen to vote for a candidate
-							memset(&buffer, 0, MAX_BUFFER_SIZE);
-							strcpy(buffer, "key_req");
-							//Request key from voting server
-							check(sendto(micro_fd, buffer, sizeof(buffer), 0, (struct sockaddr *) &micro, sock_len), "sendto", FALSE);
-							memset(&buffer, 0, MAX_BUFFER_SIZE);
-							//Get key from voting server
-							recvfrom(micro_fd, buffer, MAX_BUFFER_SIZE, 0, (struct sockaddr *) &micro, &sock_len);
-							//Forward the key over to client
-							check(send(client_fd, buffer, strlen(buffer), 0), "send", FALSE);
-							//Get encrypted id from client...
-							memset(&buffer, 0, MAX_BUFFER_SIZE);
-							recv(client_fd, buffer, MAX_BUFFER_SIZE, 0);
-							//Forward encrypted id over to voting server... happens below at the next sendto call
-						}
-					}
-					if (getInput == TRUE) {
-						//The user sent additional info on top of the choice
-						memset(&buffer, 0, MAX_BUFFER_SIZE);
-						recv(client_fd, buffer, MAX_BUFFER_SIZE, 0);
-					}
-					//Send the user request to the microserver
-					check(sendto(micro_fd, buffer, sizeof(buffer), 0, (struct sockaddr *) &micro, sock_len), "sendto", FALSE);
-
-					//Get the response from the microserver
-					memset(&buffer, 0, MAX_BUFFER_SIZE);
-					recvfrom(micro_fd, buffer, MAX_BUFFER_SIZE, 0, (struct sockaddr *) &micro, &sock_len);
-
-					//Forward the microserver's response back to client
-					check(send(client_fd, buffer, strlen(buffer), 0), "send", FALSE);
-					//We are finished communicating with the microserver
-					close(micro_fd);
-				} else {
-					//The user is no longer sending data, so we can end this thread
-					done = TRUE;
-				}
+		//Pick up replicas added or removed since the last batch
+		syncChannels();
+
+		//Do not wait for events while requests are still waiting for their turn to be sent
+		int busy = pollRings(!dispatch_waiting) || dispatch_waiting;
+
+		if ((n = epoll_wait(epoll_fd, events, MAX_EVENTS, busy ? 0 : -1)) < 0) {
+			if (errno == EINTR) continue;
+			check(n, "epoll_wait", TRUE);
+		}
+		for (int i = 0; i < n; i++) {
+			struct handle *h = events[i].data.ptr;
+			struct session *s = h->session;
+			int status = 0;
+
+			//Skip events for sessions that were closed earlier in this batch
+			if (s != NULL && s->closed) continue;
+
+			if (h->kind == HANDLE_LISTENER) {
+				//Found new connection requests
+				acceptClients(server_fd);
+				continue;
+			}
+			if (h->kind == HANDLE_CHANNEL) {
+				//Responses from a replica of a microservice, possibly for many different sessions
+				struct channel *channel = (struct channel *) h;
+
+				if (channel->address.ring[0] != '\0') clearRing(&channel->ring);
+				handleChannel(channel);
+				continue;
+			}
+			if (h->kind == HANDLE_TIMER) {
+				//Requests whose response is late
+				runTimers();
+				continue;
+			}
+			if (h->kind == HANDLE_HEALTH) {
+				checkHealth();
+				continue;
+			}
+			if (h->kind == HANDLE_RING) {
+				settleRing((struct channel *) ((char *) h - offsetof(struct channel, ring_handle)));
+				continue;
+			}
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				status = -1;
+			} else if (events[i].events & EPOLLOUT) {
+				status = flushClient(s);
+			} else if (events[i].events & EPOLLIN) {
+				status = handleClient(s);
+			} else if (events[i].events & EPOLLRDHUP) {
+				//The client hung up while its request was with a microservice
+				status = -1;
+			}
+			if (status < 0) {
+				closeSession(s);
 			}
-			//End client connection with indirection server
-			close(client_fd);
 		}
+		//Send what the batch queued, in turns between the microservices
+		dispatchRequests();
+		recycleSessions();
+		reportStats(worker->id);
 	}
 	close(server_fd);
-	
+
+	return NULL;
+}
+
+/**
+ * Reads a comma separated list of numbers, one for each microservice in turn, such as deadlines or shares
+ * Microservices left out of the list keep their value
+ * Returns -1 if a number is not positive
+ */
+int parseServiceValues(const char *list, int *values) {
+	char *end;
+
+	for (int i = 0; i < NUM_SERVICES && *list != '\0'; i++) {
+		long value = strtol(list, &end, 10);
+
+		if (end == list || value <= 0 || (*end != ',' && *end != '\0')) return -1;
+		values[i] = value;
+		list = *end == ',' ? end + 1 : end;
+	}
+	return *list == '\0' ? 0 : -1;
+}
+
+/**
+ * Reads a comma separated list of microservices to handle in process, each optionally followed by "=file" to
+ * load its data from instead of the default one, eg. "translate=words.idx,currency"
+ * Returns -1 if a microservice is unknown or cannot be handled in process
+ */
+int parseLocalServices(const char *list) {
+	//The paths point into the copy, which is kept for as long as the server runs
+	char *copy = strdup(list), *saved, *name;
+
+	if (copy == NULL) return -1;
+
+	for (name = strtok_r(copy, ",", &saved); name != NULL; name = strtok_r(NULL, ",", &saved)) {
+		char *path = strchr(name, '=');
+		int service = -1;
+
+		if (path != NULL) *path++ = '\0';
+		for (int i = 0; i < NUM_SERVICES; i++) {
+			if (strcmp(name, service_names[i]) == 0) service = i;
+		}
+		if (service < 0 || local_services[service].load == NULL || (path != NULL && *path == '\0')) return -1;
+
+		config.local_paths[service] = path != NULL ? path : local_services[service].default_path;
+	}
+	return 0;
+}
+
+/**
+ * Prints the correct usage of executing the program
+ */
+void usageError(const char *message, const char *invoke) {
+	printf("%s\n", message);
+	fprintf(stderr, "Usage: %s [-w workers] [-b backlog] [-a none|cpu|numa] [-k key lifetime] [-c cache entries] [-t translate ttl] [-r currency ttl]\n"
+		"       [-l translate,currency,voting deadlines in msec] [-y retries] [-s services] [-q translate,currency,voting shares]\n"
+		"       [-u requests per second per client] [-i in-process services, eg. translate=dictionary.tsv,currency]\n", invoke);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct service_registry registry;
+	unsigned int optional = 0;
+	int opt;
+
+	config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+	config.backlog = SOMAXCONN;
+	config.affinity = AFFINITY_NONE;
+	config.key_lifetime = DEFAULT_KEY_LIFETIME;
+	config.cache_entries = DEFAULT_CACHE_ENTRIES;
+	config.ttls[SERVICE_TRANSLATE] = DEFAULT_TRANSLATE_TTL;
+	config.ttls[SERVICE_CURRENCY] = DEFAULT_CURRENCY_TTL;
+	config.deadlines[SERVICE_TRANSLATE] = DEFAULT_TRANSLATE_DEADLINE;
+	config.deadlines[SERVICE_CURRENCY] = DEFAULT_CURRENCY_DEADLINE;
+	config.deadlines[SERVICE_VOTING] = DEFAULT_VOTING_DEADLINE;
+	config.retries = DEFAULT_RETRIES;
+	config.services = DEFAULT_SERVICES;
+	config.client_rate = DEFAULT_CLIENT_RATE;
+	for (int i = 0; i < NUM_SERVICES; i++) config.shares[i] = DEFAULT_SHARE;
+
+	while ((opt = getopt(argc, argv, "w:b:a:k:c:t:r:l:y:s:q:u:i:")) != -1) {
+		if (opt == 'w') {
+			config.workers = atoi(optarg);
+		} else if (opt == 'b') {
+			config.backlog = atoi(optarg);
+		} else if (opt == 'a' && strcmp(optarg, "none") == 0) {
+			config.affinity = AFFINITY_NONE;
+		} else if (opt == 'a' && strcmp(optarg, "cpu") == 0) {
+			config.affinity = AFFINITY_CPU;
+		} else if (opt == 'a' && strcmp(optarg, "numa") == 0) {
+			config.affinity = AFFINITY_NUMA;
+		} else if (opt == 'k' && atoi(optarg) >= 0) {
+			config.key_lifetime = atoi(optarg);
+		} else if (opt == 'c' && atoi(optarg) >= 0) {
+			config.cache_entries = atoi(optarg);
+		} else if (opt == 't' && atoi(optarg) >= 0) {
+			config.ttls[SERVICE_TRANSLATE] = atoi(optarg);
+		} else if (opt == 'r' && atoi(optarg) >= 0) {
+			config.ttls[SERVICE_CURRENCY] = atoi(optarg);
+		} else if (opt == 'l' && parseServiceValues(optarg, config.deadlines) == 0) {
+			continue;
+		} else if (opt == 'y' && atoi(optarg) >= 0) {
+			config.retries = atoi(optarg);
+		} else if (opt == 's') {
+			config.services = optarg;
+		} else if (opt == 'q' && parseServiceValues(optarg, config.shares) == 0) {
+			continue;
+		} else if (opt == 'u' && atoi(optarg) >= 0) {
+			config.client_rate = atoi(optarg);
+		} else if (opt == 'i' && parseLocalServices(optarg) == 0) {
+			continue;
+		} else {
+			usageError("Invalid option!", argv[0]);
+		}
+	}
+	if (config.workers < 1) usageError("There must be at least 1 worker!", argv[0]);
+	if (config.backlog < 1) usageError("The backlog must be at least 1!", argv[0]);
+
+	//A client that disconnects mid-response must not take the whole server down
+	signal(SIGPIPE, SIG_IGN);
+	raiseFileLimit();
+
+	//Microservices handled in process load their data once, and every worker handles requests with it
+	for (int i = 0; i < NUM_SERVICES; i++) {
+		if (config.local_paths[i] == NULL) continue;
+
+		if ((local_contexts[i] = local_services[i].load(config.local_paths[i])) == NULL) {
+			fprintf(stderr, "[ERROR]: Could not load %s for the %s service!\n", config.local_paths[i], service_names[i]);
+			exit(1);
+		}
+		//Its replicas can be left out of the registry
+		optional |= 1U << i;
+		printf("[SERVER]: Handling %s requests in process with %s\n", service_names[i], config.local_paths[i]);
+	}
+
+	//Workers open their channels from the registry, and pick up changes to the file while they run
+	if (loadRegistry(config.services, service_names, NUM_SERVICES, optional, &registry) < 0) {
+		fprintf(stderr, "[ERROR]: Could not load the services %s!\n", config.services);
+		exit(1);
+	}
+	if (startRegistry(config.services, service_names, optional, &registry) < 0) {
+		fprintf(stderr, "[ERROR]: Could not start the services reloader!\n");
+		exit(1);
+	}
+
+	struct worker *workers = calloc(config.workers, sizeof(struct worker));
+
+	for (int i = 0; i < config.workers; i++) {
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0) {
+			check(-1, "pthread_create", TRUE);
+		}
+	}
+	printf("[SERVER]: Listening for connections on %d worker(s)...\n", config.workers);
+
+	for (int i = 0; i < config.workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	free(workers);
+
 	return 0;
 }
@@ -6,6 +6,11 @@
 #include <signal.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "frame.h"
 
 #define TRUE 1
 #define FALSE 0
@@ -79,6 +84,32 @@ int userIntRange(const char *message, int min, int max) {
 	return input;
 }
 
+/**
+ * Reads a line of text from the user, without the newline
+ * Asks again until the line is not empty, and drops whatever does not fit in dest
+ */
+void userLine(char *dest, int size) {
+    while (fgets(dest, size, stdin) != NULL) {
+        if (strchr(dest, '\n') == NULL && !feof(stdin)) clearInputStream();
+        dest[strcspn(dest, "\r\n")] = '\0';
+
+        if (dest[0] != '\0') return;
+        printf("Invalid input. Please enter some text.\n");
+    }
+    //No more input, the user has closed stdin
+    exit(0);
+}
+
+/**
+ * Returns TRUE if a string holds a single word with no spaces or punctuation around it
+ */
+int isSingleWord(const char *text) {
+    for (; *text; text++) {
+        if (!isalnum((unsigned char) *text) && (unsigned char) *text < 0x80) return FALSE;
+    }
+    return TRUE;
+}
+
 /**
  * Prints the correct usage of executing the program
  */
@@ -130,13 +161,134 @@ int initClient(const char *indir_server_addr, int indir_server_port) {
     return client_fd;
 }
 
+/**
+ * Keeps receiving until len bytes have arrived
+ * Returns the number of bytes received, which is less than len if the connection closed or timed out
+ */
+int recvAll(int client_fd, char *dest, int len) {
+    int received = 0, bytes;
+
+    while (received < len && (bytes = recv(client_fd, dest + received, len - received, 0)) > 0) {
+        received += bytes;
+    }
+    return received;
+}
+
+/**
+ * Sends a request frame to the indirection server
+ */
+int sendFrame(int client_fd, uint32_t request_id, int opcode, const char *payload) {
+    char frame[FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD];
+    struct frame_header header;
+
+    header.length = strlen(payload);
+    header.request_id = request_id;
+    header.opcode = opcode;
+    header.status = FRAME_OK;
+
+    if (header.length > MAX_FRAME_PAYLOAD) return -1;
+
+    writeFrameHeader(frame, &header);
+    memcpy(frame + FRAME_HEADER_SIZE, payload, header.length);
+
+    return check(send(client_fd, frame, FRAME_HEADER_SIZE + header.length, 0), "send", FALSE);
+}
+
+/**
+ * Receives a response frame from the indirection server, writing its payload to dest as a string
+ * Returns the payload size, or -1 if the connection closed or timed out
+ */
+int recvFrame(int client_fd, struct frame_header *header, char *dest) {
+    char header_bytes[FRAME_HEADER_SIZE];
+
+    if (recvAll(client_fd, header_bytes, FRAME_HEADER_SIZE) < FRAME_HEADER_SIZE) return -1;
+    readFrameHeader(header_bytes, header);
+
+    if (header->length > MAX_FRAME_PAYLOAD) return -1;
+    if (recvAll(client_fd, dest, header->length) < (int) header->length) return -1;
+    dest[header->length] = '\0';
+
+    return header->length;
+}
+
+/**
+ * Sends one request frame and waits for the response with the same id
+ * Returns the response payload size, or -1 if the connection closed or timed out
+ */
+int framedRequest(int client_fd, int opcode, const char *payload, char *response) {
+    static uint32_t next_request_id = 1;
+    uint32_t request_id = next_request_id++;
+    struct frame_header header;
+    int bytes;
+
+    if (sendFrame(client_fd, request_id, opcode, payload) < 0) return -1;
+
+    //Responses can come back in any order, skip any that belong to an earlier request
+    while ((bytes = recvFrame(client_fd, &header, response)) >= 0 && header.request_id != request_id);
+
+    return bytes;
+}
+
+/**
+ * Returns the current monotonic time in seconds
+ */
+time_t monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+/**
+ * Asks the indirection server for the encryption key, unless the session already holds one that has not expired
+ * The key is sent as "key|seconds", where seconds is how long it can be kept
+ * Returns the key, or 0 if the connection closed or timed out
+ *
+ * @param key:     key held by the session, 0 if there is none
+ * @param expires: time the held key expires at, updated when a new key is received
+ */
+int sessionKey(int client_fd, int key, time_t *expires, char *buffer) {
+    if (key != 0 && monotonicSeconds() < *expires) return key;
+
+    if (framedRequest(client_fd, OP_KEY, "", buffer) <= 0) return 0;
+
+    const char *lifetime = strchr(buffer, '|');
+    *expires = monotonicSeconds() + (lifetime != NULL ? atoi(lifetime + 1) : 0);
+
+    return atoi(buffer);
+}
+
+/**
+ * Connects to the indirection server, asking it to speak the framed protocol
+ * Falls back to the legacy protocol on a new connection if the server does not confirm
+ *
+ * @param framed: set to TRUE if the framed protocol is in use
+ */
+int connectServer(const char *indir_server_addr, int indir_server_port, int *framed) {
+    char reply[FRAME_MAGIC_SIZE];
+    int client_fd = initClient(indir_server_addr, indir_server_port);
+
+    check(send(client_fd, FRAME_MAGIC, FRAME_MAGIC_SIZE, 0), "send", FALSE);
+
+    if (recvAll(client_fd, reply, FRAME_MAGIC_SIZE) == FRAME_MAGIC_SIZE && memcmp(reply, FRAME_MAGIC, FRAME_MAGIC_SIZE) == 0) {
+        *framed = TRUE;
+        return client_fd;
+    }
+    //The server only speaks the legacy protocol
+    close(client_fd);
+    *framed = FALSE;
+
+    return initClient(indir_server_addr, indir_server_port);
+}
+
 int main(int argc, const char *argv[]) {
     //Check if the cmd line args are of the proper format
     if (argc != 3) usageError("Invalid number of arguments!", argv[0]);
     if (strcmp(argv[1], INDIR_SERVER_ADDR) != 0) usageError("Invalid server IP!", argv[0]);
     if (atoi(argv[2]) != INDIR_SERVER_PORT) usageError("Invalid server port!", argv[0]);
 
-    int client_fd = initClient(INDIR_SERVER_ADDR, INDIR_SERVER_PORT);
+    int framed;
+    int client_fd = connectServer(INDIR_SERVER_ADDR, INDIR_SERVER_PORT, &framed);
 
     //String for holding incoming/outgoing network data
 	char buffer[MAX_BUFFER_SIZE];
@@ -145,7 +297,11 @@ int main(int argc, const char *argv[]) {
     int done = FALSE;
     int canShowResults = FALSE;
     int bytes, choice, id, sendInput, key;
-    char input[10];
+    //Key of the framed session, kept between votes until it expires
+    int session_key = 0;
+    time_t key_expires = 0;
+    char input[MAX_FRAME_PAYLOAD + 1];
+    char encrypted[16];
     
     while (!done) {
         //Display the menu to the user
@@ -155,7 +311,7 @@ int main(int argc, const char *argv[]) {
 
         if (choice == 1) {
             //User chose the translation microservice
-            printf("Enter an English word:\n");
+            printf("Enter an English word or sentence:\n");
             sendInput = TRUE;
         } else if (choice == 2) {
             //User chose the currency microservice
@@ -174,37 +330,58 @@ int main(int argc, const char *argv[]) {
             break;
         }
 
-        //Send input choice to the indirection server
-        memset(&buffer, 0, MAX_BUFFER_SIZE);
-        sprintf(buffer, "%d", choice);
-        check(send(client_fd, buffer, strlen(buffer), 0), "send", FALSE);
-
         if (sendInput == TRUE) {
             //The microservice chosen by the user requires additional data to be sent to indirection server
-            scanf("%s", input);
-            check(send(client_fd, input, strlen(input), 0), "send", FALSE);
-        } else if (choice == 4) {
-            //Get encryption key from indirection server
-            memset(&buffer, 0, MAX_BUFFER_SIZE);
-            recv(client_fd, buffer, MAX_BUFFER_SIZE, 0);
-            key = atoi(buffer);
-            
-            memset(&buffer, 0, MAX_BUFFER_SIZE);
-            //Send encrypted id to indirection server
+            userLine(input, sizeof(input));
+        }
+        memset(&buffer, 0, MAX_BUFFER_SIZE);
+
+        if (framed && choice == 4) {
+            //Get the encryption key once per session, then every vote is a single request
             //encrypted_key = id * key
-            sprintf(buffer, "%d", id * key);
+            bytes = -1;
+            if ((session_key = sessionKey(client_fd, session_key, &key_expires, buffer)) != 0) {
+                sprintf(encrypted, "%d", id * session_key);
+                bytes = framedRequest(client_fd, OP_VOTE, encrypted, buffer);
+            }
+        } else if (framed && choice == 1 && !isSingleWord(input)) {
+            //Translate the whole sentence in one request
+            bytes = framedRequest(client_fd, OP_TRANSLATE_TEXT, input, buffer);
+        } else if (framed) {
+            //The menu choices double as the opcodes of the framed protocol
+            bytes = framedRequest(client_fd, choice, sendInput ? input : "", buffer);
+        } else {
+            //Send input choice to the indirection server
+            sprintf(buffer, "%d", choice);
             check(send(client_fd, buffer, strlen(buffer), 0), "send", FALSE);
+
+            if (sendInput == TRUE) {
+                check(send(client_fd, input, strlen(input), 0), "send", FALSE);
+            } else if (choice == 4) {
+                //Get encryption key from indirection server
+                memset(&buffer, 0, MAX_BUFFER_SIZE);
+                recv(client_fd, buffer, MAX_BUFFER_SIZE, 0);
+                key = atoi(buffer);
+
+                memset(&buffer, 0, MAX_BUFFER_SIZE);
+                //Send encrypted id to indirection server
+                //encrypted_key = id * key
+                sprintf(buffer, "%d", id * key);
+                check(send(client_fd, buffer, strlen(buffer), 0), "send", FALSE);
+            }
+            //Get response from indirection server
+            memset(&buffer, 0, MAX_BUFFER_SIZE);
+            bytes = recv(client_fd, buffer, MAX_BUFFER_SIZE, 0);
         }
-        //Get response from indirection server
-        memset(&buffer, 0, MAX_BUFFER_SIZE);
-        bytes = recv(client_fd, buffer, MAX_BUFFER_SIZE, 0);
 
         if (bytes <= 0) {
             //No bytes were received back from indirection server (the microserver is most likely not running)
             strcpy(buffer, "Connection timed out: requested microserver is not responding. Please try again later!");
             //Reset TCP connection to recover from timeout
             close(client_fd);
-            client_fd = initClient(INDIR_SERVER_ADDR, INDIR_SERVER_PORT);
+            client_fd = connectServer(INDIR_SERVER_ADDR, INDIR_SERVER_PORT, &framed);
+            //The key is negotiated again on the new session
+            session_key = 0;
         }
         //The user voted successfully, and is now allowed to show voting results
         if (canShowResults == FALSE && strstr(buffer, "vote")) {
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include "rates.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define MAX_LINE_SIZE 256
+//Conversions are done in blocks, the cross rates of a block are looked up before any arithmetic
+#define CONVERT_BLOCK 256
+
+/**
+ * Progress of one converting thread, padded so threads do not share a cache line
+ * seq is odd while the thread is using a table
+ */
+struct rate_reader {
+    unsigned long seq;
+    char padding[64 - sizeof(unsigned long)];
+};
+
+//The table used for conversions
+struct rate_table *current_rates;
+
+//Cross rate of a pair with an unknown currency
+const struct cross_rate unknown_rate = {0, 1, 0, 0};
+
+struct rate_reader rate_readers[MAX_RATE_READERS];
+int rate_reader_count;
+__thread struct rate_reader *rate_reader;
+
+int rateSlot(uint32_t code) {
+    int a = (code >> 16) & 0xFF, b = (code >> 8) & 0xFF, c = code & 0xFF;
+
+    //Codes are packed into the low 3 bytes
+    if (code >> 24 || a < 'A' || a > 'Z' || b < 'A' || b > 'Z' || c < 'A' || c > 'Z') return -1;
+
+    return ((a - 'A') * 26 + (b - 'A')) * 26 + (c - 'A');
+}
+
+/**
+ * Returns the row of a currency in the cross rate matrix, or -1 if it is unknown
+ */
+int rateIndex(const struct rate_table *table, uint32_t code) {
+    int slot = rateSlot(code);
+
+    return slot < 0 ? -1 : table->index[slot];
+}
+
+/**
+ * Returns 10^exponent, for exponents of up to MAX_RATE_DIGITS
+ */
+uint64_t powerOfTen(int exponent) {
+    uint64_t power = 1;
+
+    while (exponent-- > 0) power *= 10;
+    return power;
+}
+
+/**
+ * Returns the largest number dividing both a and b, with Euclid's algorithm
+ */
+unsigned __int128 greatestCommonDivisor(unsigned __int128 a, unsigned __int128 b) {
+    while (b != 0) {
+        unsigned __int128 rest = a % b;
+        a = b;
+        b = rest;
+    }
+    return a;
+}
+
+/**
+ * Works out the exact cross rate between two currencies, (to_digits / 10^to_scale) / (from_digits / 10^from_scale),
+ * and its fixed point approximation
+ */
+void setCrossRate(struct cross_rate *cross, uint64_t from_digits, int from_scale, uint64_t to_digits, int to_scale) {
+    //Digits and powers of ten are at most 10^18, so their products fit in 128 bits
+    unsigned __int128 numerator = to_digits, denominator = from_digits, divisor;
+    int exponent, shift;
+
+    if (from_scale > to_scale) numerator *= powerOfTen(from_scale - to_scale);
+    else denominator *= powerOfTen(to_scale - from_scale);
+    divisor = greatestCommonDivisor(numerator, denominator);
+    numerator /= divisor;
+    denominator /= divisor;
+
+    *cross = unknown_rate;
+    //Below 2^63, the product of an amount and the numerator fits in 128 bits
+    if (numerator > INT64_MAX || denominator > INT64_MAX) return;
+
+    //Both fit in the 64 bit mantissa of a long double, so the estimate is off by at most a couple of units
+    long double fraction = frexpl((long double) numerator / denominator, &exponent);
+
+    //rate = fraction * 2^exponent, with fraction in [0.5, 1), a rate of 2^62 or more leaves no room for an amount
+    shift = CROSS_MANTISSA_BITS - exponent;
+    if (shift < 0) return;
+
+    cross->numerator = numerator;
+    cross->denominator = denominator;
+    cross->mantissa = (uint64_t) roundl(ldexpl(fraction, CROSS_MANTISSA_BITS));
+    cross->shift = shift;
+}
+
+/**
+ * Builds the matrix of cross rates between every pair of currencies in a table
+ * Returns -1 if there is not enough memory
+ */
+int buildCrossRates(struct rate_table *table) {
+    int count = 0;
+    int16_t slots[RATE_SLOTS];
+
+    for (int slot = 0; slot < RATE_SLOTS; slot++) {
+        table->index[slot] = -1;
+        if (table->rate_digits[slot] != 0) {
+            slots[count] = slot;
+            table->index[slot] = count++;
+        }
+    }
+    table->cross = malloc((size_t) count * count * sizeof(struct cross_rate));
+    if (table->cross == NULL) return -1;
+
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < count; j++) {
+            int from = slots[i], to = slots[j];
+
+            //Units of currency j worth 1 unit of currency i
+            setCrossRate(&table->cross[(size_t) i * count + j], table->rate_digits[from], table->rate_scale[from],
+                table->rate_digits[to], table->rate_scale[to]);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads a positive decimal such as 0.00001277 as digits / 10^scale, without going through binary floating point
+ * The number ends at the first space or the end of the text
+ * Returns -1 if it is not a positive decimal of up to MAX_RATE_DIGITS significant digits and decimals
+ */
+int parseRate(const char *text, uint64_t *digits, uint8_t *scale) {
+    uint64_t value = 0;
+    int significant = 0, decimals = 0, point = FALSE, any = FALSE;
+
+    for (; *text != '\0' && !isspace((unsigned char) *text); text++) {
+        if (*text == '.' && !point) {
+            point = TRUE;
+            continue;
+        }
+        if (*text < '0' || *text > '9') return -1;
+
+        //Leading zeros are not significant, but those after the point still count as decimals
+        significant += value != 0 || *text != '0';
+        decimals += point;
+        if (significant > MAX_RATE_DIGITS || decimals > MAX_RATE_DIGITS) return -1;
+        value = value * 10 + (*text - '0');
+        any = TRUE;
+    }
+    if (!any || value == 0) return -1;
+
+    *digits = value;
+    *scale = decimals;
+    return 0;
+}
+
+/**
+ * Records which version of the rates file a table was loaded from
+ * Returns -1 if the file does not exist
+ */
+int fileIdentity(const char *path, struct timespec *modified, long *size, unsigned long *inode) {
+    struct stat st;
+
+    if (stat(path, &st) < 0) return -1;
+
+    *modified = st.st_mtim;
+    *size = st.st_size;
+    *inode = st.st_ino;
+    return 0;
+}
+
+struct rate_table *loadRates(const char *path) {
+    FILE *file = fopen(path, "r");
+    char line[MAX_LINE_SIZE];
+    int line_number = 0;
+
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    struct rate_table *table = calloc(1, sizeof(struct rate_table));
+    if (table == NULL) {
+        fprintf(stderr, "[ERROR]: Not enough memory for the rate table!\n");
+        fclose(file);
+        return NULL;
+    }
+    fileIdentity(path, &table->modified, &table->size, &table->inode);
+
+    while (fgets(line, MAX_LINE_SIZE, file) != NULL) {
+        char code[4];
+        uint64_t digits;
+        uint8_t scale;
+        int offset = 0;
+
+        line_number++;
+        //Skip blank lines and comments
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') continue;
+
+        int slot = -1;
+        if (sscanf(line, "%3s %n", code, &offset) == 1 && strlen(code) == 3 && offset > 0) {
+            slot = rateSlot(((uint32_t) (uint8_t) code[0] << 16) | ((uint32_t) (uint8_t) code[1] << 8) | (uint8_t) code[2]);
+        }
+        if (slot < 0 || parseRate(line + offset, &digits, &scale) < 0) {
+            fprintf(stderr, "[WARNING]: %s:%d: expected a currency code and a positive decimal rate\n", path, line_number);
+            continue;
+        }
+        if (table->rate_digits[slot] == 0) table->count++;
+        table->rate_digits[slot] = digits;
+        table->rate_scale[slot] = scale;
+    }
+    fclose(file);
+
+    if (table->count == 0) {
+        fprintf(stderr, "[ERROR]: %s holds no rates!\n", path);
+        freeRates(table);
+        return NULL;
+    }
+    if (buildCrossRates(table) < 0) {
+        fprintf(stderr, "[ERROR]: Not enough memory for the cross rates!\n");
+        freeRates(table);
+        return NULL;
+    }
+    return table;
+}
+
+void freeRates(struct rate_table *table) {
+    free(table->cross);
+    free(table);
+}
+
+int formatRate(const struct rate_table *table, int slot, char *text) {
+    unsigned long long digits = table->rate_digits[slot], power = powerOfTen(table->rate_scale[slot]);
+
+    if (table->rate_scale[slot] == 0) return sprintf(text, "%llu", digits);
+    return sprintf(text, "%llu.%0*llu", digits / power, table->rate_scale[slot], digits % power);
+}
+
+int convertAmounts(const struct rate_table *table, const int64_t *amounts, const uint32_t *sources,
+        const uint32_t *dests, int64_t *results, int n) {
+    const struct cross_rate *rates[CONVERT_BLOCK];
+    int converted = 0;
+
+    for (int start = 0; start < n; start += CONVERT_BLOCK) {
+        int len = n - start < CONVERT_BLOCK ? n - start : CONVERT_BLOCK;
+
+        //Gather the cross rate of every pair, unknown currencies get a mantissa of 0
+        for (int k = 0; k < len; k++) {
+            int from = rateIndex(table, sources[start + k]), to = rateIndex(table, dests[start + k]);
+
+            rates[k] = (from | to) < 0 ? &unknown_rate : &table->cross[(size_t) from * table->count + to];
+        }
+        //Then convert the whole block without a division
+        for (int k = 0; k < len; k++) {
+            const struct cross_rate *rate = rates[k];
+            int64_t amount = amounts[start + k];
+            uint64_t magnitude = amount < 0 ? -(uint64_t) amount : (uint64_t) amount;
+            unsigned __int128 quotient = ((unsigned __int128) magnitude * rate->mantissa) >> rate->shift;
+
+            //An estimate this far past 2^63 cannot be correct by a few units, the result does not fit
+            if (quotient >> 64) {
+                results[start + k] = INVALID_AMOUNT;
+                continue;
+            }
+            //Correct the estimate into the exact quotient of magnitude * numerator / denominator
+            //Both terms of the remainder are below 2^127
+            __int128 remainder = (__int128) ((unsigned __int128) magnitude * rate->numerator) -
+                (__int128) (quotient * rate->denominator);
+            while (remainder < 0) {
+                quotient--;
+                remainder += rate->denominator;
+            }
+            while (remainder >= rate->denominator) {
+                quotient++;
+                remainder -= rate->denominator;
+            }
+            //A remainder of half the denominator or more rounds up, so halves are rounded away from zero
+            quotient += (uint64_t) remainder >= rate->denominator - (uint64_t) remainder;
+
+            int valid = rate->mantissa != 0 && quotient <= INT64_MAX;
+            int64_t result = amount < 0 ? -(int64_t) quotient : (int64_t) quotient;
+
+            results[start + k] = valid ? result : INVALID_AMOUNT;
+            converted += valid;
+        }
+    }
+    return converted;
+}
+
+const struct rate_table *beginRates() {
+    //Threads claim a reader slot the first time they convert
+    if (rate_reader == NULL) {
+        int i = __atomic_fetch_add(&rate_reader_count, 1, __ATOMIC_SEQ_CST);
+
+        if (i >= MAX_RATE_READERS) {
+            fprintf(stderr, "[ERROR]: Too many threads are converting currencies!\n");
+            exit(1);
+        }
+        rate_reader = &rate_readers[i];
+    }
+    //Tell the reloader this thread is using a table before picking it up
+    __atomic_store_n(&rate_reader->seq, rate_reader->seq + 1, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&current_rates, __ATOMIC_SEQ_CST);
+}
+
+void endRates() {
+    __atomic_store_n(&rate_reader->seq, rate_reader->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Waits until no thread can still be using a table that was replaced before the call
+ * A thread that was not using a table, or has finished with the one it was using, cannot see the old table again
+ */
+void waitForReaders() {
+    int count = __atomic_load_n(&rate_reader_count, __ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < count; i++) {
+        unsigned long seq = __atomic_load_n(&rate_readers[i].seq, __ATOMIC_SEQ_CST);
+
+        //Conversions are short, so just yield until this one is over
+        while ((seq & 1) && __atomic_load_n(&rate_readers[i].seq, __ATOMIC_SEQ_CST) == seq) {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Reloader thread, checks the rates file every RATE_RELOAD_INTERVAL seconds and swaps in a new table when it changes
+ */
+void *reloadRates(void *arg) {
+    const char *path = arg;
+
+    while (TRUE) {
+        struct rate_table *old = current_rates, *table;
+        struct timespec modified;
+        unsigned long inode;
+        long size;
+
+        sleep(RATE_RELOAD_INTERVAL);
+
+        //Editors often replace the file rather than write to it, so the inode counts as a change too
+        if (fileIdentity(path, &modified, &size, &inode) < 0) continue;
+        if (modified.tv_sec == old->modified.tv_sec && modified.tv_nsec == old->modified.tv_nsec &&
+                size == old->size && inode == old->inode) continue;
+
+        //Keep serving the old rates if the new file is broken
+        if ((table = loadRates(path)) == NULL) {
+            old->modified = modified;
+            old->size = size;
+            old->inode = inode;
+            continue;
+        }
+        table->generation = old->generation + 1;
+        __atomic_store_n(&current_rates, table, __ATOMIC_SEQ_CST);
+        waitForReaders();
+        freeRates(old);
+
+        printf("Reloaded %d currencies from %s\n", table->count, path);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+int startRates(const char *path, struct rate_table *table) {
+    pthread_t thread;
+
+    current_rates = table;
+
+    if (pthread_create(&thread, NULL, reloadRates, (void *) path) != 0) return -1;
+    pthread_detach(thread);
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+#ifndef RATES_H
+#define RATES_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "datagram.h"
+
+/*
+ * Conversion rates of the currency server
+ *
+ * Rates are read from a file of "CODE<TAB>rate" lines, where the rate is the number of units of the currency
+ * worth 1 CAD, written as a decimal such as 0.00001277. The table is indexed directly by the three letters of
+ * a code, so finding a rate is a single array access rather than a search, however many currencies are loaded.
+ *
+ * Conversions use a matrix of cross rates between every pair of loaded currencies, built with the table.
+ * Rates are kept as the decimals they were written as, never as binary floating point, so each cross rate is
+ * an exact fraction. An amount in hundredths is multiplied by its numerator in 128 bits, and the quotient by
+ * its denominator is estimated with a fixed point copy of the rate, a 62 bit mantissa and a binary shift, then
+ * corrected with the exact remainder, so no division is needed. The result is exact up to the final rounding
+ * to the nearest hundredth, with halves rounded away from zero.
+ *
+ * A reloader thread watches the file and builds a new table whenever it changes. The new table is published
+ * with a single pointer swap, RCU style: conversions never wait on a reload and always see either the old or
+ * the new table in full. The old table is freed once every thread that may still be using it has moved on.
+ */
+
+//One slot for every code of three upper case letters
+#define RATE_SLOTS (26 * 26 * 26)
+//Seconds between checks of the rates file
+#define RATE_RELOAD_INTERVAL 1
+//Largest number of threads that can convert currencies at the same time
+#define MAX_RATE_READERS 256
+//Bits in the mantissa of a cross rate, leaves room for an amount of up to 2^63 in a 128 bit product
+#define CROSS_MANTISSA_BITS 62
+//Most significant digits of a rate, and most digits after its decimal point, so it fits in 64 bits
+#define MAX_RATE_DIGITS 18
+//Room for a rate written out by formatRate(), with its decimal point and the terminating null
+#define MAX_RATE_TEXT (2 * MAX_RATE_DIGITS + 2)
+
+/**
+ * Units of one currency worth 1 unit of another
+ * numerator / denominator is the exact rate, both below 2^63, and mantissa / 2^shift approximates it
+ * A mantissa of 0 marks a pair whose rate is out of range
+ */
+struct cross_rate {
+    uint64_t numerator;
+    uint64_t denominator;
+    uint64_t mantissa;
+    uint8_t shift;
+};
+
+struct rate_table {
+    //Units worth 1 CAD, rate_digits / 10^rate_scale as written in the rates file, 0 if the currency is unknown
+    uint64_t rate_digits[RATE_SLOTS];
+    uint8_t rate_scale[RATE_SLOTS];
+    //Row and column of each currency in the cross rate matrix, -1 if the currency is unknown
+    int16_t index[RATE_SLOTS];
+    int count;
+    //count x count cross rates, from the row currency to the column currency
+    struct cross_rate *cross;
+    //Bumped by every reload, so clients can tell results of different tables apart
+    uint32_t generation;
+    //Identity of the file the table was loaded from, used to notice changes
+    struct timespec modified;
+    long size;
+    unsigned long inode;
+};
+
+/**
+ * Returns the slot of a currency code packed with packCurrency(), or -1 if it is not three upper case letters
+ */
+int rateSlot(uint32_t code);
+
+/**
+ * Reads a rates file into a new table
+ * Returns NULL if the file could not be read or holds no valid rates
+ */
+struct rate_table *loadRates(const char *path);
+
+void freeRates(struct rate_table *table);
+
+/**
+ * Writes the rate of a known currency the way it was written in the rates file, e.g. 120.69
+ * Returns the length of the text, which needs up to MAX_RATE_TEXT bytes
+ */
+int formatRate(const struct rate_table *table, int slot, char *text);
+
+/**
+ * Converts amounts between currencies with the cross rate matrix
+ * Amounts and results are in hundredths, a result is INVALID_AMOUNT if a currency is unknown or it does not fit
+ * Returns the number of amounts converted
+ *
+ * @param table:   rates to convert with
+ * @param amounts: n amounts, in hundredths of their source currency
+ * @param sources: n packed source currency codes
+ * @param dests:   n packed destination currency codes
+ * @param results: n converted amounts, in hundredths of their destination currency
+ */
+int convertAmounts(const struct rate_table *table, const int64_t *amounts, const uint32_t *sources,
+    const uint32_t *dests, int64_t *results, int n);
+
+/**
+ * Makes a table the one used for conversions and starts a thread that reloads it when the file at path changes
+ * Returns -1 if the thread could not be started
+ */
+int startRates(const char *path, struct rate_table *table);
+
+/**
+ * Returns the current table, which stays valid until the matching endRates()
+ * Never blocks, even while the table is being reloaded
+ */
+const struct rate_table *beginRates();
+
+void endRates();
+
+#endif
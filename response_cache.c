@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "response_cache.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define NO_ENTRY UINT32_MAX
+
+/**
+ * Returns the hash of a key, FNV-1a seeded with its service
+ */
+uint64_t keyHash(int service, const char *key, int key_length) {
+    uint64_t hash = 0xCBF29CE484222325ULL ^ (uint64_t) service;
+
+    for (int i = 0; i < key_length; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+int initCache(struct response_cache *cache, uint32_t capacity, size_t max_bytes) {
+    uint32_t bucket_count = 16;
+
+    while (bucket_count < capacity && bucket_count < (1U << 31)) bucket_count *= 2;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->capacity = capacity;
+    cache->max_bytes = max_bytes;
+    cache->mask = bucket_count - 1;
+    cache->entries = calloc(capacity, sizeof(struct cache_entry));
+    cache->buckets = malloc(bucket_count * sizeof(uint32_t));
+
+    if (cache->entries == NULL || cache->buckets == NULL) return -1;
+    memset(cache->buckets, 0xFF, bucket_count * sizeof(uint32_t));
+
+    return 0;
+}
+
+/**
+ * Unlinks an entry from its bucket and frees it
+ */
+void removeEntry(struct response_cache *cache, uint32_t index) {
+    struct cache_entry *entry = &cache->entries[index];
+    uint32_t *link = &cache->buckets[entry->hash & cache->mask];
+
+    while (*link != index) link = &cache->entries[*link].next;
+    *link = entry->next;
+
+    cache->bytes -= entry->key_length + (entry->state == CACHE_READY ? entry->value_length + 1 : 0);
+    cache->count--;
+    free(entry->data);
+    entry->data = NULL;
+    entry->state = CACHE_FREE;
+    entry->stamp++;
+}
+
+/**
+ * Moves the CLOCK hand to the next entry that can be used, evicting it if it is in use
+ * Returns the index of the entry, or NO_ENTRY if every entry other than keep is in use and referenced
+ *
+ * @param keep: entry that must not be evicted, or NO_ENTRY
+ */
+uint32_t evictEntry(struct response_cache *cache, uint32_t keep) {
+    //Two turns clear every mark on the first and are sure to find an entry on the second
+    for (uint64_t turns = 0; turns < 2 * (uint64_t) cache->capacity; turns++) {
+        uint32_t index = cache->hand;
+        struct cache_entry *entry = &cache->entries[index];
+
+        cache->hand = cache->hand + 1 == cache->capacity ? 0 : cache->hand + 1;
+
+        if (entry->state == CACHE_FREE) return index;
+        if (index == keep) continue;
+        if (entry->referenced) {
+            entry->referenced = FALSE;
+            continue;
+        }
+        removeEntry(cache, index);
+        cache->stats.evictions++;
+        return index;
+    }
+    return NO_ENTRY;
+}
+
+/**
+ * Returns the index of the entry holding a key, or NO_ENTRY
+ */
+uint32_t lookupEntry(const struct response_cache *cache, int service, uint64_t hash, const char *key, int key_length) {
+    for (uint32_t i = cache->buckets[hash & cache->mask]; i != NO_ENTRY; i = cache->entries[i].next) {
+        const struct cache_entry *entry = &cache->entries[i];
+
+        if (entry->hash == hash && entry->service == service && entry->key_length == key_length &&
+                memcmp(entry->data, key, key_length) == 0) {
+            return i;
+        }
+    }
+    return NO_ENTRY;
+}
+
+const struct cache_entry *findCached(struct response_cache *cache, int service, const char *key, int key_length, int64_t now) {
+    uint32_t index = cache->capacity == 0 ? NO_ENTRY : lookupEntry(cache, service, keyHash(service, key, key_length), key, key_length);
+    struct cache_entry *entry = index == NO_ENTRY ? NULL : &cache->entries[index];
+
+    if (entry != NULL && entry->epoch != cache->epochs[service]) {
+        //Left over from before the service was invalidated
+        removeEntry(cache, index);
+        entry = NULL;
+    } else if (entry != NULL && entry->state == CACHE_READY && entry->expires <= now) {
+        removeEntry(cache, index);
+        cache->stats.expired++;
+        entry = NULL;
+    }
+    if (entry == NULL || entry->state != CACHE_READY) {
+        cache->stats.misses++;
+        return NULL;
+    }
+    entry->referenced = TRUE;
+    cache->stats.hits++;
+
+    return entry;
+}
+
+uint32_t findFlight(const struct response_cache *cache, int service, const char *key, int key_length) {
+    uint32_t index = cache->capacity == 0 ? NO_ENTRY : lookupEntry(cache, service, keyHash(service, key, key_length), key, key_length);
+    const struct cache_entry *entry = index == NO_ENTRY ? NULL : &cache->entries[index];
+
+    if (entry == NULL || entry->state != CACHE_FILLING || entry->epoch != cache->epochs[service]) return 0;
+    return entry->flight;
+}
+
+uint64_t reserveCached(struct response_cache *cache, int service, const char *key, int key_length, uint32_t flight) {
+    if (cache->capacity == 0 || key_length > UINT16_MAX || (size_t) key_length > cache->max_bytes) return NO_TICKET;
+
+    uint64_t hash = keyHash(service, key, key_length);
+    uint32_t index = lookupEntry(cache, service, hash, key, key_length);
+
+    //A request for the same key is already out, either response fills the entry but the newer one is waited on
+    if (index != NO_ENTRY && cache->entries[index].state == CACHE_FILLING && cache->entries[index].epoch == cache->epochs[service]) {
+        cache->entries[index].flight = flight;
+        return ((uint64_t) cache->entries[index].stamp << 32) | index;
+    }
+    if (index != NO_ENTRY) removeEntry(cache, index);
+
+    if ((index = evictEntry(cache, NO_ENTRY)) == NO_ENTRY) return NO_TICKET;
+
+    struct cache_entry *entry = &cache->entries[index];
+    if ((entry->data = malloc(key_length)) == NULL) return NO_TICKET;
+
+    memcpy(entry->data, key, key_length);
+    entry->hash = hash;
+    entry->service = service;
+    entry->epoch = cache->epochs[service];
+    entry->key_length = key_length;
+    entry->value_length = 0;
+    entry->flight = flight;
+    entry->state = CACHE_FILLING;
+    //Give the response time to come back before the hand can take the entry
+    entry->referenced = TRUE;
+
+    entry->next = cache->buckets[hash & cache->mask];
+    cache->buckets[hash & cache->mask] = index;
+    cache->bytes += key_length;
+    cache->count++;
+
+    return ((uint64_t) entry->stamp << 32) | index;
+}
+
+void fillCached(struct response_cache *cache, uint64_t ticket, int status, const char *value, int length, int64_t expires) {
+    uint32_t index = (uint32_t) ticket;
+
+    if (ticket == NO_TICKET || index >= cache->capacity) return;
+
+    struct cache_entry *entry = &cache->entries[index];
+
+    if (entry->stamp != ticket >> 32 || entry->state != CACHE_FILLING) return;
+    if (expires == 0 || entry->epoch != cache->epochs[entry->service] || length > UINT16_MAX ||
+            entry->key_length + (size_t) length + 1 > cache->max_bytes) {
+        removeEntry(cache, index);
+        return;
+    }
+    //Make room for the response, but never by evicting the entry being filled
+    while (cache->bytes + length + 1 > cache->max_bytes && evictEntry(cache, index) != NO_ENTRY);
+
+    char *data = realloc(entry->data, entry->key_length + length + 1);
+
+    if (cache->bytes + length + 1 > cache->max_bytes || data == NULL) {
+        removeEntry(cache, index);
+        return;
+    }
+    entry->data = data;
+    memcpy(data + entry->key_length, value, length);
+    data[entry->key_length + length] = '\0';
+
+    entry->value_length = length;
+    entry->status = status;
+    entry->expires = expires;
+    entry->state = CACHE_READY;
+    cache->bytes += length + 1;
+}
+
+void invalidateCached(struct response_cache *cache, int service) {
+    cache->epochs[service]++;
+    cache->stats.invalidations++;
+}
+
+size_t cacheMemory(const struct response_cache *cache) {
+    return cache->bytes + (size_t) cache->capacity * sizeof(struct cache_entry) + ((size_t) cache->mask + 1) * sizeof(uint32_t);
+}
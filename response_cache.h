@@ -0,0 +1,137 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Cache of microservice responses kept by the indirection server
+ *
+ * Entries are keyed by the bytes of a request, and each belongs to a service. An entry is reserved when a
+ * request goes out to the microservice and filled when the response comes back, so the response does not
+ * need to carry its request. A filled entry is good until its time to live runs out, or until its service
+ * is invalidated: every service has an epoch, and entries reserved under an older epoch are stale.
+ *
+ * While an entry waits for its response it names the request in flight for it, so an identical request can
+ * wait on that one instead of being sent too. Responses that must not be kept, such as voting results, still
+ * get an entry while they are in flight and it is freed as soon as the response comes back.
+ *
+ * Entries live in a fixed array swept by a CLOCK hand. A hit marks the entry as referenced, and when room
+ * is needed the hand evicts the first entry that has not been referenced since it last went by, clearing
+ * the mark of every entry it passes. Chained buckets map the hash of a key to its entry. The cache is
+ * bounded both by the number of entries and by the bytes of keys and responses they hold.
+ *
+ * A cache is not thread safe, each worker of the indirection server keeps its own.
+ */
+
+//Number of services whose entries can be invalidated separately
+#define MAX_CACHE_SERVICES 8
+//Ticket of a request whose response is not to be cached
+#define NO_TICKET UINT64_MAX
+
+enum cache_entry_state {
+    CACHE_FREE,
+    CACHE_FILLING,  //Reserved, waiting for the response
+    CACHE_READY
+};
+
+struct cache_entry {
+    uint64_t hash;
+    //The key followed by the response and a NUL
+    char *data;
+    //Monotonic time in milliseconds the response expires at
+    int64_t expires;
+    //Id of the request the response is waiting on, while the entry is filling
+    uint32_t flight;
+    //Next entry in the same bucket
+    uint32_t next;
+    //Bumped every time the entry is freed, so a ticket for an earlier use of the entry is not mistaken for one of its own
+    uint32_t stamp;
+    uint32_t epoch;
+    uint16_t key_length;
+    uint16_t value_length;
+    uint8_t service;
+    uint8_t state;
+    uint8_t referenced;
+    uint8_t status;
+};
+
+/**
+ * Counters since the cache was created
+ */
+struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long expired;
+    unsigned long invalidations;
+};
+
+struct response_cache {
+    struct cache_entry *entries;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t hand;
+    //Number of buckets minus 1, the number of buckets is a power of 2
+    uint32_t mask;
+    uint32_t *buckets;
+    //Bytes of keys and responses held, and the most they can take up
+    size_t bytes;
+    size_t max_bytes;
+    uint32_t epochs[MAX_CACHE_SERVICES];
+    struct cache_stats stats;
+};
+
+/**
+ * Sets up an empty cache
+ * Returns -1 if there is not enough memory
+ *
+ * @param cache:     cache to set up
+ * @param capacity:  most entries the cache holds
+ * @param max_bytes: most bytes of keys and responses the cache holds
+ */
+int initCache(struct response_cache *cache, uint32_t capacity, size_t max_bytes);
+
+/**
+ * Returns the filled entry of a key, or NULL if the key has no fresh response
+ * The response is entry->data + entry->key_length, and is NUL terminated
+ *
+ * @param now: monotonic time in milliseconds
+ */
+const struct cache_entry *findCached(struct response_cache *cache, int service, const char *key, int key_length, int64_t now);
+
+/**
+ * Returns the id of the request in flight for a key, or 0 if no request for the key is waiting on a response
+ */
+uint32_t findFlight(const struct response_cache *cache, int service, const char *key, int key_length);
+
+/**
+ * Reserves an entry for the response to a request that is being sent
+ * Returns the ticket to fill the entry with, or NO_TICKET if the key cannot be cached
+ *
+ * @param flight: id of the request, found by findFlight() until the response comes back
+ */
+uint64_t reserveCached(struct response_cache *cache, int service, const char *key, int key_length, uint32_t flight);
+
+/**
+ * Stores the response to a reserved request, unless the entry was evicted or its service invalidated since
+ *
+ * @param ticket: ticket given by reserveCached()
+ * @param status: status of the response, kept with it
+ * @param value:  the response
+ * @param length: length of the response
+ * @param expires: monotonic time in milliseconds the response expires at, 0 if it is not to be kept
+ */
+void fillCached(struct response_cache *cache, uint64_t ticket, int status, const char *value, int length, int64_t expires);
+
+/**
+ * Makes every entry of a service stale, including those still waiting for their response
+ */
+void invalidateCached(struct response_cache *cache, int service);
+
+/**
+ * Returns the bytes of memory the cache takes up, its tables included
+ */
+size_t cacheMemory(const struct response_cache *cache);
+
+#endif
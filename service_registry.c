@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "service_registry.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define MAX_LINE_SIZE 256
+
+/**
+ * The registry in use, copied by readers under the lock
+ */
+struct service_registry current_registry;
+unsigned long registry_version = 0;
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Records which version of the registry file a registry was loaded from
+ * Returns -1 if the file does not exist
+ */
+int registryIdentity(const char *path, struct timespec *modified, long *size, unsigned long *inode) {
+    struct stat st;
+
+    if (stat(path, &st) < 0) return -1;
+
+    *modified = st.st_mtim;
+    *size = st.st_size;
+    *inode = st.st_ino;
+    return 0;
+}
+
+int loadRegistry(const char *path, const char **names, int service_count, unsigned int optional, struct service_registry *registry) {
+    FILE *file = fopen(path, "r");
+    char line[MAX_LINE_SIZE];
+    int line_number = 0;
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    memset(registry, 0, sizeof(*registry));
+    registry->service_count = service_count;
+    registryIdentity(path, &registry->modified, &registry->size, &registry->inode);
+
+    while (fgets(line, MAX_LINE_SIZE, file) != NULL) {
+        char name[32], host[64], port_text[MAX_RING_NAME + 1];
+        struct in_addr address;
+        int port = 0, service = -1;
+
+        line_number++;
+        //Skip blank lines and comments
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') continue;
+
+        if (sscanf(line, "%31s %63s %32s", name, host, port_text) == 3) {
+            for (int i = 0; i < service_count; i++) {
+                if (strcmp(name, names[i]) == 0) service = i;
+            }
+        }
+        //A ring is named where the port would be
+        int is_ring = service >= 0 && strcmp(host, "ring") == 0;
+
+        if (is_ring && strlen(port_text) >= MAX_RING_NAME) {
+            fprintf(stderr, "[WARNING]: %s:%d: ring names are at most %d characters long\n", path, line_number, MAX_RING_NAME - 1);
+            continue;
+        }
+        if (service >= 0 && !is_ring) port = atoi(port_text);
+        if (service < 0 || (!is_ring && (inet_pton(AF_INET, host, &address) != 1 || port <= 0 || port > 65535))) {
+            fprintf(stderr, "[WARNING]: %s:%d: expected a service, an IPv4 address and a port, or ring and a name\n", path, line_number);
+            continue;
+        }
+        if (registry->counts[service] == MAX_REPLICAS) {
+            fprintf(stderr, "[WARNING]: %s:%d: %s already has %d replicas\n", path, line_number, name, MAX_REPLICAS);
+            continue;
+        }
+        struct replica_address *replica = &registry->replicas[service][registry->counts[service]++];
+
+        if (is_ring) {
+            strcpy(replica->ring, port_text);
+        } else {
+            strcpy(replica->host, host);
+            replica->port = port;
+        }
+    }
+    fclose(file);
+
+    for (int i = 0; i < service_count; i++) {
+        if (registry->counts[i] == 0 && !(optional & (1U << i))) {
+            fprintf(stderr, "[ERROR]: %s has no replica for %s!\n", path, names[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Publishes a registry to the readers
+ */
+void publishRegistry(const struct service_registry *registry) {
+    pthread_mutex_lock(&registry_lock);
+    current_registry = *registry;
+    __atomic_add_fetch(&registry_version, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+unsigned long registryVersion() {
+    return __atomic_load_n(&registry_version, __ATOMIC_ACQUIRE);
+}
+
+unsigned long copyRegistry(struct service_registry *dest) {
+    pthread_mutex_lock(&registry_lock);
+    *dest = current_registry;
+    unsigned long version = registry_version;
+    pthread_mutex_unlock(&registry_lock);
+
+    return version;
+}
+
+/**
+ * Arguments of the reloader thread
+ */
+struct registry_reloader {
+    const char *path;
+    const char **names;
+    unsigned int optional;
+};
+
+/**
+ * Reloader thread, checks the registry file every REGISTRY_RELOAD_INTERVAL seconds and publishes it again when it changes
+ */
+void *reloadRegistry(void *arg) {
+    struct registry_reloader *reloader = arg;
+    struct service_registry *registry = malloc(sizeof(struct service_registry));
+
+    if (registry == NULL) {
+        fprintf(stderr, "[ERROR]: Not enough memory to reload the services!\n");
+        return NULL;
+    }
+    while (TRUE) {
+        struct timespec modified;
+        unsigned long inode;
+        long size;
+
+        sleep(REGISTRY_RELOAD_INTERVAL);
+
+        //Editors often replace the file rather than write to it, so the inode counts as a change too
+        if (registryIdentity(reloader->path, &modified, &size, &inode) < 0) continue;
+        if (modified.tv_sec == current_registry.modified.tv_sec && modified.tv_nsec == current_registry.modified.tv_nsec &&
+                size == current_registry.size && inode == current_registry.inode) continue;
+
+        //Keep the replicas in use if the new file is broken, but do not report it again until it changes
+        if (loadRegistry(reloader->path, reloader->names, current_registry.service_count, reloader->optional, registry) < 0) {
+            copyRegistry(registry);
+            registry->modified = modified;
+            registry->size = size;
+            registry->inode = inode;
+            publishRegistry(registry);
+            continue;
+        }
+        publishRegistry(registry);
+
+        printf("Reloaded the services from %s\n", reloader->path);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+int startRegistry(const char *path, const char **names, unsigned int optional, const struct service_registry *registry) {
+    static struct registry_reloader reloader;
+    pthread_t thread;
+
+    reloader.path = path;
+    reloader.names = names;
+    reloader.optional = optional;
+    publishRegistry(registry);
+
+    if (pthread_create(&thread, NULL, reloadRegistry, &reloader) != 0) return -1;
+    pthread_detach(thread);
+
+    return 0;
+}
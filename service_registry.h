@@ -0,0 +1,76 @@
+#ifndef SERVICE_REGISTRY_H
+#define SERVICE_REGISTRY_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+#include "shm_ring.h"
+
+/*
+ * Replicas of the microservices the indirection server forwards requests to
+ *
+ * Replicas are read from a file of "service<TAB>address<TAB>port" lines, and a service is listed on as many
+ * lines as it has replicas. A replica running on the same machine can be reached through shared memory
+ * instead, with a "service<TAB>ring<TAB>name" line naming the ring it serves (see shm_ring.h). A reloader
+ * thread watches the file and publishes the replicas again whenever it changes, so replicas can be added or
+ * removed without restarting. Every service needs at least one replica, unless it is optional: a file that
+ * leaves one out is reported and the previous replicas stay in use.
+ *
+ * Readers copy the registry whenever its version changes, so each thread can keep using its copy without
+ * locking while a reload is in progress.
+ */
+
+//Most services and replicas per service the registry holds
+#define MAX_SERVICES 8
+#define MAX_REPLICAS 16
+//Seconds between checks of the registry file
+#define REGISTRY_RELOAD_INTERVAL 1
+
+struct replica_address {
+    char host[INET_ADDRSTRLEN];
+    int port;
+    //Name of the ring the replica serves, empty if it is reached over UDP
+    char ring[MAX_RING_NAME];
+};
+
+struct service_registry {
+    int service_count;
+    int counts[MAX_SERVICES];
+    struct replica_address replicas[MAX_SERVICES][MAX_REPLICAS];
+    //Identity of the file the registry was loaded from, used to notice changes
+    struct timespec modified;
+    long size;
+    unsigned long inode;
+};
+
+/**
+ * Reads a registry file
+ * Returns -1 if the file could not be read or a service that is not optional has no replica
+ *
+ * @param path:          file of replicas
+ * @param names:         name of each service, as used in the file
+ * @param service_count: number of services
+ * @param optional:      bit mask of the services that can be left out of the file
+ * @param registry:      registry to fill in
+ */
+int loadRegistry(const char *path, const char **names, int service_count, unsigned int optional, struct service_registry *registry);
+
+/**
+ * Makes a registry the one in use and starts a thread that reloads it when the file at path changes
+ * Returns -1 if the thread could not be started
+ */
+int startRegistry(const char *path, const char **names, unsigned int optional, const struct service_registry *registry);
+
+/**
+ * Returns the version of the registry in use, bumped by every reload
+ * Never blocks
+ */
+unsigned long registryVersion();
+
+/**
+ * Copies the registry in use
+ * Returns the version of the copy
+ */
+unsigned long copyRegistry(struct service_registry *dest);
+
+#endif
@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+#include "shm_ring.h"
+
+#define TRUE 1
+#define FALSE 0
+
+//Abstract unix sockets have no file, the name only has to be unique on the machine
+#define RING_SOCKET_PREFIX "microservice-demo/"
+
+struct ring_slot *claimSlot(struct ring *ring) {
+    //The consumer frees slots by moving the head, the acquire keeps the slot from being refilled before it is read
+    if (ring->claimed - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= RING_SLOTS) return NULL;
+
+    return &ring->slots[ring->claimed++ & (RING_SLOTS - 1)];
+}
+
+void publishSlots(struct ring *ring) {
+    __atomic_store_n(&ring->tail, ring->claimed, __ATOMIC_RELEASE);
+}
+
+struct ring_slot *peekSlot(struct ring *ring) {
+    uint32_t head = ring->head;
+
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != head ? &ring->slots[head & (RING_SLOTS - 1)] : NULL;
+}
+
+int copySlot(const struct ring_slot *slot, char *datagram) {
+    //Checked and used as one value, a length changed in between cannot overrun the buffer
+    uint32_t length = __atomic_load_n(&slot->length, __ATOMIC_ACQUIRE);
+
+    if (length > MAX_DATAGRAM_SIZE) length = MAX_DATAGRAM_SIZE;
+    memcpy(datagram, slot->data, length);
+    return length;
+}
+
+void consumeSlot(struct ring *ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void wakeConsumer(struct ring *ring, int wake_fd) {
+    uint64_t one = 1;
+
+    //Pairs with the fence of prepareSleep(): either the consumer sees the published slot, or this sees it sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_ACQ_REL)) {
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("write");
+    }
+}
+
+int prepareSleep(struct ring *ring) {
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (peekSlot(ring) != NULL) {
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Empties a ring, only while nobody produces or consumes on it
+ */
+void resetRing(struct ring *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->claimed = 0;
+    ring->sleeping = 0;
+}
+
+/**
+ * Returns the monotonic time in milliseconds
+ */
+int64_t ringMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Fills in the address of the socket of a ring
+ * Returns the length of the address
+ */
+socklen_t ringAddress(const char *name, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    //The leading NUL puts the socket in the abstract namespace
+    int length = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "%s%s", RING_SOCKET_PREFIX, name);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + length;
+}
+
+/**
+ * Sends a number along with file descriptors over a unix socket
+ * Returns -1 if it could not be sent
+ */
+int sendFds(int socket_fd, int32_t value, const int *fds, int count) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {&value, sizeof(value)};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    if (count > 0) {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+    }
+    return sendmsg(socket_fd, &message, MSG_NOSIGNAL) == sizeof(value) ? 0 : -1;
+}
+
+/**
+ * Receives a number along with up to max file descriptors over a unix socket
+ * Returns the number of file descriptors received, or -1 with errno set to EAGAIN if nothing was received yet,
+ * or to ECONNRESET if the other side has closed the socket
+ */
+int receiveFds(int socket_fd, int32_t *value, int *fds, int max) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {value, sizeof(*value)};
+    struct msghdr message;
+    int count = 0;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(max * sizeof(int));
+
+    ssize_t bytes = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+
+    if (bytes != sizeof(*value)) {
+        if (bytes >= 0) errno = ECONNRESET;
+        return -1;
+    }
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (count > max) count = max;
+            memcpy(fds, CMSG_DATA(header), count * sizeof(int));
+        }
+    }
+    return count;
+}
+
+int createRing(const char *name, struct ring_server *server) {
+    struct sockaddr_un address;
+    socklen_t length = ringAddress(name, &address);
+
+    memset(server, 0, sizeof(*server));
+    for (int i = 0; i < MAX_RING_CLIENTS; i++) {
+        server->client_fds[i] = -1;
+        server->client_wake_fds[i] = -1;
+    }
+    if (strlen(name) >= MAX_RING_NAME) return -1;
+
+    //The segment lives in an anonymous memory file, so nothing is left behind when the microservice exits
+    if ((server->memory_fd = memfd_create(name, MFD_CLOEXEC)) < 0 || ftruncate(server->memory_fd, sizeof(struct ring_segment)) < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    server->segment = mmap(NULL, sizeof(struct ring_segment), PROT_READ | PROT_WRITE, MAP_SHARED, server->memory_fd, 0);
+    if (server->segment == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if ((server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+            (server->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(server->listen_fd, (struct sockaddr *) &address, length) < 0 || listen(server->listen_fd, MAX_RING_CLIENTS) < 0) {
+        perror("bind");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Frees the rings of a client that left or did not finish its handshake
+ */
+void detachClient(struct ring_server *server, int client) {
+    close(server->client_fds[client]);
+    if (server->client_wake_fds[client] >= 0) close(server->client_wake_fds[client]);
+    server->client_fds[client] = -1;
+    server->client_wake_fds[client] = -1;
+}
+
+/**
+ * Gives the rings of a client that connected to it, its handshake goes on in serveRingClients()
+ * A client is turned away by closing its socket if every ring is in use
+ */
+void acceptClient(struct ring_server *server, int socket_fd) {
+    for (int i = 0; i < MAX_RING_CLIENTS; i++) {
+        if (server->client_fds[i] < 0) {
+            server->client_fds[i] = socket_fd;
+            server->handshake_started[i] = ringMillis();
+            return;
+        }
+    }
+    fprintf(stderr, "[WARNING]: A client was turned away, all %d rings are in use\n", MAX_RING_CLIENTS);
+    close(socket_fd);
+}
+
+/**
+ * Answers a client in its handshake once it has sent its eventfd, with its rings, the segment and the eventfd
+ * of the microservice
+ */
+void finishClient(struct ring_server *server, int client) {
+    int32_t value;
+    int wake_fd, count = receiveFds(server->client_fds[client], &value, &wake_fd, 1);
+
+    if (count < 0 && errno == EAGAIN) return;
+    if (count != 1) {
+        detachClient(server, client);
+        return;
+    }
+    //Whatever the previous client of the rings left in them is dropped, even a slot it never published
+    resetRing(&server->segment->requests[client]);
+    resetRing(&server->segment->responses[client]);
+
+    int fds[2] = {server->memory_fd, server->wake_fd};
+
+    server->client_wake_fds[client] = wake_fd;
+    //The socket has room for so short a message, a client that cannot take it is dropped
+    if (sendFds(server->client_fds[client], client, fds, 2) < 0) detachClient(server, client);
+}
+
+void serveRingClients(struct ring_server *server, int timeout) {
+    struct pollfd fds[MAX_RING_CLIENTS + 2];
+    int clients[MAX_RING_CLIENTS + 2];
+    int count = 2, socket_fd;
+    int64_t now = ringMillis();
+    uint64_t wakeups;
+
+    fds[0].fd = server->wake_fd;
+    fds[1].fd = server->listen_fd;
+    for (int i = 0; i < MAX_RING_CLIENTS; i++) {
+        if (server->client_fds[i] < 0) continue;
+
+        if (server->client_wake_fds[i] < 0) {
+            int64_t left = server->handshake_started[i] + HANDSHAKE_TIMEOUT * 1000 - now;
+
+            //A client that connects and then says nothing only holds on to its rings for so long
+            if (left <= 0) {
+                detachClient(server, i);
+                continue;
+            }
+            if (timeout < 0 || timeout > left) timeout = left;
+        } else if (timeout != 0 && prepareSleep(&server->segment->requests[i]) < 0) {
+            timeout = 0;
+        }
+        fds[count].fd = server->client_fds[i];
+        clients[count++] = i;
+    }
+    for (int i = 0; i < count; i++) {
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    int ready = poll(fds, count, timeout);
+
+    for (int i = 0; i < MAX_RING_CLIENTS; i++) {
+        if (server->client_wake_fds[i] >= 0) __atomic_store_n(&server->segment->requests[i].sleeping, 0, __ATOMIC_RELAXED);
+    }
+    if (ready <= 0) return;
+
+    if ((fds[0].revents & POLLIN) && read(server->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) perror("read");
+
+    for (int i = 2; i < count; i++) {
+        if (fds[i].revents == 0) continue;
+
+        //Clients send nothing once they are attached, so a readable socket means the client is gone
+        if (server->client_wake_fds[clients[i]] >= 0) {
+            detachClient(server, clients[i]);
+        } else {
+            finishClient(server, clients[i]);
+        }
+    }
+    if (fds[1].revents & POLLIN) {
+        while ((socket_fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            acceptClient(server, socket_fd);
+        }
+    }
+}
+
+int connectRing(const char *name, int wake_fd, struct ring_link *link) {
+    struct sockaddr_un address;
+    socklen_t length = ringAddress(name, &address);
+
+    link->segment = NULL;
+    link->wake_fd = wake_fd;
+    link->service_fd = -1;
+
+    if ((link->socket_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) return -1;
+
+    //Connecting to a unix socket does not wait for the microservice, it is done or refused straight away
+    //The microservice answers the eventfd once it gets to it, with the rings, the segment and its own eventfd
+    if (connect(link->socket_fd, (struct sockaddr *) &address, length) < 0 || sendFds(link->socket_fd, 0, &wake_fd, 1) < 0) {
+        detachRing(link);
+        return -1;
+    }
+    return 0;
+}
+
+int finishRing(struct ring_link *link) {
+    int32_t client;
+    int fds[2], count = receiveFds(link->socket_fd, &client, fds, 2);
+
+    if (count < 0 && errno == EAGAIN) return 1;
+    if (count != 2) {
+        for (int i = 0; i < count; i++) close(fds[i]);
+        detachRing(link);
+        return -1;
+    }
+    link->segment = mmap(NULL, sizeof(struct ring_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    link->service_fd = fds[1];
+    link->client = client;
+    close(fds[0]);
+
+    if (link->segment == MAP_FAILED || client < 0 || client >= MAX_RING_CLIENTS) {
+        if (link->segment == MAP_FAILED) link->segment = NULL;
+        detachRing(link);
+        return -1;
+    }
+    return 0;
+}
+
+int attachRing(const char *name, int wake_fd, struct ring_link *link) {
+    if (connectRing(name, wake_fd, link) < 0) return -1;
+
+    struct pollfd fd = {link->socket_fd, POLLIN, 0};
+
+    if (poll(&fd, 1, HANDSHAKE_TIMEOUT * 1000) <= 0) {
+        detachRing(link);
+        return -1;
+    }
+    return finishRing(link) == 0 ? 0 : -1;
+}
+
+void detachRing(struct ring_link *link) {
+    if (link->segment != NULL) munmap(link->segment, sizeof(struct ring_segment));
+    if (link->socket_fd >= 0) close(link->socket_fd);
+    if (link->service_fd >= 0) close(link->service_fd);
+
+    link->segment = NULL;
+    link->socket_fd = -1;
+    link->service_fd = -1;
+}
+
+int isRingAttached(const struct ring_link *link) {
+    struct pollfd fd = {link->socket_fd, POLLIN, 0};
+
+    //The microservice sends nothing once the client is attached, so a readable socket means it has exited
+    return link->segment != NULL && poll(&fd, 1, 0) == 0;
+}
+
+int sendRing(struct ring_link *link, const char *datagram, int length) {
+    struct ring *ring = link->segment == NULL ? NULL : &link->segment->requests[link->client];
+    struct ring_slot *slot;
+
+    if (ring == NULL) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (length > MAX_DATAGRAM_SIZE || (slot = claimSlot(ring)) == NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+    memcpy(slot->data, datagram, length);
+    slot->length = length;
+    publishSlots(ring);
+    wakeConsumer(ring, link->service_fd);
+
+    return length;
+}
+
+int receiveRing(struct ring_link *link, char *datagram) {
+    struct ring *ring = link->segment == NULL ? NULL : &link->segment->responses[link->client];
+    struct ring_slot *slot;
+
+    while (ring != NULL && (slot = peekSlot(ring)) != NULL) {
+        int length = copySlot(slot, datagram);
+
+        consumeSlot(ring);
+        //The microservice publishes an empty slot for a request it had no response to
+        if (length > 0) return length;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+int sleepRing(struct ring_link *link) {
+    if (link->segment == NULL) return 0;
+    return prepareSleep(&link->segment->responses[link->client]);
+}
+
+void clearRing(struct ring_link *link) {
+    uint64_t wakeups;
+
+    if (read(link->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) perror("read");
+}
+
+int waitRing(struct ring_link *link, int timeout) {
+    struct pollfd fd = {link->wake_fd, POLLIN, 0};
+
+    if (link->segment == NULL) return -1;
+    if (sleepRing(link) < 0) return 0;
+
+    int ready = poll(&fd, 1, timeout);
+
+    __atomic_store_n(&link->segment->responses[link->client].sleeping, 0, __ATOMIC_RELAXED);
+    clearRing(link);
+
+    return ready > 0 || peekSlot(&link->segment->responses[link->client]) != NULL ? 0 : -1;
+}
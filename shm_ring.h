@@ -0,0 +1,214 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+
+#include "datagram.h"
+
+/*
+ * Shared memory transport between the indirection server and microservices running on the same machine
+ *
+ * A microservice serving a ring maps one shared memory segment holding a request ring and a response ring for
+ * each client, and listens on an abstract unix socket named after the ring. A client, such as a worker of the
+ * indirection server, attaches by connecting to the socket and handing over an eventfd of its own: it is given
+ * the segment, the index of its rings and the eventfd of the microservice. Neither side blocks on the other
+ * during this handshake, so a client that never finishes it cannot stall the microservice, nor a microservice
+ * that never answers the client. The socket stays open while the client is attached, so the microservice can
+ * empty its rings and give them to another client once it closes, whatever state the client left them in.
+ *
+ * Rings carry the same datagrams as UDP, each copied once into a slot. Every ring has a single producer and a
+ * single consumer, so it is a bounded queue that needs no locks: the producer fills slots and publishes them by
+ * moving the tail, the consumer reads them and frees them by moving the head. While both sides are busy nothing
+ * but shared memory is touched. A consumer about to wait marks its ring as sleeping, and only then does the
+ * producer write to its eventfd.
+ */
+
+//Slots of each ring, a power of 2
+#define RING_SLOTS 512
+//Most clients attached to a ring at once
+#define MAX_RING_CLIENTS 16
+//Longest name of a ring, its terminating NUL included
+#define MAX_RING_NAME 32
+//Seconds either side waits for the other during a handshake
+#define HANDSHAKE_TIMEOUT 1
+
+struct ring_slot {
+    uint32_t length;
+    char data[MAX_DATAGRAM_SIZE];
+};
+
+/**
+ * The consumer and the producer each write to their own cache line
+ */
+struct ring {
+    //Position of the next slot to consume, only written by the consumer
+    uint32_t head __attribute__((aligned(64)));
+    //Position of the next slot to publish, and of the next slot to claim, only written by the producer
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t claimed;
+    //Set by the consumer before it waits on its eventfd, cleared by the producer that wakes it
+    uint32_t sleeping __attribute__((aligned(64)));
+    struct ring_slot slots[RING_SLOTS] __attribute__((aligned(64)));
+};
+
+struct ring_segment {
+    struct ring requests[MAX_RING_CLIENTS];
+    struct ring responses[MAX_RING_CLIENTS];
+};
+
+/**
+ * A ring as served by a microservice
+ */
+struct ring_server {
+    struct ring_segment *segment;
+    //Memory file of the segment, handed to every client that attaches
+    int memory_fd;
+    int listen_fd;
+    //Eventfd the microservice waits on while every request ring is empty
+    int wake_fd;
+    //Socket and eventfd of each client, -1 if its rings are free
+    //A client with a socket but no eventfd yet is still in its handshake, which it started at the given time
+    int client_fds[MAX_RING_CLIENTS];
+    int client_wake_fds[MAX_RING_CLIENTS];
+    int64_t handshake_started[MAX_RING_CLIENTS];
+};
+
+/**
+ * A client's end of a ring
+ */
+struct ring_link {
+    //NULL while the client is not attached
+    struct ring_segment *segment;
+    int client;
+    //-1 while the client is not attached, and not in its handshake either
+    int socket_fd;
+    //Eventfd of the client, made by its caller so it can stay registered with epoll while the ring is attached again
+    int wake_fd;
+    //Eventfd of the microservice
+    int service_fd;
+};
+
+/**
+ * Returns the slot the producer can fill next, or NULL if the ring is full
+ * A slot is only seen by the consumer once it is published
+ */
+struct ring_slot *claimSlot(struct ring *ring);
+
+/**
+ * Hands every slot claimed so far over to the consumer
+ */
+void publishSlots(struct ring *ring);
+
+/**
+ * Returns the next published slot, or NULL if there is none
+ * Only the consumer of the ring can call it
+ */
+struct ring_slot *peekSlot(struct ring *ring);
+
+/**
+ * Copies the datagram of a published slot out of shared memory
+ * The other process can still write to the slot, so its length is read once and the copy is what gets parsed
+ * Returns the length of the datagram
+ *
+ * @param datagram: buffer of MAX_DATAGRAM_SIZE bytes
+ */
+int copySlot(const struct ring_slot *slot, char *datagram);
+
+/**
+ * Gives the slot returned by peekSlot() back to the producers
+ */
+void consumeSlot(struct ring *ring);
+
+/**
+ * Wakes the consumer of a ring through its eventfd, if it is sleeping
+ * Called by a producer once it has published its slots
+ */
+void wakeConsumer(struct ring *ring, int wake_fd);
+
+/**
+ * Marks a ring as sleeping, so the next slot published wakes its consumer
+ * Returns -1, and leaves the ring awake, if a slot is already waiting
+ */
+int prepareSleep(struct ring *ring);
+
+/**
+ * Creates the segment of a ring and starts listening for clients
+ * Returns -1 if the ring could not be created, or is already served by another process
+ */
+int createRing(const char *name, struct ring_server *server);
+
+/**
+ * Takes the handshakes of clients connecting a step further, and frees the rings of the clients that left
+ * Handshakes that take longer than HANDSHAKE_TIMEOUT seconds are dropped
+ * Waits up to timeout milliseconds for a client or for a request, -1 to wait as long as it takes: the request
+ * rings are marked as sleeping while it waits, and it returns at once if a request is already waiting
+ */
+void serveRingClients(struct ring_server *server, int timeout);
+
+/**
+ * Starts attaching to a ring served by a microservice, without waiting for it to answer
+ * The link's socket_fd becomes readable once it does, call finishRing() then
+ * Returns -1 if no microservice serves the ring
+ *
+ * @param name:    name of the ring
+ * @param wake_fd: non-blocking eventfd the microservice writes to when a response arrives while the ring sleeps
+ * @param link:    client end to fill in
+ */
+int connectRing(const char *name, int wake_fd, struct ring_link *link);
+
+/**
+ * Finishes attaching to a ring once the microservice has answered
+ * Returns 0 once attached, 1 if there is no answer yet, or -1 if the microservice turned the client away or
+ * left, and then detaches the link
+ */
+int finishRing(struct ring_link *link);
+
+/**
+ * Attaches to a ring, waiting up to HANDSHAKE_TIMEOUT seconds for the microservice to answer
+ * For clients that have nothing else to do in the meantime
+ * Returns -1 if no microservice serves the ring or all its rings are in use
+ */
+int attachRing(const char *name, int wake_fd, struct ring_link *link);
+
+/**
+ * Detaches from a ring, or gives up attaching to it, the wake_fd is left open
+ */
+void detachRing(struct ring_link *link);
+
+/**
+ * Returns TRUE if the link is attached and the microservice is still serving the ring
+ */
+int isRingAttached(const struct ring_link *link);
+
+/**
+ * Copies a datagram into the request ring and wakes the microservice if it sleeps
+ * Returns the length of the datagram, or -1 with errno set to EAGAIN if the ring is full or ENOTCONN if it is not attached
+ */
+int sendRing(struct ring_link *link, const char *datagram, int length);
+
+/**
+ * Copies the next response out of the response ring
+ * Returns its length, or -1 with errno set to EAGAIN if there is none
+ *
+ * @param datagram: buffer of MAX_DATAGRAM_SIZE bytes
+ */
+int receiveRing(struct ring_link *link, char *datagram);
+
+/**
+ * Marks the response ring as sleeping, see prepareSleep()
+ * Returns -1 if a response is already waiting
+ */
+int sleepRing(struct ring_link *link);
+
+/**
+ * Clears a wakeup of the client's eventfd
+ */
+void clearRing(struct ring_link *link);
+
+/**
+ * Waits up to timeout milliseconds for a response, for clients that have nothing else to wait on
+ * Returns -1 if none arrived
+ */
+int waitRing(struct ring_link *link, int timeout);
+
+#endif
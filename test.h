@@ -0,0 +1,40 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+/*
+ * Checks shared by the standalone test programs
+ *
+ * Each test program is a single file: it calls expect() for every check it makes, and returns finishTests()
+ * from main, so it prints the checks that failed and exits with status 1 if any did.
+ */
+
+static int test_failures = 0;
+static int test_checks = 0;
+
+/**
+ * Counts a check, and reports it if it failed
+ */
+static inline void expect(int condition, const char *description) {
+    test_checks++;
+    if (!condition) {
+        fprintf(stderr, "[FAIL]: %s\n", description);
+        test_failures++;
+    }
+}
+
+/**
+ * Prints how many checks passed
+ * Returns the status to exit with, 1 if any check failed
+ */
+static inline int finishTests() {
+    if (test_failures > 0) {
+        printf("%d of %d checks failed\n", test_failures, test_checks);
+        return 1;
+    }
+    printf("All %d checks passed\n", test_checks);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "datagram.h"
+#include "rates.h"
+#include "test.h"
+
+#define TRUE 1
+#define FALSE 0
+
+//Amounts converted in one call, more than a block of convertAmounts() so the blocks are checked to line up
+#define REPEATED_CONVERSIONS 1000
+
+/*
+ * Checks the amounts the currency server converts against values worked out by hand, in particular how they are
+ * rounded to the nearest hundredth
+ */
+
+//Rates picked so that conversions land on halves of a hundredth, some of them with rates such as 0.29 and 1.15
+//that binary fractions cannot hold exactly. The expected results are worked out in decimal
+const char *test_rates =
+    "# Units of each currency worth 1 CAD\n"
+    "CAD\t1\n"
+    "USD\t0.75\n"
+    "HLF\t0.5\n"
+    "QTR\t4\n"
+    "JPY\t120.69\n"
+    "ABC\t0.29\n"
+    "DEF\t1.15\n"
+    "TNY\t0.000000000000000001\n"
+    "BIG\t100000000000000000\n";
+
+/**
+ * An amount in hundredths and what it converts to
+ */
+struct conversion {
+    const char *source;
+    const char *dest;
+    int64_t amount;
+    int64_t expected;
+    const char *description;
+};
+
+struct conversion conversions[] = {
+    {"CAD", "CAD", 12345, 12345, "a currency converts to itself unchanged"},
+    {"CAD", "USD", 10000, 7500, "whole amounts are converted exactly"},
+    {"CAD", "JPY", 10000, 1206900, "rates with decimals are converted exactly"},
+    {"JPY", "CAD", 1206900, 10000, "the inverse of a rate is converted exactly"},
+    {"QTR", "CAD", 1, 0, "a quarter of a hundredth rounds down"},
+    {"CAD", "USD", 1, 1, "three quarters of a hundredth round up"},
+    {"CAD", "HLF", 1, 1, "half a hundredth rounds up"},
+    {"CAD", "HLF", 3, 2, "one and a half hundredths round up"},
+    {"CAD", "HLF", -1, -1, "minus half a hundredth rounds down"},
+    {"CAD", "HLF", -3, -2, "minus one and a half hundredths round down"},
+    {"QTR", "HLF", 20, 3, "halves are rounded away from zero between two foreign currencies"},
+    {"QTR", "HLF", -20, -3, "negative halves are rounded away from zero between two foreign currencies"},
+    {"CAD", "USD", -5, -4, "negative amounts round like positive ones"},
+    {"JPY", "CAD", 100, 1, "a yen is worth about a cent"},
+    {"JPY", "CAD", 60, 0, "less than half a cent in yen rounds to nothing"},
+    {"HLF", "QTR", 1000000000000000000LL, 8000000000000000000LL, "large amounts are converted exactly"},
+    {"HLF", "QTR", 2000000000000000000LL, INVALID_AMOUNT, "an amount too large for its result is invalid"},
+    {"CAD", "ABC", 50, 15, "half a hundredth at a decimal rate rounds up"},
+    {"CAD", "ABC", -50, -15, "minus half a hundredth at a decimal rate rounds down"},
+    {"CAD", "DEF", 10, 12, "eleven and a half hundredths at a decimal rate round up"},
+    {"CAD", "DEF", 30, 35, "thirty four and a half hundredths at a decimal rate round up"},
+    {"CAD", "DEF", -30, -35, "minus thirty four and a half hundredths at a decimal rate round down"},
+    {"ABC", "DEF", 29, 115, "the cross rate of two decimal rates is exact"},
+    {"DEF", "ABC", 10, 3, "the inverse cross rate of two decimal rates rounds to the nearest hundredth"},
+    {"ABC", "CAD", 29, 100, "the inverse of a decimal rate is exact"},
+    {"CAD", "ABC", 1000000000000000050LL, 290000000000000015LL, "halves of large amounts are rounded exactly"},
+    {"CAD", "TNY", 500000000000000000LL, 1, "half a hundredth at the smallest rate rounds up"},
+    {"CAD", "BIG", 1, 100000000000000000LL, "a rate of eighteen digits converts exactly"},
+    {"TNY", "BIG", 1, INVALID_AMOUNT, "a cross rate out of range is invalid"},
+    {"CAD", "XYZ", 100, INVALID_AMOUNT, "an unknown currency is invalid"},
+    {"XYZ", "CAD", 100, INVALID_AMOUNT, "an unknown source currency is invalid"},
+    {"CAD", "USD", 0, 0, "nothing converts to nothing"},
+};
+
+/**
+ * Writes the test rates to a temporary file and loads them
+ * Returns NULL if they could not be loaded
+ */
+struct rate_table *loadTestRates() {
+    char path[] = "/tmp/ratesXXXXXX";
+    int fd = mkstemp(path);
+    struct rate_table *table = NULL;
+
+    if (fd < 0) {
+        perror("mkstemp");
+        return NULL;
+    }
+    if (write(fd, test_rates, strlen(test_rates)) == (ssize_t) strlen(test_rates)) table = loadRates(path);
+    close(fd);
+    unlink(path);
+    return table;
+}
+
+void testKnownValues(const struct rate_table *table) {
+    int n = sizeof(conversions) / sizeof(conversions[0]);
+    int64_t amounts[n], results[n];
+    uint32_t sources[n], dests[n];
+    int valid = 0;
+
+    for (int i = 0; i < n; i++) {
+        amounts[i] = conversions[i].amount;
+        sources[i] = packCurrency(conversions[i].source, 3);
+        dests[i] = packCurrency(conversions[i].dest, 3);
+        valid += conversions[i].expected != INVALID_AMOUNT;
+    }
+    expect(convertAmounts(table, amounts, sources, dests, results, n) == valid, "every valid amount is counted as converted");
+
+    for (int i = 0; i < n; i++) {
+        if (results[i] != conversions[i].expected) {
+            fprintf(stderr, "%ld %s to %s: got %ld, expected %ld\n", (long) conversions[i].amount, conversions[i].source,
+                    conversions[i].dest, (long) results[i], (long) conversions[i].expected);
+        }
+        expect(results[i] == conversions[i].expected, conversions[i].description);
+    }
+}
+
+void testBlocks(const struct rate_table *table) {
+    int64_t amounts[REPEATED_CONVERSIONS], results[REPEATED_CONVERSIONS];
+    uint32_t sources[REPEATED_CONVERSIONS], dests[REPEATED_CONVERSIONS];
+    int matching = TRUE;
+
+    //Each amount converted on its own gives the same result as in a batch spanning several blocks
+    for (int i = 0; i < REPEATED_CONVERSIONS; i++) {
+        amounts[i] = (i * 7919) % 100000 - 50000;
+        sources[i] = packCurrency(i % 3 == 0 ? "JPY" : "CAD", 3);
+        dests[i] = packCurrency(i % 2 == 0 ? "USD" : "HLF", 3);
+    }
+    convertAmounts(table, amounts, sources, dests, results, REPEATED_CONVERSIONS);
+    for (int i = 0; i < REPEATED_CONVERSIONS; i++) {
+        int64_t result;
+        convertAmounts(table, &amounts[i], &sources[i], &dests[i], &result, 1);
+        if (result != results[i]) matching = FALSE;
+    }
+    expect(matching, "a batch of several blocks converts each amount as it would on its own");
+}
+
+int main() {
+    struct rate_table *table = loadTestRates();
+
+    expect(table != NULL, "rates can be loaded");
+    if (table != NULL) {
+        testKnownValues(table);
+        testBlocks(table);
+        freeRates(table);
+    }
+
+    return finishTests();
+}
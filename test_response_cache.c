@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "response_cache.h"
+#include "test.h"
+
+#define TRUE 1
+#define FALSE 0
+
+//Monotonic time the checks pretend it is, in milliseconds
+#define NOW 1000000
+#define LATER (NOW + 60000)
+
+/*
+ * Checks the behaviour of the response cache of the indirection server: eviction within its byte budget,
+ * expiry, invalidation of a service and tickets that outlive their entry
+ */
+
+/**
+ * Reserves an entry for a key and fills it straight away
+ * Returns the ticket the entry was filled with
+ */
+uint64_t cacheResponse(struct response_cache *cache, int service, const char *key, const char *value, int length, int64_t expires) {
+    uint64_t ticket = reserveCached(cache, service, key, strlen(key), 1);
+
+    fillCached(cache, ticket, 0, value, length, expires);
+    return ticket;
+}
+
+/**
+ * Returns TRUE if a key has a fresh response equal to value
+ */
+int isCached(struct response_cache *cache, int service, const char *key, const char *value, int64_t now) {
+    const struct cache_entry *entry = findCached(cache, service, key, strlen(key), now);
+
+    return entry != NULL && entry->value_length == strlen(value) && memcmp(entry->data + entry->key_length, value, entry->value_length) == 0;
+}
+
+void testEviction() {
+    struct response_cache cache;
+    char key[32], value[200];
+    int within_budget = TRUE;
+
+    memset(value, 'v', sizeof(value));
+    value[sizeof(value) - 1] = '\0';
+    expect(initCache(&cache, 64, 1000) == 0, "a cache can be set up");
+
+    //Far more entries than fit in the byte budget, though not in the number of entries
+    for (int i = 0; i < 50; i++) {
+        sprintf(key, "key %d", i);
+        cacheResponse(&cache, 0, key, value, strlen(value), LATER);
+        if (cache.bytes > cache.max_bytes) within_budget = FALSE;
+    }
+    expect(within_budget, "the cache never holds more bytes than it is given");
+    expect(cache.stats.evictions > 0, "responses are evicted to stay within the byte budget");
+    expect(isCached(&cache, 0, "key 49", value, NOW), "the last response is kept");
+    expect(!isCached(&cache, 0, "key 0", value, NOW), "the first response is evicted");
+
+    //A response looked up since the hand last went by survives the next eviction
+    expect(isCached(&cache, 0, "key 48", value, NOW), "a recent response is kept");
+    cacheResponse(&cache, 0, "key 50", value, strlen(value), LATER);
+    expect(isCached(&cache, 0, "key 48", value, NOW), "a referenced response is not evicted");
+
+    //A response that could never fit is not kept, and takes nothing with it
+    char *huge = malloc(2000);
+    memset(huge, 'h', 2000);
+    cacheResponse(&cache, 0, "huge", huge, 2000, LATER);
+    expect(findCached(&cache, 0, "huge", 4, NOW) == NULL, "a response larger than the cache is not kept");
+    expect(cache.bytes <= cache.max_bytes, "a response larger than the cache leaves it within budget");
+    free(huge);
+}
+
+void testExpiry() {
+    struct response_cache cache;
+
+    initCache(&cache, 16, 4096);
+    cacheResponse(&cache, 0, "hello", "bonjour", 7, NOW + 100);
+
+    expect(isCached(&cache, 0, "hello", "bonjour", NOW + 99), "a response is served until it expires");
+    expect(!isCached(&cache, 0, "hello", "bonjour", NOW + 100), "a response is not served once it expires");
+    expect(cache.stats.expired == 1, "an expired response is counted");
+    expect(cache.count == 0 && cache.bytes == 0, "an expired response is freed");
+
+    //Responses with no lifetime are never kept
+    cacheResponse(&cache, 0, "results", "1 vote", 6, 0);
+    expect(findCached(&cache, 0, "results", 7, NOW) == NULL && cache.count == 0, "a response that is not to be kept is freed");
+}
+
+void testInvalidation() {
+    struct response_cache cache;
+
+    initCache(&cache, 16, 4096);
+    cacheResponse(&cache, 1, "100 USD EUR", "92.00", 5, LATER);
+    cacheResponse(&cache, 0, "hello", "bonjour", 7, LATER);
+
+    //A request goes out just before the service is invalidated
+    uint64_t ticket = reserveCached(&cache, 1, "5 CAD JPY", 9, 42);
+    expect(findFlight(&cache, 1, "5 CAD JPY", 9) == 42, "a request in flight can be waited on");
+
+    invalidateCached(&cache, 1);
+    expect(!isCached(&cache, 1, "100 USD EUR", "92.00", NOW), "an invalidated service has no responses");
+    expect(isCached(&cache, 0, "hello", "bonjour", NOW), "other services keep their responses");
+    expect(findFlight(&cache, 1, "5 CAD JPY", 9) == 0, "a request sent before the invalidation is not waited on");
+
+    fillCached(&cache, ticket, 0, "540", 3, LATER);
+    expect(findCached(&cache, 1, "5 CAD JPY", 9, NOW) == NULL, "a response to a request sent before the invalidation is not kept");
+
+    cacheResponse(&cache, 1, "100 USD EUR", "93.00", 5, LATER);
+    expect(isCached(&cache, 1, "100 USD EUR", "93.00", NOW), "an invalidated service caches new responses");
+}
+
+void testStaleTicket() {
+    struct response_cache cache;
+
+    //A single entry, so the second key has to take the place of the first
+    initCache(&cache, 1, 4096);
+    uint64_t first = reserveCached(&cache, 0, "hello", 5, 1);
+    uint64_t second = reserveCached(&cache, 0, "goodbye", 7, 2);
+
+    expect(first != NO_TICKET && second != NO_TICKET, "an entry can be reserved");
+    expect((uint32_t) first == (uint32_t) second, "the second key reuses the entry of the first");
+    expect(findFlight(&cache, 0, "hello", 5) == 0, "the first key is evicted");
+
+    //The late response to the first request must not land in the entry of the second
+    fillCached(&cache, first, 0, "bonjour", 7, LATER);
+    expect(findCached(&cache, 0, "goodbye", 7, NOW) == NULL, "a stale ticket does not fill the entry");
+    expect(findFlight(&cache, 0, "goodbye", 7) == 2, "a stale ticket leaves the entry waiting for its own response");
+
+    fillCached(&cache, second, 0, "au revoir", 9, LATER);
+    expect(isCached(&cache, 0, "goodbye", "au revoir", NOW), "the entry is filled with its own ticket");
+}
+
+int main() {
+    testEviction();
+    testExpiry();
+    testInvalidation();
+    testStaleTicket();
+
+    return finishTests();
+}
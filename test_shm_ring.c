@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "shm_ring.h"
+#include "test.h"
+
+#define TRUE 1
+#define FALSE 0
+
+//Datagrams sent through a ring by two threads at once
+#define THREADED_COUNT 200000
+
+/*
+ * Checks the shared memory rings between the indirection server and the microservices: slots wrapping around the
+ * ring, a full ring turning producers away, the sleeping consumer being woken, and a client attaching in process
+ */
+
+/**
+ * Returns a ring with no slot in use, aligned like the rings of a segment
+ */
+struct ring *newRing() {
+    struct ring *ring = aligned_alloc(64, sizeof(struct ring));
+
+    memset(ring, 0, sizeof(struct ring));
+    return ring;
+}
+
+/**
+ * Returns how many times an eventfd was written to since it was last read, 0 if it was not
+ */
+uint64_t readWakeups(int wake_fd) {
+    uint64_t wakeups = 0;
+
+    if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0) return 0;
+    return wakeups;
+}
+
+/**
+ * Claims and publishes a slot holding a number
+ * Returns -1 if the ring is full
+ */
+int produce(struct ring *ring, uint32_t value) {
+    struct ring_slot *slot = claimSlot(ring);
+
+    if (slot == NULL) return -1;
+    memcpy(slot->data, &value, sizeof(value));
+    slot->length = sizeof(value);
+    publishSlots(ring);
+    return 0;
+}
+
+void testWraparound() {
+    struct ring *ring = newRing();
+    uint32_t produced = 0, consumed = 0;
+    int in_order = TRUE;
+
+    //Batches of a size that does not divide the ring, so they straddle its end at every turn
+    while (produced < 5 * RING_SLOTS) {
+        for (int i = 0; i < 7; i++) produce(ring, produced++);
+        struct ring_slot *slot;
+        while ((slot = peekSlot(ring)) != NULL) {
+            uint32_t value;
+            memcpy(&value, slot->data, sizeof(value));
+            if (slot->length != sizeof(value) || value != consumed) in_order = FALSE;
+            consumeSlot(ring);
+            consumed++;
+        }
+    }
+    expect(in_order && consumed == produced, "slots come out in order as the ring wraps around");
+
+    //Positions wrap around at 2^32, well past the number of slots
+    ring->head = ring->tail = ring->claimed = UINT32_MAX - 3;
+    in_order = TRUE;
+    for (uint32_t i = 0; i < 8; i++) produce(ring, i);
+    for (uint32_t i = 0; i < 8; i++) {
+        struct ring_slot *slot = peekSlot(ring);
+        uint32_t value;
+        if (slot == NULL) {
+            in_order = FALSE;
+            break;
+        }
+        memcpy(&value, slot->data, sizeof(value));
+        if (value != i) in_order = FALSE;
+        consumeSlot(ring);
+    }
+    expect(in_order && peekSlot(ring) == NULL, "slots come out in order as positions overflow");
+    free(ring);
+}
+
+void testFullRing() {
+    struct ring *ring = newRing();
+    int filled = 0;
+
+    while (produce(ring, filled) == 0 && filled <= RING_SLOTS) filled++;
+    expect(filled == RING_SLOTS, "every slot of a ring can be filled");
+    expect(claimSlot(ring) == NULL, "a full ring has no slot to claim");
+
+    //Claimed slots are not seen until they are published
+    consumeSlot(ring);
+    expect(claimSlot(ring) != NULL, "a consumed slot can be claimed again");
+    for (int i = 1; i < RING_SLOTS; i++) consumeSlot(ring);
+    expect(peekSlot(ring) == NULL, "a claimed slot is not seen before it is published");
+    publishSlots(ring);
+    expect(peekSlot(ring) != NULL, "a claimed slot is seen once it is published");
+    free(ring);
+}
+
+void testWakeup() {
+    struct ring *ring = newRing();
+    int wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    //An awake consumer polls the ring, so producers do not make system calls for it
+    produce(ring, 1);
+    wakeConsumer(ring, wake_fd);
+    expect(readWakeups(wake_fd) == 0, "an awake consumer is not woken");
+
+    //A consumer cannot sleep while a slot is waiting, or it would never be woken for it
+    expect(prepareSleep(ring) < 0, "a consumer with a slot waiting does not sleep");
+    expect(ring->sleeping == 0, "a consumer with a slot waiting is left awake");
+    consumeSlot(ring);
+
+    expect(prepareSleep(ring) == 0, "a consumer with an empty ring can sleep");
+    produce(ring, 2);
+    wakeConsumer(ring, wake_fd);
+    expect(readWakeups(wake_fd) == 1, "a sleeping consumer is woken");
+    expect(ring->sleeping == 0, "a woken consumer is awake");
+
+    //Producing more before the consumer gets to the ring does not wake it again
+    produce(ring, 3);
+    wakeConsumer(ring, wake_fd);
+    expect(readWakeups(wake_fd) == 0, "a consumer is only woken once");
+
+    close(wake_fd);
+    free(ring);
+}
+
+/**
+ * Sends THREADED_COUNT numbers through a ring, yielding while it is full
+ */
+void *produceNumbers(void *argument) {
+    struct ring *ring = argument;
+
+    for (uint32_t i = 0; i < THREADED_COUNT; i++) {
+        while (produce(ring, i) < 0) sched_yield();
+    }
+    return NULL;
+}
+
+void testThreads() {
+    struct ring *ring = newRing();
+    pthread_t producer;
+    uint32_t consumed = 0;
+    int in_order = TRUE;
+
+    pthread_create(&producer, NULL, produceNumbers, ring);
+    while (consumed < THREADED_COUNT) {
+        struct ring_slot *slot = peekSlot(ring);
+        uint32_t value;
+        if (slot == NULL) {
+            sched_yield();
+            continue;
+        }
+        memcpy(&value, slot->data, sizeof(value));
+        if (value != consumed) in_order = FALSE;
+        consumeSlot(ring);
+        consumed++;
+    }
+    pthread_join(producer, NULL);
+    expect(in_order, "slots come out in order while the producer runs on another thread");
+    free(ring);
+}
+
+void testAttach() {
+    struct ring_server server;
+    struct ring_link link;
+    char name[MAX_RING_NAME], datagram[MAX_DATAGRAM_SIZE];
+    int wake_fd = eventfd(0, EFD_NONBLOCK), attached = 1;
+
+    sprintf(name, "test-%d", getpid());
+    if (createRing(name, &server) < 0) {
+        expect(FALSE, "a ring can be created");
+        return;
+    }
+    expect(connectRing(name, wake_fd, &link) == 0, "a client can connect to a ring");
+
+    //Both sides take the handshake a step further at a time, so one thread can play both
+    for (int i = 0; i < 100 && attached == 1; i++) {
+        serveRingClients(&server, 0);
+        attached = finishRing(&link);
+    }
+    expect(attached == 0 && isRingAttached(&link), "a client attaches to a ring");
+    if (attached != 0) return;
+    int client = link.client;
+    struct ring *requests = &server.segment->requests[client];
+    struct ring *responses = &server.segment->responses[client];
+
+    //A full request ring turns the client away instead of overwriting a request
+    int sent = 0;
+    while (sendRing(&link, "ping", 4) == 4 && sent <= RING_SLOTS) sent++;
+    expect(sent == RING_SLOTS && errno == EAGAIN, "a client is turned away by a full ring");
+    for (int i = 0; i < RING_SLOTS; i++) consumeSlot(requests);
+
+    //A sleeping microservice is woken by a request
+    expect(prepareSleep(requests) == 0, "a microservice with no request can sleep");
+    expect(sendRing(&link, "ping", 4) == 4, "a client can send once its requests are consumed");
+    expect(readWakeups(server.wake_fd) == 1, "a request wakes a sleeping microservice");
+    struct ring_slot *slot = peekSlot(requests);
+    expect(slot != NULL && slot->length == 4 && memcmp(slot->data, "ping", 4) == 0, "a request arrives intact");
+    consumeSlot(requests);
+
+    //And a sleeping client is woken by a response
+    expect(receiveRing(&link, datagram) < 0 && errno == EAGAIN, "a client with no response receives nothing");
+    expect(sleepRing(&link) == 0, "a client with no response can sleep");
+    slot = claimSlot(responses);
+    memcpy(slot->data, "pong", 4);
+    slot->length = 4;
+    publishSlots(responses);
+    wakeConsumer(responses, server.client_wake_fds[client]);
+    expect(readWakeups(wake_fd) == 1, "a response wakes a sleeping client");
+    expect(receiveRing(&link, datagram) == 4 && memcmp(datagram, "pong", 4) == 0, "a response arrives intact");
+
+    //A length past the end of a slot, written by a faulty or hostile peer, is cut to the slot
+    slot = claimSlot(responses);
+    slot->length = UINT32_MAX;
+    publishSlots(responses);
+    expect(receiveRing(&link, datagram) == MAX_DATAGRAM_SIZE, "a response longer than a slot is cut to the slot");
+
+    //A client that leaves frees its rings, and the next client to take them finds them empty
+    produce(requests, 1);
+    produce(responses, 1);
+    detachRing(&link);
+    for (int i = 0; i < 100 && server.client_fds[client] >= 0; i++) serveRingClients(&server, 0);
+    expect(server.client_fds[client] < 0, "the rings of a client that leaves are freed");
+
+    attached = connectRing(name, wake_fd, &link) == 0 ? 1 : -1;
+    for (int i = 0; i < 100 && attached == 1; i++) {
+        serveRingClients(&server, 0);
+        attached = finishRing(&link);
+    }
+    expect(attached == 0 && link.client == client, "a client can take the rings another client left");
+    expect(peekSlot(requests) == NULL && receiveRing(&link, datagram) < 0, "rings are emptied for the next client");
+    detachRing(&link);
+
+    close(wake_fd);
+}
+
+int main() {
+    testWraparound();
+    testFullRing();
+    testWakeup();
+    testThreads();
+    testAttach();
+
+    return finishTests();
+}
@@ -0,0 +1,161 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vote_log.h"
+#include "test.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define CANDIDATES 5
+#define RECORD_SIZE ((off_t) sizeof(struct vote_record))
+
+/*
+ * Checks that the vote log of the voting server gives back the votes it committed, cuts off a record
+ * that was only partly written, and that a snapshot plus the rest of the log adds up to the whole log
+ */
+
+char directory[] = "/tmp/votelogXXXXXX";
+
+/**
+ * Counts a vote replayed from the log, context is the array of counts indexed by candidate id
+ */
+void countVote(uint32_t candidate_id, void *context) {
+    long *votes = context;
+
+    if (candidate_id < CANDIDATES) votes[candidate_id]++;
+}
+
+/**
+ * Releases a log, the voting server never does since its log lives as long as it does
+ */
+void closeVoteLog(struct vote_log *log) {
+    close(log->fd);
+    free(log->pending);
+    free(log->spare);
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->committed);
+    pthread_cond_destroy(&log->filled);
+}
+
+/**
+ * Writes count votes to a new log at path, spread over the candidates, and commits them
+ */
+void logVotes(const char *path, int count) {
+    struct vote_log log;
+    long votes[CANDIDATES] = {0};
+    uint64_t lsn = 0;
+
+    unlink(path);
+    expect(openVoteLog(&log, path, 0, 0, 1, countVote, votes) == 0, "a new log has no votes");
+    for (int i = 0; i < count; i++) {
+        lsn = appendVote(&log, (i * 7) % CANDIDATES);
+    }
+    commitVotes(&log, lsn);
+    expect(durableVotes(&log) == (uint64_t) count, "committed votes are durable");
+    closeVoteLog(&log);
+}
+
+off_t fileSize(const char *path) {
+    struct stat status;
+
+    if (stat(path, &status) < 0) return -1;
+    return status.st_size;
+}
+
+void testTornRecord() {
+    char path[64];
+    struct vote_log log;
+    long votes[CANDIDATES] = {0};
+
+    sprintf(path, "%s/torn.wal", directory);
+    logVotes(path, 10);
+    expect(fileSize(path) == VOTE_LOG_HEADER_SIZE + 10 * RECORD_SIZE, "every committed vote is written");
+
+    //The server died halfway through writing the last record
+    truncate(path, VOTE_LOG_HEADER_SIZE + 9 * RECORD_SIZE + RECORD_SIZE / 2);
+    expect(openVoteLog(&log, path, 0, 0, 1, countVote, votes) == 9, "a torn record is not replayed");
+    expect(fileSize(path) == VOTE_LOG_HEADER_SIZE + 9 * RECORD_SIZE, "a torn record is cut off");
+    expect(log.next_lsn == 9 && durableVotes(&log) == 9, "the log carries on after the last whole record");
+
+    //The next vote takes the place of the torn one
+    commitVotes(&log, appendVote(&log, 3));
+    closeVoteLog(&log);
+    memset(votes, 0, sizeof(votes));
+    expect(openVoteLog(&log, path, 0, 0, 1, countVote, votes) == 10, "a vote logged after a torn record is replayed");
+    expect(votes[3] == 2, "a vote logged after a torn record is counted");
+    closeVoteLog(&log);
+
+    //A whole record that fails its check is cut off too, along with everything after it
+    off_t check = VOTE_LOG_HEADER_SIZE + 4 * RECORD_SIZE + offsetof(struct vote_record, check);
+    FILE *file = fopen(path, "r+");
+    fseek(file, check, SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, check, SEEK_SET);
+    fputc(byte ^ 0xff, file);
+    fclose(file);
+
+    memset(votes, 0, sizeof(votes));
+    expect(openVoteLog(&log, path, 0, 0, 1, countVote, votes) == 4, "a record that fails its check is not replayed");
+    expect(fileSize(path) == VOTE_LOG_HEADER_SIZE + 4 * RECORD_SIZE, "a record that fails its check is cut off");
+    closeVoteLog(&log);
+    unlink(path);
+}
+
+void testSnapshotReplay() {
+    char path[64], snapshot_path[64];
+    struct vote_log log;
+    struct vote_snapshot snapshot;
+    long all_votes[CANDIDATES] = {0}, snapshot_votes[CANDIDATES] = {0}, votes[CANDIDATES] = {0};
+    uint32_t ids[CANDIDATES];
+    char *names[CANDIDATES] = {"Alice", "Bob", "Carol", "Dave", "Eve"};
+
+    sprintf(path, "%s/votes.wal", directory);
+    sprintf(snapshot_path, "%s/votes.snap", directory);
+    for (int i = 0; i < CANDIDATES; i++) ids[i] = i;
+    logVotes(path, 100);
+
+    //Counts of the whole log, then a snapshot of the first 60 votes, taken the way the server does
+    expect(openVoteLog(&log, path, 0, 0, 1, countVote, all_votes) == 100, "every vote is replayed");
+    expect(readVotes(&log, 0, 60, countVote, snapshot_votes) == 0, "durable votes can be read back");
+    expect(writeSnapshot(snapshot_path, 60, CANDIDATES, ids, names, snapshot_votes) == 0, "a snapshot can be written");
+    closeVoteLog(&log);
+
+    //Restart from the snapshot and only replay the votes logged after it
+    expect(openSnapshot(snapshot_path, &snapshot) == 0, "a snapshot can be mapped");
+    expect(snapshot.header->lsn == 60 && snapshot.header->candidate_count == CANDIDATES, "a snapshot keeps its LSN and candidates");
+    for (uint32_t i = 0; i < snapshot.header->candidate_count; i++) {
+        const struct snapshot_candidate *candidate = &snapshot.candidates[i];
+
+        expect(candidate->id == ids[i] && strcmp(snapshot.strings + candidate->name_offset, names[i]) == 0, "a snapshot keeps the candidates' names");
+        if (candidate->id < CANDIDATES) votes[candidate->id] = candidate->votes;
+    }
+    expect(openVoteLog(&log, path, snapshot.header->lsn, 0, 1, countVote, votes) == 40, "only the votes after a snapshot are replayed");
+    expect(memcmp(votes, all_votes, sizeof(votes)) == 0, "a snapshot plus the rest of the log counts every vote");
+    expect(log.next_lsn == 100, "the log carries on after its last vote");
+    closeVoteLog(&log);
+    closeSnapshot(&snapshot);
+
+    //A damaged snapshot is refused, so the whole log is replayed instead
+    truncate(snapshot_path, sizeof(struct snapshot_header) + 4);
+    expect(openSnapshot(snapshot_path, &snapshot) < 0, "a damaged snapshot is refused");
+    unlink(snapshot_path);
+    unlink(path);
+}
+
+int main() {
+    if (mkdtemp(directory) == NULL) {
+        perror("[ERROR]: could not create a directory for the logs");
+        return 1;
+    }
+
+    testTornRecord();
+    testSnapshotReplay();
+    rmdir(directory);
+
+    return finishTests();
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "translate_handler.h"
+
+#define TRUE 1
+#define FALSE 0
+
+//Bytes that can be part of a word: ASCII letters and digits, and every byte of a UTF-8 multibyte character
+unsigned char word_bytes[256];
+
+/**
+ * Fills in the word_bytes table
+ */
+void initWordBytes() {
+    for (int c = 0; c < 256; c++) {
+        word_bytes[c] = c >= 0x80 || isalnum(c);
+    }
+}
+
+/**
+ * Returns the length of the run of word bytes (or of separator bytes) that text starts with
+ *
+ * @param text:    text to scan
+ * @param len:     length of text
+ * @param in_word: TRUE to measure a run of word bytes, FALSE to measure a run of separators
+ */
+int scanRun(const char *text, int len, int in_word) {
+    int i = 0;
+
+#ifdef __SSE2__
+    //Classify 16 bytes per step, with the same rules as word_bytes
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i before_a = _mm_set1_epi8('a' - 1), after_z = _mm_set1_epi8('z' + 1);
+    const __m128i before_0 = _mm_set1_epi8('0' - 1), after_9 = _mm_set1_epi8('9' + 1);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (text + i));
+        __m128i lower = _mm_or_si128(c, case_bit);
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, before_a), _mm_cmplt_epi8(lower, after_z));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, before_0), _mm_cmplt_epi8(c, after_9));
+        //Bytes of multibyte characters have their top bit set, so they count as word bytes too
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), c));
+
+        if (!in_word) mask = ~mask & 0xFFFF;
+        //The run ends at the first byte of the other kind
+        if (mask != 0xFFFF) return i + __builtin_ctz(~mask);
+    }
+#endif
+    for (; i < len && word_bytes[(unsigned char) text[i]] == in_word; i++);
+
+    return i;
+}
+
+/**
+ * Translates one word, retrying in lower case if the word is capitalized
+ * Returns the French word, or NULL if the word is unknown
+ *
+ * @param scratch: buffer of MAX_WORD_LENGTH + 1 bytes for words that had their case changed
+ */
+const char *translateWord(struct dictionary *dict, const char *word, int len, int *french_length, char *scratch) {
+    const char *french = lookupWord(dict, word, len, french_length);
+
+    if (french != NULL || len > MAX_WORD_LENGTH || !isupper((unsigned char) word[0])) return french;
+
+    //Words at the start of a sentence are capitalized, but the dictionary is in lower case
+    for (int i = 0; i < len; i++) {
+        scratch[i] = tolower((unsigned char) word[i]);
+    }
+    if ((french = lookupWord(dict, scratch, len, french_length)) == NULL) return NULL;
+    //scratch only has room for a word as long as the dictionary allows
+    if (*french_length > MAX_WORD_LENGTH) return NULL;
+
+    //Keep the capital on the translation
+    memcpy(scratch, french, *french_length);
+    scratch[0] = toupper((unsigned char) scratch[0]);
+
+    return scratch;
+}
+
+int translateText(struct dictionary *dict, const char *text, int len, char *dest, int max_length) {
+    char scratch[MAX_WORD_LENGTH + 1];
+    int length = 0;
+
+    for (int i = 0, run; i < len; i += run) {
+        int in_word = word_bytes[(unsigned char) text[i]];
+        const char *copy = text + i;
+        int copy_length;
+
+        run = copy_length = scanRun(text + i, len - i, in_word);
+
+        if (in_word) {
+            const char *french = translateWord(dict, text + i, run, &copy_length, scratch);
+
+            if (french != NULL) {
+                copy = french;
+            } else {
+                copy_length = run;
+            }
+        }
+        if (length + copy_length > max_length) return -1;
+
+        memcpy(dest + length, copy, copy_length);
+        length += copy_length;
+    }
+    return length;
+}
+
+int handleTranslate(const struct datagram_header *header, const char *payload, char *response, void *context) {
+    struct dictionary *dict = context;
+    char *french = response + DATAGRAM_HEADER_SIZE;
+    const char *word;
+    int length;
+
+    if (header->opcode == DG_TRANSLATE_TEXT) {
+        //Translate a whole sentence or list of words at once
+        if ((length = translateText(dict, payload, header->length, french, MAX_DATAGRAM_PAYLOAD)) >= 0) {
+            return writeResponseHeader(response, header, DG_OK, length);
+        }
+        return writeResponseHeader(response, header, DG_ERROR, sprintf(french, "The translation is too long, please try again."));
+    }
+    //Attempt to translate the word received from indirection server
+    if (header->opcode == DG_TRANSLATE && (word = lookupWord(dict, payload, header->length, &length)) != NULL) {
+        memcpy(french, word, length);
+        return writeResponseHeader(response, header, DG_OK, length);
+    }
+    return writeResponseHeader(response, header, DG_ERROR, sprintf(french, "Invalid word, please try again."));
+}
+
+void *loadTranslator(const char *path) {
+    struct dictionary *dict = malloc(sizeof(struct dictionary));
+
+    initWordBytes();
+
+    //Index files are mapped, word lists are indexed in memory
+    if (dict == NULL || openDictionary(path, dict) < 0) {
+        free(dict);
+        return NULL;
+    }
+    return dict;
+}
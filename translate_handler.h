@@ -0,0 +1,43 @@
+#ifndef TRANSLATE_HANDLER_H
+#define TRANSLATE_HANDLER_H
+
+#include "datagram.h"
+#include "dictionary.h"
+
+/*
+ * Request handler of the translate server
+ *
+ * The handler only turns a request datagram into a response datagram, so it is linked both into the translate
+ * server, which runs it behind its UDP loop, and into the indirection server, which can run it in process and
+ * skip the round trip to a translate server. The dictionary is only read once it is loaded, so any number of
+ * threads can translate with it at the same time.
+ */
+
+/**
+ * Loads a word list or index file to translate with
+ * Returns the context to give handleTranslate(), or NULL if the dictionary could not be loaded
+ */
+void *loadTranslator(const char *path);
+
+/**
+ * Translates every known word of a text in one pass
+ * Punctuation, spacing and unknown words are copied as they are
+ * Returns the length of the translation, or -1 if it is longer than max_length
+ *
+ * @param dict:       dictionary to translate with
+ * @param text:       text in English, not NUL terminated
+ * @param len:        length of text
+ * @param dest:       buffer for the translation
+ * @param max_length: size of dest
+ */
+int translateText(struct dictionary *dict, const char *text, int len, char *dest, int max_length);
+
+/**
+ * Translates the word or text in a request and writes the response
+ * Returns the size of the response
+ *
+ * @param context: the dictionary given by loadTranslator()
+ */
+int handleTranslate(const struct datagram_header *header, const char *payload, char *response, void *context);
+
+#endif
@@ -6,6 +6,11 @@
 #include <signal.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <pthread.h>
+
+#include "datagram.h"
+#include "udp_loop.h"
+#include "translate_handler.h"
 
 #define TRUE 1
 #define FALSE 0
@@ -13,7 +18,10 @@
 #define MAX_BUFFER_SIZE 2048
 
 #define PORT 9044
-#define NUM_WORDS 5
+//Word list or index file loaded when none is given on the command line
+#define DEFAULT_DICTIONARY "dictionary.tsv"
+//Dictionaries up to this size are printed at startup
+#define MAX_PRINTED_WORDS 20
 
 /**
  * Check whether a function has returned an error code and exit the program if necessary
@@ -30,34 +38,21 @@ int check(int status, char *function_name, int can_exit) {
     return status;
 }
 
-/**
- * Translates a given English word to French
- * 
- * @param word:          a word in English, will become the translated word in French
- * @param english_words: list of english words
- * @param french_words:  list of french words
- */
-int translate(char *word, char *english_words[NUM_WORDS], char *french_words[NUM_WORDS]) {
-    for (int i = 0; i < NUM_WORDS; i++) {
-        //English word was found in the list
-        if (strcmp(word, english_words[i]) == 0) {
-            memset(word, 0, strlen(word));
-            //Write the corresponding french word to the word string
-            strcpy(word, french_words[i]);
-            return 0;
-        }
-    }
-    return -1;
-}
-
 /*
- * Prints useful info about the microserver, including the conversion rates
+ * Prints useful info about the microserver, including the translations of small dictionaries
  */
-void printStartup(char *words[NUM_WORDS], char *translated[NUM_WORDS]) {
+void printStartup(const char *path, struct dictionary *dict) {
+    const char *english, *french;
+
+    printf("Loaded %lu words from %s\n\n", (unsigned long) dict->header->word_count, path);
+    if (dict->header->word_count > MAX_PRINTED_WORDS) return;
+
     printf("English\t\tFrench\n-------\t\t------\n");
 
-    for (int i = 0; i < NUM_WORDS; i++) {
-        printf("%s\t\t%s\n", words[i], translated[i]);
+    for (uint64_t i = 0; i < dict->header->bucket_count; i++) {
+        if (bucketWords(dict, i, &english, &french)) {
+            printf("%s\t\t%s\n", english, french);
+        }
     }
 }
 
@@ -90,40 +85,74 @@ int initServer(int server_port) {
     return server_fd;
 }
 
-int main() {
-	int server_fd = initServer(PORT);
-
-    //Important microservice info
-    char *english_words[NUM_WORDS] = {"hello", "school", "book", "boy", "girl"};
-    char *french_words[NUM_WORDS] = {"bonjour", "ecole", "livre", "garcon", "fille"};
+/**
+ * Serves the shared memory ring next to the UDP socket, see shm_ring.h
+ */
+void *serveRing(void *arg) {
+    runUdpLoop(arg);
+    return NULL;
+}
 
-    //String for holding incoming/outgoing network data
-    char buffer[MAX_BUFFER_SIZE];
-	memset(&buffer, 0, MAX_BUFFER_SIZE);
+/**
+ * Prints the correct usage of the program and exits
+ */
+void usageError(const char *program) {
+    fprintf(stderr, "Usage: %s [-d dictionary] [-n batch] [-m mmsg|uring] [-p port] [-x ring]\n", program);
+    exit(1);
+}
 
-    printStartup(english_words, french_words);
-    
-    //Placeholder info for communicating with indirection server
-    struct sockaddr_in server;
+int main(int argc, char *argv[]) {
+    //Important microservice info
+    struct dictionary *dict;
+    const char *path = DEFAULT_DICTIONARY;
+    struct udp_loop loop = {.name = "translate", .batch = DEFAULT_UDP_BATCH, .backend = BACKEND_URING, .handler = handleTranslate};
+    struct udp_loop ring_loop;
+    const char *ring = NULL;
+    pthread_t ring_thread;
+    int port = PORT, opt;
+
+    while ((opt = getopt(argc, argv, "d:n:m:p:x:")) != -1) {
+        if (opt == 'd') {
+            path = optarg;
+        } else if (opt == 'n' && atoi(optarg) > 0) {
+            loop.batch = atoi(optarg);
+        } else if (opt == 'm' && parseBackend(optarg) >= 0) {
+            loop.backend = parseBackend(optarg);
+        } else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= 65535) {
+            //Replicas running on the same machine each need their own port
+            port = atoi(optarg);
+        } else if (opt == 'x') {
+            ring = optarg;
+        } else {
+            usageError(argv[0]);
+        }
+    }
 
-    int sock_len = sizeof(struct sockaddr_in);
-    int done = FALSE;
-    int bytes;
-
-	while (!done) {
-        memset(buffer, 0, MAX_BUFFER_SIZE);
-
-        if (bytes = recvfrom(server_fd, buffer, MAX_BUFFER_SIZE, 0, (struct sockaddr *) &server, &sock_len) > 0) {
-            //Attempt to translate the data received from indirection server
-            if (translate(buffer, english_words, french_words) == -1) {
-                memset(buffer, 0, MAX_BUFFER_SIZE);
-                strcpy(buffer, "Invalid word, please try again.");
-            }
-            //Send result message back to indirection server
-            sendto(server_fd, buffer, sizeof(buffer), 0, (struct sockaddr *) &server, sock_len);
+    if ((dict = loadTranslator(path)) == NULL) {
+        fprintf(stderr, "[ERROR]: Could not load the dictionary %s!\n", path);
+        exit(1);
+    }
+    loop.context = dict;
+	loop.fd = initServer(port);
+
+    printStartup(path, dict);
+
+    //Requests from an indirection server on the same machine can come through shared memory instead
+    if (ring != NULL) {
+        ring_loop = loop;
+        ring_loop.name = "translate ring";
+        ring_loop.ring = ring;
+        if (pthread_create(&ring_thread, NULL, serveRing, &ring_loop) != 0) {
+            fprintf(stderr, "[ERROR]: Could not start serving the ring!\n");
+            exit(1);
         }
-	}
-	close(server_fd);
+    }
+
+    //Serve requests in batches until the program is killed
+    runUdpLoop(&loop);
+	close(loop.fd);
+    closeDictionary(dict);
+    free(dict);
 	
 	return 0;
 }
@@ -0,0 +1,547 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+
+#include "udp_loop.h"
+#include "shm_ring.h"
+
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+//Multishot receive needs the headers of Linux 6.0 or newer, which also have provided buffer rings
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+#define TRUE 1
+#define FALSE 0
+
+//Receive buffer of the socket, big enough to absorb bursts between two batches
+#define UDP_SOCKET_BUFFER (4 * 1024 * 1024)
+//Batches a busy ring handles between two checks for clients attaching or leaving
+#define RING_CLIENT_CHECK 256
+
+/**
+ * Packets handled since the last report
+ */
+struct loop_stats {
+    unsigned long received;
+    unsigned long sent;
+    unsigned long batches;
+    struct timespec since;
+};
+
+/**
+ * Returns the seconds elapsed between two times
+ */
+double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * Prints the packets/sec of the last interval once it is over, and starts a new interval
+ * Intervals without any traffic are not reported
+ */
+void reportStats(const char *name, struct loop_stats *stats) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double seconds = elapsed(&stats->since, &now);
+    if (seconds < STATS_INTERVAL) return;
+
+    if (stats->received > 0) {
+        printf("[%s]: %.0f packets/sec received, %.0f packets/sec sent, %.1f packets per batch\n", name,
+            stats->received / seconds, stats->sent / seconds, (double) stats->received / stats->batches);
+        fflush(stdout);
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->since = now;
+}
+
+/**
+ * Validates a received datagram and passes it to the handler
+ * Returns the size of the response, or -1 if nothing should be sent back
+ */
+int handleDatagram(struct udp_loop *loop, const char *request, int bytes, char *response) {
+    struct datagram_header header;
+
+    //Malformed datagrams are ignored
+    if (readDatagramHeader(request, bytes, &header) < 0) return -1;
+    //Health checks are answered by the loop, so every microservice answers them the same way
+    if (header.opcode == DG_PING) return writeResponseHeader(response, &header, DG_OK, 0);
+
+    return loop->handler(&header, request + DATAGRAM_HEADER_SIZE, response, loop->context);
+}
+
+int parseBackend(const char *name) {
+    if (strcmp(name, "mmsg") == 0) return BACKEND_MMSG;
+    if (strcmp(name, "uring") == 0) return BACKEND_URING;
+    return -1;
+}
+
+/**
+ * Serves requests with one recvmmsg() and one sendmmsg() per batch
+ */
+void runMmsgLoop(struct udp_loop *loop) {
+    int batch = loop->batch;
+
+    //One request and one response buffer per datagram of the batch
+    char *requests = malloc((size_t) batch * MAX_DATAGRAM_SIZE);
+    char *responses = malloc((size_t) batch * MAX_DATAGRAM_SIZE);
+    struct mmsghdr *in = calloc(batch, sizeof(struct mmsghdr));
+    struct mmsghdr *out = calloc(batch, sizeof(struct mmsghdr));
+    struct iovec *in_iov = calloc(batch, sizeof(struct iovec));
+    struct iovec *out_iov = calloc(batch, sizeof(struct iovec));
+    struct sockaddr_in *addrs = calloc(batch, sizeof(struct sockaddr_in));
+    struct loop_stats stats = {0};
+
+    if (!requests || !responses || !in || !out || !in_iov || !out_iov || !addrs) {
+        fprintf(stderr, "[ERROR]: Could not allocate the buffers of the request loop!\n");
+        exit(1);
+    }
+    for (int i = 0; i < batch; i++) {
+        in_iov[i].iov_base = requests + (size_t) i * MAX_DATAGRAM_SIZE;
+        in_iov[i].iov_len = MAX_DATAGRAM_SIZE;
+        in[i].msg_hdr.msg_iov = &in_iov[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+        in[i].msg_hdr.msg_name = &addrs[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stats.since);
+
+    while (TRUE) {
+        for (int i = 0; i < batch; i++) {
+            in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        //Block until at least one datagram arrives, then take whatever else is already queued
+        int received = recvmmsg(loop->fd, in, batch, MSG_WAITFORONE, NULL);
+        if (received < 0) {
+            if (errno != EINTR) perror("recvmmsg");
+            continue;
+        }
+        int responses_ready = 0;
+
+        for (int i = 0; i < received; i++) {
+            char *response = responses + (size_t) responses_ready * MAX_DATAGRAM_SIZE;
+            int length = handleDatagram(loop, in_iov[i].iov_base, in[i].msg_len, response);
+            if (length < 0) continue;
+
+            //Reply to whoever sent the request
+            out_iov[responses_ready].iov_base = response;
+            out_iov[responses_ready].iov_len = length;
+            out[responses_ready].msg_hdr.msg_iov = &out_iov[responses_ready];
+            out[responses_ready].msg_hdr.msg_iovlen = 1;
+            out[responses_ready].msg_hdr.msg_name = &addrs[i];
+            out[responses_ready].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+            responses_ready++;
+        }
+        if (loop->before_reply != NULL && responses_ready > 0) loop->before_reply(loop->context);
+
+        //sendmmsg() may stop early, keep going until the whole batch is out
+        for (int sent = 0, n; sent < responses_ready; sent += n) {
+            if ((n = sendmmsg(loop->fd, out + sent, responses_ready - sent, 0)) < 0) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                //Drop the rest of the batch, the indirection server will time out on it
+                perror("sendmmsg");
+                break;
+            }
+            stats.sent += n;
+        }
+        stats.received += received;
+        stats.batches++;
+        reportStats(loop->name, &stats);
+    }
+}
+
+#ifdef HAVE_IO_URING
+
+//Number of provided receive buffers, must be a power of 2
+#define URING_BUFFERS 1024
+//Room for the recvmsg header and the sender address in front of the datagram
+#define URING_BUFFER_SIZE (MAX_DATAGRAM_SIZE + 128)
+#define URING_BUFFER_GROUP 0
+//user_data of the multishot receive, sends use the id of their buffer
+#define RECV_TAG ((uint64_t) -1)
+
+/**
+ * An io_uring instance with its rings mapped into memory
+ */
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    //Submissions written but not yet handed to the kernel
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    //Ring of receive buffers the kernel picks from
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+};
+
+/**
+ * Per buffer state, a receive buffer is only given back to the kernel once its response has been sent
+ */
+struct uring_slot {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_in addr;
+    char response[MAX_DATAGRAM_SIZE];
+};
+
+/**
+ * Maps the rings of a new io_uring instance
+ * Returns -1 if io_uring is not available
+ */
+int setupUring(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    //Multishot receives can post many completions per submission, so give them plenty of room
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_BUFFERS * 2;
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0) return -1;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+    if (single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return -1;
+
+    char *cq = sq;
+    if (!single_mmap) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return -1;
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) return -1;
+
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    //Register the ring of provided buffers
+    size_t buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+    ring->buf_tail = 0;
+
+    return 0;
+}
+
+/**
+ * Hands a receive buffer back to the kernel, it becomes visible with the next publishBuffers()
+ */
+void returnBuffer(struct uring *ring, char *buffers, unsigned short id) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+
+    buf->addr = (unsigned long) (buffers + (size_t) id * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = id;
+    ring->buf_tail++;
+}
+
+void publishBuffers(struct uring *ring) {
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submits everything queued so far and waits for at least min_complete completions
+ */
+int enterUring(struct uring *ring, unsigned min_complete) {
+    unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    int status = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (status < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter");
+    }
+    return status;
+}
+
+/**
+ * Returns a free submission entry, submitting the queued ones first if the ring is full
+ */
+struct io_uring_sqe *getSqe(struct uring *ring) {
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        enterUring(ring, 0);
+    }
+    unsigned index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+
+    return sqe;
+}
+
+/**
+ * Queues a multishot receive, which keeps posting one completion per datagram until it runs out of buffers
+ */
+void armReceive(struct uring *ring, int fd, struct msghdr *msg) {
+    struct io_uring_sqe *sqe = getSqe(ring);
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = RECV_TAG;
+}
+
+/**
+ * Queues the response held in a slot
+ */
+void queueSend(struct uring *ring, int fd, struct uring_slot *slot, unsigned short id) {
+    struct io_uring_sqe *sqe = getSqe(ring);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) &slot->msg;
+    sqe->len = 1;
+    sqe->user_data = id;
+}
+
+/**
+ * Serves requests with a multishot receive on io_uring, responses are sent from the same ring
+ * Returns -1 if io_uring could not be set up, otherwise never returns
+ */
+int runUringLoop(struct udp_loop *loop) {
+    struct uring ring;
+    //The receive and its sends are submitted together, so there is at most one entry per buffer plus the receive
+    if (setupUring(&ring, URING_BUFFERS * 2) < 0) return -1;
+
+    char *buffers = malloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+    struct uring_slot *slots = calloc(URING_BUFFERS, sizeof(struct uring_slot));
+    struct loop_stats stats = {0};
+
+    if (!buffers || !slots) {
+        fprintf(stderr, "[ERROR]: Could not allocate the buffers of the request loop!\n");
+        exit(1);
+    }
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        returnBuffer(&ring, buffers, i);
+    }
+    publishBuffers(&ring);
+
+    //Template for the multishot receive, the kernel lays out each buffer as header, sender address, datagram
+    struct msghdr template;
+    memset(&template, 0, sizeof(template));
+    template.msg_namelen = sizeof(struct sockaddr_in);
+
+    int free_buffers = URING_BUFFERS;
+    int armed = TRUE;
+    armReceive(&ring, loop->fd, &template);
+    clock_gettime(CLOCK_MONOTONIC, &stats.since);
+
+    while (TRUE) {
+        enterUring(&ring, 1);
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        unsigned long received = 0;
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+
+            if (cqe->user_data != RECV_TAG) {
+                //A response went out, its request buffer can be reused
+                if (cqe->res >= 0) stats.sent++;
+                returnBuffer(&ring, buffers, (unsigned short) cqe->user_data);
+                free_buffers++;
+                continue;
+            }
+            //The receive stops when it runs out of buffers, re-arm it once some have come back
+            if (!(cqe->flags & IORING_CQE_F_MORE)) armed = FALSE;
+            if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) continue;
+
+            unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buffer = buffers + (size_t) id * URING_BUFFER_SIZE;
+            struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buffer;
+            struct uring_slot *slot = &slots[id];
+            int length = -1;
+
+            free_buffers--;
+            received++;
+
+            if (!(out->flags & MSG_TRUNC)) {
+                char *datagram = buffer + sizeof(*out) + template.msg_namelen;
+                length = handleDatagram(loop, datagram, out->payloadlen, slot->response);
+            }
+            if (length < 0) {
+                returnBuffer(&ring, buffers, id);
+                free_buffers++;
+                continue;
+            }
+            //Reply to whoever sent the request
+            memcpy(&slot->addr, buffer + sizeof(*out), sizeof(slot->addr));
+            slot->iov.iov_base = slot->response;
+            slot->iov.iov_len = length;
+            slot->msg.msg_name = &slot->addr;
+            slot->msg.msg_namelen = out->namelen;
+            slot->msg.msg_iov = &slot->iov;
+            slot->msg.msg_iovlen = 1;
+            queueSend(&ring, loop->fd, slot, id);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        //Sends are only queued so far, the ring has room for a whole batch and they go out on the next enter
+        if (loop->before_reply != NULL && received > 0) loop->before_reply(loop->context);
+        publishBuffers(&ring);
+
+        if (!armed && free_buffers > 0) {
+            armReceive(&ring, loop->fd, &template);
+            armed = TRUE;
+        }
+        if (received > 0) {
+            stats.received += received;
+            stats.batches++;
+        }
+        reportStats(loop->name, &stats);
+    }
+}
+
+#endif
+
+/**
+ * Serves requests from a shared memory ring, see shm_ring.h
+ * Nothing but shared memory is touched while requests keep coming, the loop only sleeps on its eventfd once the
+ * request ring of every client is empty
+ */
+void runRingLoop(struct udp_loop *loop) {
+    struct ring_server server;
+    char datagram[MAX_DATAGRAM_SIZE], scratch[MAX_DATAGRAM_SIZE];
+    struct loop_stats stats = {0};
+    unsigned long batches = 0;
+    int next = 0;
+
+    if (createRing(loop->ring, &server) < 0) {
+        fprintf(stderr, "[ERROR]: Could not serve the ring %s!\n", loop->ring);
+        exit(1);
+    }
+    printf("[%s]: Serving the ring %s\n", loop->name, loop->ring);
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &stats.since);
+
+    while (TRUE) {
+        int received = 0, ready = 0;
+        uint32_t woken = 0;
+
+        //Take turns between the clients, starting from another one each batch so none of them waits behind the others
+        for (int c = 0; c < MAX_RING_CLIENTS && received < loop->batch; c++) {
+            int client = (next + c) % MAX_RING_CLIENTS;
+            struct ring *requests = &server.segment->requests[client];
+            struct ring *responses = &server.segment->responses[client];
+            struct ring_slot *request;
+
+            if (server.client_wake_fds[client] < 0) continue;
+
+            while (received < loop->batch && (request = peekSlot(requests)) != NULL) {
+                //A response that does not fit in the client's ring is dropped, as a datagram would be
+                struct ring_slot *response = claimSlot(responses);
+                //Parsed from a copy, so a client cannot change the request while it is handled
+                int length = handleDatagram(loop, datagram, copySlot(request, datagram), response != NULL ? response->data : scratch);
+
+                consumeSlot(requests);
+                received++;
+
+                if (response == NULL) continue;
+                //A claimed slot has to be published, the client skips it if it is empty
+                response->length = length < 0 ? 0 : length;
+                woken |= 1U << client;
+                ready++;
+            }
+        }
+        next = (next + 1) % MAX_RING_CLIENTS;
+
+        if (loop->before_reply != NULL && received > 0) loop->before_reply(loop->context);
+
+        //The responses of the batch are handed over together, with at most one wakeup per client that sleeps
+        for (int c = 0; woken != 0; c++, woken >>= 1) {
+            if (!(woken & 1)) continue;
+            publishSlots(&server.segment->responses[c]);
+            wakeConsumer(&server.segment->responses[c], server.client_wake_fds[c]);
+        }
+        if (received > 0) {
+            stats.received += received;
+            stats.sent += ready;
+            stats.batches++;
+        }
+        reportStats(loop->name, &stats);
+
+        if (received == 0) {
+            //Wait for a request, or for a client to attach or leave
+            serveRingClients(&server, -1);
+        } else if (++batches % RING_CLIENT_CHECK == 0) {
+            serveRingClients(&server, 0);
+        }
+    }
+}
+
+void runUdpLoop(struct udp_loop *loop) {
+    if (loop->batch < 1) loop->batch = 1;
+    if (loop->batch > MAX_UDP_BATCH) loop->batch = MAX_UDP_BATCH;
+
+    if (loop->ring != NULL) {
+        runRingLoop(loop);
+        return;
+    }
+
+    //A bigger socket buffer keeps bursts from being dropped while a batch is being handled
+    if (setsockopt(loop->fd, SOL_SOCKET, SO_RCVBUF, &(int){UDP_SOCKET_BUFFER}, sizeof(int)) < 0) {
+        perror("setsockopt");
+    }
+    //Let the startup info out before the loop takes over
+    fflush(stdout);
+
+    if (loop->backend == BACKEND_URING) {
+#ifdef HAVE_IO_URING
+        runUringLoop(loop);
+#endif
+        fprintf(stderr, "[%s]: io_uring is not available, using recvmmsg() instead\n", loop->name);
+    }
+    runMmsgLoop(loop);
+}
@@ -0,0 +1,76 @@
+#ifndef UDP_LOOP_H
+#define UDP_LOOP_H
+
+#include "datagram.h"
+
+/*
+ * Batched request loop shared by the microservices
+ *
+ * Instead of one recvfrom() and one sendto() per request, the loop drains up to `batch` datagrams with a
+ * single recvmmsg() and sends all of their responses with a single sendmmsg(). When the kernel supports it,
+ * the loop can instead run on io_uring with one multishot receive that keeps filling a ring of provided
+ * buffers, so a whole batch of requests and responses costs a single io_uring_enter().
+ *
+ * A loop can also serve a shared memory ring instead of its socket, for an indirection server on the same
+ * machine (see shm_ring.h). Requests are taken from the ring in batches, and responses are written straight
+ * into the response ring of their client and handed over once the whole batch is handled.
+ *
+ * Every STATS_INTERVAL seconds of traffic the loop prints the packets/sec it received and sent.
+ */
+
+//Largest number of datagrams handled per system call
+#define MAX_UDP_BATCH 1024
+#define DEFAULT_UDP_BATCH 64
+//Seconds between packets/sec reports
+#define STATS_INTERVAL 5
+
+enum udp_backend {
+    BACKEND_MMSG,
+    BACKEND_URING
+};
+
+/**
+ * Handles one request and writes the response datagram, starting with its header
+ * Returns the size of the response, or -1 if nothing should be sent back
+ *
+ * @param header:   header of the request
+ * @param payload:  header->length bytes of request payload
+ * @param response: buffer of MAX_DATAGRAM_SIZE bytes for the response
+ * @param context:  the context given to the loop
+ */
+typedef int (*request_handler)(const struct datagram_header *header, const char *payload, char *response, void *context);
+
+/**
+ * Called once a batch of requests has been handled, before any of its responses is sent
+ *
+ * @param context: the context given to the loop
+ */
+typedef void (*batch_hook)(void *context);
+
+struct udp_loop {
+    //Name of the microservice, used when printing stats
+    const char *name;
+    int fd;
+    int batch;
+    int backend;
+    request_handler handler;
+    void *context;
+    //Optional, lets a service hold back the responses of a batch, e.g. until its effects are durable
+    batch_hook before_reply;
+    //Name of the shared memory ring to serve instead of fd, NULL to serve fd
+    const char *ring;
+};
+
+/**
+ * Parses the name of a backend given on the command line
+ * Returns -1 if the name is unknown
+ */
+int parseBackend(const char *name);
+
+/**
+ * Serves requests on loop->fd, or on loop->ring, forever
+ * Falls back to the recvmmsg() backend if io_uring was asked for but is not available
+ */
+void runUdpLoop(struct udp_loop *loop);
+
+#endif
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "vote_log.h"
+
+#define TRUE 1
+#define FALSE 0
+
+//Records read at a time when replaying
+#define REPLAY_CHUNK 4096
+
+/**
+ * Returns the check of a record, never 0 so a zero filled tail is never taken for votes
+ */
+uint32_t recordCheck(uint64_t lsn, uint32_t candidate_id) {
+    uint64_t hash = (lsn ^ 0x9E3779B97F4A7C15ULL) * 0xBF58476D1CE4E5B9ULL;
+
+    hash ^= candidate_id;
+    hash *= 0x94D049BB133111EBULL;
+    return (uint32_t) (hash >> 32) | 1;
+}
+
+/**
+ * Writes a whole buffer to a file, carrying on after short writes
+ * Returns -1 if the write failed
+ */
+int writeFully(int fd, const char *buffer, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buffer, size);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * Syncs the directory holding a file, so a newly created file survives a crash
+ */
+void syncDirectory(const char *path) {
+    char copy[4096];
+
+    snprintf(copy, sizeof(copy), "%s", path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Returns the offset of a record in the log
+ */
+off_t recordOffset(uint64_t lsn) {
+    return VOTE_LOG_HEADER_SIZE + lsn * sizeof(struct vote_record);
+}
+
+/**
+ * Passes the vote of every valid record from LSN from up to LSN to to replay
+ * Returns the LSN of the first record that is missing or not valid, or -1 if the log could not be read
+ */
+int64_t scanRecords(int fd, uint64_t from, uint64_t to, vote_replay replay, void *context) {
+    struct vote_record records[REPLAY_CHUNK];
+    uint64_t lsn = from;
+
+    while (lsn < to) {
+        size_t wanted = to - lsn < REPLAY_CHUNK ? to - lsn : REPLAY_CHUNK;
+        ssize_t n = pread(fd, records, wanted * sizeof(struct vote_record), recordOffset(lsn));
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        int count = n / sizeof(struct vote_record);
+
+        for (int i = 0; i < count; i++) {
+            //The log ends at the first record that is out of order or torn
+            if (records[i].lsn != lsn || records[i].check != recordCheck(lsn, records[i].candidate_id)) return lsn;
+
+            replay(records[i].candidate_id, context);
+            lsn++;
+        }
+        //A partial record can only be the torn end of the log
+        if (count < (int) wanted) break;
+    }
+    return lsn;
+}
+
+long openVoteLog(struct vote_log *log, const char *path, uint64_t start_lsn, int commit_delay, int group_size, vote_replay replay, void *context) {
+    char magic[VOTE_LOG_HEADER_SIZE];
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    memset(log, 0, sizeof(*log));
+
+    //A snapshot counts votes up to start_lsn, the log must still hold everything after them
+    if (start_lsn > 0 && st.st_size < recordOffset(start_lsn)) {
+        fprintf(stderr, "[ERROR]: %s ends before vote %lu of the snapshot!\n", path, (unsigned long) start_lsn);
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < VOTE_LOG_HEADER_SIZE) {
+        //A new log, or one that died before its header was synced
+        if (ftruncate(fd, 0) < 0 || writeFully(fd, VOTE_LOG_MAGIC, VOTE_LOG_HEADER_SIZE) < 0 || fdatasync(fd) < 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        syncDirectory(path);
+    } else {
+        if (read(fd, magic, VOTE_LOG_HEADER_SIZE) != VOTE_LOG_HEADER_SIZE || memcmp(magic, VOTE_LOG_MAGIC, VOTE_LOG_HEADER_SIZE) != 0) {
+            fprintf(stderr, "[ERROR]: %s is not a vote log!\n", path);
+            close(fd);
+            return -1;
+        }
+        int64_t end_lsn = scanRecords(fd, start_lsn, UINT64_MAX, replay, context);
+        if (end_lsn < 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        log->next_lsn = end_lsn;
+
+        //Cut off whatever was not fully written, new votes go straight after the last valid one
+        off_t end = recordOffset(log->next_lsn);
+        if (end < st.st_size) {
+            fprintf(stderr, "[WARNING]: %s: dropping %ld bytes after the last complete vote\n", path, (long) (st.st_size - end));
+            if (ftruncate(fd, end) < 0 || fdatasync(fd) < 0) {
+                perror(path);
+                close(fd);
+                return -1;
+            }
+        }
+    }
+    lseek(fd, 0, SEEK_END);
+
+    log->fd = fd;
+    log->durable_lsn = log->next_lsn;
+    log->commit_delay = commit_delay;
+    log->group_size = group_size > 0 ? group_size : 1;
+    log->pending_capacity = log->spare_capacity = log->group_size * 2;
+    log->pending = malloc(log->pending_capacity * sizeof(struct vote_record));
+    log->spare = malloc(log->spare_capacity * sizeof(struct vote_record));
+    if (log->pending == NULL || log->spare == NULL) {
+        fprintf(stderr, "[ERROR]: Not enough memory for the vote log!\n");
+        close(fd);
+        return -1;
+    }
+    //Commit delays are measured on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->committed, NULL);
+    pthread_cond_init(&log->filled, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return log->next_lsn - start_lsn;
+}
+
+uint64_t appendVote(struct vote_log *log, uint32_t candidate_id) {
+    return appendVotes(log, &candidate_id, 1);
+}
+
+uint64_t appendVotes(struct vote_log *log, const uint32_t *candidate_ids, int n) {
+    pthread_mutex_lock(&log->lock);
+
+    while (log->pending_count + n > log->pending_capacity) {
+        struct vote_record *grown = realloc(log->pending, log->pending_capacity * 2 * sizeof(struct vote_record));
+
+        if (grown == NULL) {
+            fprintf(stderr, "[ERROR]: Not enough memory for the vote log!\n");
+            exit(1);
+        }
+        log->pending = grown;
+        log->pending_capacity *= 2;
+    }
+    int was_pending = log->pending_count;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t lsn = log->next_lsn++;
+        struct vote_record *record = &log->pending[log->pending_count++];
+
+        record->lsn = lsn;
+        record->candidate_id = candidate_ids[i];
+        record->check = recordCheck(lsn, candidate_ids[i]);
+    }
+    //Wake a leader that is waiting for its group to fill up
+    if (was_pending < log->group_size && log->pending_count >= log->group_size) pthread_cond_signal(&log->filled);
+
+    uint64_t end = log->next_lsn;
+    pthread_mutex_unlock(&log->lock);
+    return end;
+}
+
+void commitVotes(struct vote_log *log, uint64_t lsn) {
+    pthread_mutex_lock(&log->lock);
+
+    while (log->durable_lsn < lsn) {
+        //Another thread is committing, its group may already hold these votes
+        if (log->committing) {
+            pthread_cond_wait(&log->committed, &log->lock);
+            continue;
+        }
+        log->committing = TRUE;
+
+        //Give other workers a chance to add their votes to the group
+        if (log->commit_delay > 0 && log->pending_count < log->group_size) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += (long) log->commit_delay * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+
+            while (log->pending_count < log->group_size &&
+                pthread_cond_timedwait(&log->filled, &log->lock, &deadline) == 0);
+        }
+        //Take every pending vote as the group, appends carry on into the spare buffer meanwhile
+        struct vote_record *group = log->pending;
+        int count = log->pending_count, capacity = log->pending_capacity;
+        uint64_t end = log->next_lsn;
+
+        log->pending = log->spare;
+        log->pending_capacity = log->spare_capacity;
+        log->pending_count = 0;
+        log->spare = group;
+        log->spare_capacity = capacity;
+
+        pthread_mutex_unlock(&log->lock);
+
+        //One write and one sync for the whole group
+        if (writeFully(log->fd, (const char *) group, count * sizeof(struct vote_record)) < 0 || fdatasync(log->fd) < 0) {
+            perror("[ERROR]: Could not write the vote log");
+            exit(1);
+        }
+        pthread_mutex_lock(&log->lock);
+        log->durable_lsn = end;
+        log->committing = FALSE;
+        pthread_cond_broadcast(&log->committed);
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+uint64_t durableVotes(struct vote_log *log) {
+    pthread_mutex_lock(&log->lock);
+    uint64_t lsn = log->durable_lsn;
+    pthread_mutex_unlock(&log->lock);
+
+    return lsn;
+}
+
+int readVotes(struct vote_log *log, uint64_t from, uint64_t to, vote_replay replay, void *context) {
+    //Durable records were checked when they were written, so anything short of to is an error
+    return scanRecords(log->fd, from, to, replay, context) == (int64_t) to ? 0 : -1;
+}
+
+int openSnapshot(const char *path, struct vote_snapshot *snapshot) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct snapshot_header)) {
+        fprintf(stderr, "[WARNING]: %s is too small to be a snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+    snapshot->size = st.st_size;
+    snapshot->image = mmap(NULL, snapshot->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (snapshot->image == MAP_FAILED) {
+        perror("mmap");
+        snapshot->image = NULL;
+        return -1;
+    }
+    const struct snapshot_header *header = (const struct snapshot_header *) snapshot->image;
+    size_t candidates_size = (size_t) header->candidate_count * sizeof(struct snapshot_candidate);
+
+    //Only look inside once the header says the file is complete
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 || header->version != SNAPSHOT_VERSION ||
+            header->byte_order != SNAPSHOT_BYTE_ORDER ||
+            sizeof(*header) + candidates_size + header->strings_size != snapshot->size) {
+        fprintf(stderr, "[WARNING]: %s is not a valid snapshot\n", path);
+        closeSnapshot(snapshot);
+        return -1;
+    }
+    snapshot->header = header;
+    snapshot->candidates = (const struct snapshot_candidate *) (snapshot->image + sizeof(*header));
+    snapshot->strings = snapshot->image + sizeof(*header) + candidates_size;
+
+    //Every string has to end inside the pool
+    for (uint32_t i = 0; i < header->candidate_count; i++) {
+        const struct snapshot_candidate *candidate = &snapshot->candidates[i];
+
+        if (candidate->name_offset >= header->strings_size ||
+                memchr(snapshot->strings + candidate->name_offset, '\0', header->strings_size - candidate->name_offset) == NULL) {
+            fprintf(stderr, "[WARNING]: %s is not a valid snapshot\n", path);
+            closeSnapshot(snapshot);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int writeSnapshot(const char *path, uint64_t lsn, uint32_t count, const uint32_t ids[], char *const names[], const long votes[]) {
+    struct snapshot_header header;
+    size_t strings_size = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        strings_size += strlen(names[i]) + 1;
+    }
+    size_t size = sizeof(header) + (size_t) count * sizeof(struct snapshot_candidate) + strings_size;
+    char *image = calloc(1, size);
+    if (image == NULL) return -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.lsn = lsn;
+    header.candidate_count = count;
+    header.strings_size = strings_size;
+    memcpy(image, &header, sizeof(header));
+
+    struct snapshot_candidate *candidates = (struct snapshot_candidate *) (image + sizeof(header));
+    char *strings = image + sizeof(header) + (size_t) count * sizeof(struct snapshot_candidate);
+    uint32_t used = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        candidates[i].id = ids[i];
+        candidates[i].name_offset = used;
+        strcpy(strings + used, names[i]);
+        used += strlen(names[i]) + 1;
+        candidates[i].votes = votes[i];
+    }
+    //Write a new file and rename it over the old one, so a crash leaves one snapshot or the other in full
+    char temp[4096];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int status = -1;
+
+    if (fd >= 0 && writeFully(fd, image, size) == 0 && fdatasync(fd) == 0) status = 0;
+    if (fd >= 0) close(fd);
+    free(image);
+
+    if (status < 0 || rename(temp, path) < 0) {
+        perror(temp);
+        unlink(temp);
+        return -1;
+    }
+    syncDirectory(path);
+
+    return 0;
+}
+
+void closeSnapshot(struct vote_snapshot *snapshot) {
+    if (snapshot->image) munmap(snapshot->image, snapshot->size);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
@@ -0,0 +1,162 @@
+#ifndef VOTE_LOG_H
+#define VOTE_LOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Write-ahead log of the votes accepted by the voting server
+ *
+ * Every accepted vote is appended to the log before it is acknowledged. Rather than one fsync per vote,
+ * votes are committed in groups: the first worker that needs its votes on disk becomes the leader, writes
+ * every vote appended so far (by any worker) and syncs them with a single fdatasync(), while the other
+ * workers wait for it. A leader can wait up to commit_delay microseconds for more votes to join its group,
+ * unless group_size votes are already waiting.
+ *
+ * On startup the log is replayed to rebuild the vote counts. A record that was only partly written when
+ * the server died fails its check and is cut off, along with anything after it.
+ *
+ * Snapshots hold every candidate and its vote count up to some LSN. They are built from the durable part
+ * of the log, never from the live counts, so taking one does not pause voting. A snapshot is mapped on
+ * startup and, since records have a fixed size, the log is replayed straight from the snapshot's LSN.
+ */
+
+#define VOTE_LOG_MAGIC "VOTELOG1"
+#define VOTE_LOG_HEADER_SIZE 8
+#define SNAPSHOT_MAGIC "VOTESNAP"
+#define SNAPSHOT_VERSION 2
+//Written in host byte order, so a snapshot from a machine with a different byte order is rejected
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+/**
+ * One vote as it is stored in the log
+ */
+struct vote_record {
+    //Position of the vote in the log, starting from 0
+    uint64_t lsn;
+    uint32_t candidate_id;
+    //Detects records that were torn or never written
+    uint32_t check;
+};
+
+struct vote_log {
+    int fd;
+    pthread_mutex_t lock;
+    //Signalled when a group has been committed
+    pthread_cond_t committed;
+    //Signalled when group_size votes are waiting
+    pthread_cond_t filled;
+    //Records appended but not yet handed to a leader
+    struct vote_record *pending;
+    int pending_count;
+    int pending_capacity;
+    //Spare buffer, swapped with pending by the leader
+    struct vote_record *spare;
+    int spare_capacity;
+    //Next LSN to hand out, every record below durable_lsn is on disk
+    uint64_t next_lsn;
+    uint64_t durable_lsn;
+    int committing;
+    int commit_delay;
+    int group_size;
+};
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    //Votes with an LSN below this one are counted
+    uint64_t lsn;
+    uint32_t candidate_count;
+    uint32_t strings_size;
+};
+
+/**
+ * A candidate of a snapshot, its name is a NUL terminated string in the string pool
+ */
+struct snapshot_candidate {
+    uint32_t id;
+    uint32_t name_offset;
+    int64_t votes;
+};
+
+/**
+ * A snapshot mapped from its file: the header, the candidates and then the string pool
+ */
+struct vote_snapshot {
+    char *image;
+    size_t size;
+    const struct snapshot_header *header;
+    const struct snapshot_candidate *candidates;
+    const char *strings;
+};
+
+/**
+ * Callback for every vote found in the log on startup
+ */
+typedef void (*vote_replay)(uint32_t candidate_id, void *context);
+
+/**
+ * Opens the log, creating it if needed, and replays every vote in it from start_lsn on
+ * Returns the number of votes replayed, or -1 if the log could not be opened
+ *
+ * @param log:          log to set up
+ * @param path:         file holding the log
+ * @param start_lsn:    first vote to replay, the earlier ones are already counted by a snapshot
+ * @param commit_delay: longest a leader waits for more votes to join its group, in microseconds
+ * @param group_size:   number of waiting votes that makes a leader commit straight away
+ * @param replay:       called for each vote in the log
+ * @param context:      passed to replay
+ */
+long openVoteLog(struct vote_log *log, const char *path, uint64_t start_lsn, int commit_delay, int group_size, vote_replay replay, void *context);
+
+/**
+ * Appends a vote to the log, it is not durable until commitVotes() returns for its LSN
+ * Returns the LSN to pass to commitVotes()
+ */
+uint64_t appendVote(struct vote_log *log, uint32_t candidate_id);
+
+/**
+ * Appends n votes to the log at once, taking the lock a single time
+ * Returns the LSN to pass to commitVotes() for all of them
+ */
+uint64_t appendVotes(struct vote_log *log, const uint32_t *candidate_ids, int n);
+
+/**
+ * Blocks until every vote appended with an LSN below lsn is on disk
+ * Exits the program if the log cannot be written, since votes could no longer be acknowledged
+ */
+void commitVotes(struct vote_log *log, uint64_t lsn);
+
+/**
+ * Returns the LSN below which every vote is on disk
+ */
+uint64_t durableVotes(struct vote_log *log);
+
+/**
+ * Reads the durable votes from LSN from up to LSN to and passes each of them to replay
+ * Returns -1 if the log could not be read
+ */
+int readVotes(struct vote_log *log, uint64_t from, uint64_t to, vote_replay replay, void *context);
+
+/**
+ * Maps a snapshot written by writeSnapshot()
+ * Returns -1 if there is no snapshot or it is damaged
+ */
+int openSnapshot(const char *path, struct vote_snapshot *snapshot);
+
+/**
+ * Writes a snapshot of count candidates, replacing the previous one only once the new one is on disk
+ * Returns -1 if the snapshot could not be written
+ *
+ * @param path:  file holding the snapshot
+ * @param lsn:   votes with an LSN below this one are counted
+ * @param ids:   id of each candidate
+ * @param names: name of each candidate
+ * @param votes: vote count of each candidate
+ */
+int writeSnapshot(const char *path, uint64_t lsn, uint32_t count, const uint32_t ids[], char *const names[], const long votes[]);
+
+void closeSnapshot(struct vote_snapshot *snapshot);
+
+#endif
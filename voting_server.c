@@ -6,6 +6,12 @@
 #include <signal.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <pthread.h>
+
+#include "datagram.h"
+#include "udp_loop.h"
+#include "vote_log.h"
+#include "candidates.h"
 
 #define TRUE 1
 #define FALSE 0
@@ -13,8 +19,26 @@
 #define MAX_BUFFER_SIZE 2048
 
 #define PORT 9046
-#define NUM_CANDIDATES 4
 #define ENCRYPT_KEY "9"
+//Largest number of worker threads
+#define MAX_WORKERS 64
+#define DEFAULT_CANDIDATES "candidates.tsv"
+//Candidates that can be added while the server runs
+#define DEFAULT_ROOM 65536
+//Candidates are only listed on startup if there are this many or fewer
+#define MAX_LISTED_CANDIDATES 20
+#define DEFAULT_VOTE_LOG "votes.wal"
+#define DEFAULT_SNAPSHOT "votes.snap"
+//Seconds between snapshots
+#define DEFAULT_SNAPSHOT_INTERVAL 10
+//Leaders shown when a request does not say how many
+#define DEFAULT_LEADERS 3
+//Longest line of the results, longer names are cut short
+#define MAX_ROW_SIZE 128
+//Votes waiting to be committed that make a group big enough to commit straight away
+#define DEFAULT_GROUP_SIZE 1024
+//Votes each worker remembers the candidate of, a power of 2
+#define RECENT_VOTES 65536
 
 /**
  * Check whether a function has returned an error code and exit the program if necessary
@@ -32,62 +56,549 @@ int check(int status, char *function_name, int can_exit) {
 }
 
 /**
- * Adds 1 to the vote count of a candidate based given their id
- */ 
-int addVote(int id, char *ids[NUM_CANDIDATES], int votes[NUM_CANDIDATES]) {
-    for (int i = 0; i < NUM_CANDIDATES; i++) {
-        //Found a matching id
-        if (atoi(ids[i]) == id)  {
-            votes[i]++;
-            return i;
+ * Vote counts of one worker, only ever written by that worker so votes need no locks
+ * Aligned to a cache line so workers never write to the same line
+ */
+struct vote_shard {
+    //Votes of each candidate, by index in the registry
+    long *votes;
+    //Candidate of each of the last RECENT_VOTES votes, so readers can find what changed without a full scan
+    uint32_t *recent;
+    //Number of votes added, so readers can tell the counts changed without reading them
+    unsigned long version;
+} __attribute__((aligned(64)));
+
+/**
+ * Gives a shard room for the votes of every candidate the registry can hold
+ * Returns -1 if there is not enough memory
+ */
+int allocShard(struct vote_shard *shard, uint32_t capacity) {
+    shard->votes = calloc(capacity, sizeof(long));
+    shard->recent = calloc(RECENT_VOTES, sizeof(uint32_t));
+
+    return shard->votes && shard->recent ? 0 : -1;
+}
+
+/**
+ * Adds votes to a candidate given their index
+ */
+void addVotes(int index, long count, struct vote_shard *shard) {
+    //The shard has a single writer, readers only need to see whole values
+    __atomic_store_n(&shard->votes[index], shard->votes[index] + count, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->recent[shard->version & (RECENT_VOTES - 1)], index, __ATOMIC_RELAXED);
+    //A reader that sees the new version also sees the new count
+    __atomic_store_n(&shard->version, shard->version + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Adds up the votes of a candidate over every shard
+ *
+ * @param shards:  vote counts of each worker
+ * @param workers: number of workers
+ * @param index:   index of the candidate
+ */
+long candidateVotes(struct vote_shard *shards, int workers, int index) {
+    long votes = 0;
+
+    for (int w = 0; w < workers; w++) {
+        votes += __atomic_load_n(&shards[w].votes[index], __ATOMIC_RELAXED);
+    }
+    return votes;
+}
+
+/**
+ * Appends a string to a response, cutting it short if the response is full
+ * Returns the new length of the response
+ */
+int appendText(char *dest, int length, const char *text, int text_length) {
+    if (text_length > MAX_DATAGRAM_PAYLOAD - length) text_length = MAX_DATAGRAM_PAYLOAD - length;
+    memcpy(dest + length, text, text_length);
+
+    return length + text_length;
+}
+
+/**
+ * Writes the candidate info (name and id) to a given string, as many candidates as fit in a response
+ * Returns the length of the string
+ *
+ * @param dest:     string of MAX_DATAGRAM_PAYLOAD bytes to hold the candidates
+ * @param registry: candidates to write
+ */
+int sprintCandidates(char *dest, const struct candidate_registry *registry) {
+    const char *heading = "ID\tName\n--\t----\n";
+    int length = appendText(dest, 0, heading, strlen(heading));
+    uint32_t count = candidateCount(registry);
+    char row[MAX_ROW_SIZE];
+
+    //Loop through the candidates, stopping at the first one that does not fit
+    for (uint32_t i = 0; i < count; i++) {
+        int row_length = snprintf(row, MAX_ROW_SIZE, "%u\t%s\n", registry->ids[i], registry->names[i]);
+
+        if (row_length >= MAX_ROW_SIZE || row_length > MAX_DATAGRAM_PAYLOAD - length) break;
+        length = appendText(dest, length, row, row_length);
+    }
+    return length;
+}
+
+/**
+ * Candidates and the vote counts of every worker, in the same order
+ * Every vote counted by a worker is already durable in the log, so results never show a vote a crash would lose
+ */
+struct ballot {
+    struct candidate_registry registry;
+    struct vote_shard shards[MAX_WORKERS];
+    int workers;
+    struct vote_log log;
+};
+
+/**
+ * Vote counts rebuilt from the log up to some LSN, used to replay the log and to take snapshots
+ */
+struct snapshotter {
+    struct ballot *ballot;
+    long *counts;
+    uint64_t lsn;
+    const char *path;
+    int interval;
+};
+
+/**
+ * Results as rendered by one worker, kept until a vote comes in
+ * Each worker has its own view, so serving results takes no locks
+ */
+struct results_view {
+    //Version of each shard the view is up to date with
+    unsigned long seen[MAX_WORKERS];
+    //Candidates in the view, with the votes of each as of the last refresh
+    uint32_t count;
+    long *votes;
+    //Candidates from the most to the fewest votes, and where each of them is in that order
+    uint32_t *order;
+    uint32_t *rank;
+    //The results response, which lists the first shown candidates
+    char text[MAX_DATAGRAM_PAYLOAD];
+    int length;
+    uint32_t shown;
+    int text_stale;
+    //The last leaderboard response, for the top leaders_k candidates
+    char leaders[MAX_DATAGRAM_PAYLOAD];
+    int leaders_length;
+    uint32_t leaders_k;
+    int leaders_stale;
+};
+
+/**
+ * Gives a view room for every candidate the registry can hold
+ * Returns -1 if there is not enough memory
+ */
+int allocView(struct results_view *view, uint32_t capacity) {
+    view->votes = malloc(capacity * sizeof(long));
+    view->order = malloc(capacity * sizeof(uint32_t));
+    view->rank = malloc(capacity * sizeof(uint32_t));
+    view->text_stale = TRUE;
+    view->leaders_stale = TRUE;
+
+    return view->votes && view->order && view->rank ? 0 : -1;
+}
+
+/**
+ * Returns the first rank at or above a given rank with as many votes as the candidate at that rank
+ * The leaderboard is sorted, so the candidates tied with it are all just above it
+ */
+uint32_t firstTiedRank(const struct results_view *view, uint32_t rank) {
+    long votes = view->votes[view->order[rank]];
+    uint32_t low = 0, high = rank;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+
+        if (view->votes[view->order[middle]] > votes) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Moves a candidate up the leaderboard past everyone with fewer votes than it now has
+ * Counts only ever go up, so a candidate never has to move down. Rather than stepping past each candidate
+ * it overtakes, it swaps places with the first of each group of tied candidates, so a candidate leaving a
+ * tie of millions at 0 votes moves in a single swap
+ *
+ * @param view:  leaderboard to update
+ * @param i:     index of the candidate
+ * @param votes: new vote count of the candidate
+ */
+void promoteCandidate(struct results_view *view, uint32_t i, long votes) {
+    uint32_t rank = view->rank[i];
+
+    while (rank > 0 && view->votes[view->order[rank - 1]] < votes) {
+        uint32_t first = firstTiedRank(view, rank - 1), other = view->order[first];
+
+        view->order[rank] = other;
+        view->rank[other] = rank;
+        rank = first;
+    }
+    view->order[rank] = i;
+    view->rank[i] = rank;
+    view->votes[i] = votes;
+}
+
+/**
+ * Brings the count of one candidate up to date, and marks the responses it appears in as stale
+ */
+void updateCandidate(struct results_view *view, struct ballot *ballot, uint32_t i) {
+    long votes = candidateVotes(ballot->shards, ballot->workers, i);
+
+    if (votes == view->votes[i]) return;
+
+    promoteCandidate(view, i, votes);
+
+    if (i < view->shown) view->text_stale = TRUE;
+    if (view->rank[i] < view->leaders_k) view->leaders_stale = TRUE;
+}
+
+/**
+ * Brings a view up to date with the vote counts
+ * Only the candidates voted for since the last refresh are looked at, unless so many votes came in that a
+ * shard no longer remembers them all
+ */
+void refreshView(struct results_view *view, struct ballot *ballot) {
+    unsigned long versions[MAX_WORKERS];
+    int rescan = FALSE;
+
+    //Read the versions first, every vote they include is for a candidate that is already counted
+    for (int w = 0; w < ballot->workers; w++) {
+        versions[w] = __atomic_load_n(&ballot->shards[w].version, __ATOMIC_ACQUIRE);
+    }
+    uint32_t count = candidateCount(&ballot->registry);
+
+    //New candidates join at the bottom of the leaderboard, and the results may have room to list them
+    for (; view->count < count; view->count++) {
+        view->votes[view->count] = -1;
+        view->order[view->count] = view->count;
+        view->rank[view->count] = view->count;
+        updateCandidate(view, ballot, view->count);
+        view->text_stale = TRUE;
+    }
+    for (int w = 0; w < ballot->workers; w++) {
+        struct vote_shard *shard = &ballot->shards[w];
+        unsigned long seen = view->seen[w];
+
+        if (versions[w] - seen > RECENT_VOTES) {
+            rescan = TRUE;
+        } else {
+            for (; seen != versions[w]; seen++) {
+                updateCandidate(view, ballot, __atomic_load_n(&shard->recent[seen & (RECENT_VOTES - 1)], __ATOMIC_RELAXED));
+            }
+            //The worker may have gone round the whole ring while it was being read
+            if (__atomic_load_n(&shard->version, __ATOMIC_ACQUIRE) - view->seen[w] > RECENT_VOTES) rescan = TRUE;
+        }
+        view->seen[w] = versions[w];
+    }
+    if (rescan) {
+        for (uint32_t i = 0; i < view->count; i++) {
+            updateCandidate(view, ballot, i);
+        }
+    }
+}
+
+/**
+ * Returns the results response of a view, only rendered again if a candidate it lists has new votes
+ * Results list as many candidates as fit in a response
+ */
+const char *renderResults(struct results_view *view, struct ballot *ballot, int *length) {
+    if (view->text_stale) {
+        const char *heading = "Votes\tID\tName\n-----\t--\t----\n";
+        char row[MAX_ROW_SIZE];
+
+        view->length = appendText(view->text, 0, heading, strlen(heading));
+        view->shown = 0;
+
+        for (uint32_t i = 0; i < view->count; i++) {
+            int row_length = snprintf(row, MAX_ROW_SIZE, "%ld\t%u\t%s\n", view->votes[i], ballot->registry.ids[i],
+                ballot->registry.names[i]);
+
+            if (row_length >= MAX_ROW_SIZE || row_length > MAX_DATAGRAM_PAYLOAD - view->length) break;
+            view->length = appendText(view->text, view->length, row, row_length);
+            view->shown++;
+        }
+        view->text_stale = FALSE;
+    }
+    *length = view->length;
+    return view->text;
+}
+
+/**
+ * Returns the k candidates with the most votes as a response, from the leaderboard of a view
+ * The response is kept, and only rendered again for another k or if one of the leaders has new votes
+ */
+const char *renderLeaders(struct results_view *view, struct ballot *ballot, uint32_t k, int *length) {
+    if (k > view->count) k = view->count;
+
+    if (view->leaders_stale || k != view->leaders_k) {
+        const char *heading = "Rank\tVotes\tID\tName\n----\t-----\t--\t----\n";
+        char row[MAX_ROW_SIZE];
+
+        view->leaders_length = appendText(view->leaders, 0, heading, strlen(heading));
+
+        for (uint32_t r = 0; r < k; r++) {
+            uint32_t i = view->order[r];
+            int row_length = snprintf(row, MAX_ROW_SIZE, "%u\t%ld\t%u\t%s\n", r + 1, view->votes[i],
+                ballot->registry.ids[i], ballot->registry.names[i]);
+
+            if (row_length >= MAX_ROW_SIZE || row_length > MAX_DATAGRAM_PAYLOAD - view->leaders_length) break;
+            view->leaders_length = appendText(view->leaders, view->leaders_length, row, row_length);
+        }
+        view->leaders_k = k;
+        view->leaders_stale = FALSE;
+    }
+    *length = view->leaders_length;
+    return view->leaders;
+}
+
+/**
+ * A thread serving requests with its own socket and its own shard of the vote counts
+ */
+struct worker {
+    struct ballot *ballot;
+    struct vote_shard *shard;
+    //Votes in the log up to this LSN must be durable before the current batch is answered
+    uint64_t commit_lsn;
+    //Votes of the current batch for each candidate, only added to the shard once they are durable,
+    //and the candidates that have some
+    long *uncommitted;
+    uint32_t *voted;
+    uint32_t voted_count;
+    struct results_view view;
+    struct udp_loop loop;
+    char name[16];
+    pthread_t thread;
+};
+
+/**
+ * Holds a vote of the current batch until commitBatch() has made it durable
+ */
+void holdVote(struct worker *worker, int i) {
+    if (worker->uncommitted[i]++ == 0) worker->voted[worker->voted_count++] = i;
+}
+
+/**
+ * Returns the largest candidate id a vote can be cast for
+ * Votes carry the id times the key as a signed 32 bit integer, so larger ids could never be voted for
+ */
+uint32_t maxCandidateId() {
+    return INT32_MAX / atoi(ENCRYPT_KEY);
+}
+
+/**
+ * Counts a batch of encrypted votes in one pass, every accepted vote goes to the log at once
+ * Returns the length of the summary: the number of votes accepted and rejected, and the position of each
+ * rejected vote in the batch
+ *
+ * @param worker:  worker counting the votes
+ * @param request: n encrypted candidate ids
+ * @param summary: buffer of MAX_DATAGRAM_PAYLOAD bytes for the summary
+ */
+int countBatch(struct worker *worker, const char *request, int n, char *summary) {
+    struct ballot *ballot = worker->ballot;
+    uint32_t ids[MAX_VOTE_BATCH];
+    int key = atoi(ENCRYPT_KEY), accepted = 0, rejected = 0;
+
+    for (int v = 0; v < n; v++) {
+        int id = (int32_t) getU32(request + v * VOTE_BATCH_ENTRY_SIZE) / key;
+        int i = id < 0 ? -1 : findCandidate(&ballot->registry, id);
+
+        if (i == -1) {
+            putU16(summary + VOTE_SUMMARY_SIZE + rejected++ * 2, v);
+            continue;
         }
+        holdVote(worker, i);
+        ids[accepted++] = id;
+    }
+    //The votes are only acknowledged once the log holds them, see commitBatch()
+    if (accepted > 0) worker->commit_lsn = appendVotes(&ballot->log, ids, accepted);
+
+    putU32(summary, accepted);
+    putU32(summary + 4, rejected);
+    return VOTE_SUMMARY_SIZE + rejected * 2;
+}
+
+/**
+ * Handles a request to the voting server and writes the response
+ * Returns the size of the response
+ */
+int handleRequest(const struct datagram_header *header, const char *request, char *response, void *context) {
+    struct worker *worker = context;
+    struct ballot *ballot = worker->ballot;
+    char *payload = response + DATAGRAM_HEADER_SIZE;
+    int status = DG_OK, length;
+
+    if (header->opcode == DG_KEY) {
+        //Indirection server has requested the encryption key
+        putU32(payload, atoi(ENCRYPT_KEY));
+        length = 4;
+    } else if (header->opcode == DG_CANDIDATES) {
+        //Show candidate info
+        length = sprintCandidates(payload, &ballot->registry);
+    } else if (header->opcode == DG_RESULTS) {
+        //Show voting results, totalled over every worker and only rendered again if a vote came in
+        refreshView(&worker->view, ballot);
+        const char *results = renderResults(&worker->view, ballot, &length);
+        memcpy(payload, results, length);
+    } else if (header->opcode == DG_LEADERS && (header->length == 0 || header->length == 4)) {
+        //Show the candidates with the most votes
+        uint32_t k = header->length == 4 ? getU32(request) : DEFAULT_LEADERS;
+
+        refreshView(&worker->view, ballot);
+        const char *leaders = renderLeaders(&worker->view, ballot, k, &length);
+        memcpy(payload, leaders, length);
+    } else if (header->opcode == DG_VOTE && header->length == 4) {
+        //Decrypt the id retrieved from indirection server
+        int id = (int32_t) getU32(request) / atoi(ENCRYPT_KEY);
+        int i = id < 0 ? -1 : findCandidate(&ballot->registry, id);
+
+        if (i == -1) {
+            //The id provided was invalid
+            status = DG_ERROR;
+            length = sprintf(payload, "Invalid candidate ID, please try again.");
+        } else {
+            //The vote is only counted and acknowledged once the log holds it, see commitBatch()
+            holdVote(worker, i);
+            worker->commit_lsn = appendVote(&ballot->log, id);
+            length = sprintf(payload, "Your vote for %s has been added!", ballot->registry.names[i]);
+        }
+    } else if (header->opcode == DG_VOTE_BATCH && header->length % VOTE_BATCH_ENTRY_SIZE == 0) {
+        //Count many votes at once, such as votes collected offline
+        length = countBatch(worker, request, header->length / VOTE_BATCH_ENTRY_SIZE, payload);
+    } else if (header->opcode == DG_ADD_CANDIDATE && header->length > 4 && header->length <= 4 + MAX_NAME_LENGTH) {
+        //The id is followed by the name
+        char name[MAX_NAME_LENGTH + 1];
+        uint32_t id = getU32(request);
+
+        memcpy(name, request + 4, header->length - 4);
+        name[header->length - 4] = '\0';
+
+        int added = id > maxCandidateId() ? CANDIDATE_INVALID : addCandidate(&ballot->registry, id, name, 0, TRUE);
+        if (added == CANDIDATE_ADDED) {
+            length = sprintf(payload, "%s has been added as candidate %u!", name, id);
+        } else {
+            status = DG_ERROR;
+            length = sprintf(payload, "%s", added == CANDIDATE_EXISTS ? "That candidate ID is already taken." :
+                added == CANDIDATE_FULL ? "No more candidates can be added." :
+                added == CANDIDATE_INVALID && id > maxCandidateId() ? "That candidate ID is too large." :
+                added == CANDIDATE_INVALID ? "Invalid candidate name, please try again." : "The candidate could not be saved.");
+        }
+    } else {
+        status = DG_ERROR;
+        length = sprintf(payload, "Invalid request, please try again.");
+    }
+    return writeResponseHeader(response, header, status, length);
+}
+
+/**
+ * Runs after a worker has handled a batch, holds back its responses until every vote in it is durable
+ * Votes of other workers waiting at the same time are committed in the same group
+ * The votes are only added to the worker's shard then, so results from any worker only count durable votes
+ */
+void commitBatch(void *context) {
+    struct worker *worker = context;
+
+    commitVotes(&worker->ballot->log, worker->commit_lsn);
+
+    for (uint32_t v = 0; v < worker->voted_count; v++) {
+        uint32_t i = worker->voted[v];
+
+        addVotes(i, worker->uncommitted[i], worker->shard);
+        worker->uncommitted[i] = 0;
+    }
+    worker->voted_count = 0;
+}
+
+/**
+ * Counts a vote read from the log
+ */
+void countLoggedVote(uint32_t id, void *context) {
+    struct snapshotter *snapshotter = context;
+    int i = findCandidate(&snapshotter->ballot->registry, id);
+
+    //Candidates are saved before anyone can vote for them, so this only happens if the file was edited
+    if (i == -1) {
+        fprintf(stderr, "[WARNING]: The vote log holds a vote for unknown candidate %u\n", id);
+        return;
     }
-    return -1;
+    snapshotter->counts[i]++;
 }
 
 /**
- * Writes the candidate info (name and id) to a given string
- * 
- * @param dest:       string to hold the results
- * @param candidates: list of candidate names
- * @param ids:        list of candidate ids
+ * Snapshot thread, every interval seconds counts the votes made durable since the last snapshot and writes
+ * a new one
+ * Only reads the log, so workers never wait for a snapshot
  */
-void sprintCandidates(char *dest, char *candidates[NUM_CANDIDATES], char *ids[NUM_CANDIDATES]) {
-    strcpy(dest, "ID\tName\n--\t----\n");
+void *takeSnapshots(void *arg) {
+    struct snapshotter *snapshotter = arg;
+    struct ballot *ballot = snapshotter->ballot;
 
-    //Loop through all candidates, writing the info for each into dest
-    for (int i = 0; i < NUM_CANDIDATES; i++) {
-        strcat(dest, ids[i]);
-        strcat(dest, "\t");
-        strcat(dest, candidates[i]);
-        strcat(dest, "\n");
+    while (TRUE) {
+        sleep(snapshotter->interval);
+
+        uint64_t lsn = durableVotes(&ballot->log);
+        if (lsn == snapshotter->lsn) continue;
+
+        if (readVotes(&ballot->log, snapshotter->lsn, lsn, countLoggedVote, snapshotter) < 0) {
+            fprintf(stderr, "[ERROR]: Could not read the vote log, no more snapshots will be taken!\n");
+            return NULL;
+        }
+        snapshotter->lsn = lsn;
+
+        //Candidates added since the last snapshot start with no votes, their counts are already 0
+        if (writeSnapshot(snapshotter->path, lsn, candidateCount(&ballot->registry), ballot->registry.ids,
+                ballot->registry.names, snapshotter->counts) < 0) {
+            fprintf(stderr, "[ERROR]: Could not write the snapshot!\n");
+        }
     }
+    return NULL;
 }
 
 /**
- * Writes the voting results to a given string
- * 
- * @param dest:       string to hold the results
- * @param candidates: list of candidate names
- * @param ids:        list of candidate ids
- * @param votes:      list of candidate vote counts
+ * Restores the vote counts from a snapshot, candidates that are no longer in the candidates file are added back
+ * Returns -1 if there is no usable snapshot, leaving the counts as they are
  */
-void sprintResults(char *dest, char *candidates[NUM_CANDIDATES], char *ids[NUM_CANDIDATES], int votes[NUM_CANDIDATES]) {
-    strcpy(dest, "Votes\tID\tName\n-----\t--\t----\n");
+int loadSnapshot(const char *path, struct ballot *ballot, struct snapshotter *snapshotter) {
+    struct vote_snapshot snapshot;
+
+    if (openSnapshot(path, &snapshot) < 0) return -1;
 
-    char buffer[10];
-    memset(&buffer, 0, 10);
+    for (uint32_t c = 0; c < snapshot.header->candidate_count; c++) {
+        const struct snapshot_candidate *candidate = &snapshot.candidates[c];
+        int i = findCandidate(&ballot->registry, candidate->id);
 
-    //Loop through all candidates, writing the info for each into dest
-    for (int i = 0; i < NUM_CANDIDATES; i++) {
-        sprintf(buffer, "%d", votes[i]);
-        strcat(dest, buffer);
-        strcat(dest, "\t");
-        strcat(dest, ids[i]);
-        strcat(dest, "\t");
-        strcat(dest, candidates[i]);
-        strcat(dest, "\n");
+        if (i == -1 && addCandidate(&ballot->registry, candidate->id, snapshot.strings + candidate->name_offset, 0, FALSE) == CANDIDATE_ADDED) {
+            i = findCandidate(&ballot->registry, candidate->id);
+        }
+        if (i == -1) {
+            fprintf(stderr, "[WARNING]: Could not restore candidate %u from %s\n", candidate->id, path);
+            continue;
+        }
+        //The snapshot already counts the starting votes
+        snapshotter->counts[i] = candidate->votes;
     }
+    snapshotter->lsn = snapshot.header->lsn;
+    closeSnapshot(&snapshot);
+
+    return 0;
+}
+
+/**
+ * Worker thread, serves requests on the worker's socket until the program is killed
+ */
+void *runWorker(void *arg) {
+    struct worker *worker = arg;
+
+    runUdpLoop(&worker->loop);
+    return NULL;
 }
 
 /**
@@ -114,72 +625,161 @@ int initServer(int server_port) {
     check((server_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)), "socket", TRUE);
     //Allow address to be reused
     check(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)), "setsockopt", TRUE);
+    //Every worker binds its own socket to the port, and the kernel spreads senders across them
+    check(setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)), "setsockopt", TRUE);
     check(bind(server_fd, (struct sockaddr*) &server, sizeof(server)), "bind", TRUE);
 
     return server_fd;
 }
 
-int main() {
-	int server_fd = initServer(PORT);
+/**
+ * Prints the correct usage of the program and exits
+ */
+void usageError(const char *program) {
+    fprintf(stderr, "Usage: %s [-w workers] [-n batch] [-m mmsg|uring] [-c candidates] [-a room] [-l log] [-d commit delay usec] [-g group size]"
+        " [-s snapshot] [-i snapshot interval] [-x ring]\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    //Important microservice info, the starting vote counts go in the first shard
+    static struct ballot ballot;
+    static struct worker workers[MAX_WORKERS];
+    static struct snapshotter snapshotter = {&ballot, NULL, 0, DEFAULT_SNAPSHOT, DEFAULT_SNAPSHOT_INTERVAL};
+    const char *candidates_path = DEFAULT_CANDIDATES;
+    long room = DEFAULT_ROOM;
+    int batch = DEFAULT_UDP_BATCH, backend = BACKEND_URING;
+    const char *log_path = DEFAULT_VOTE_LOG;
+    int commit_delay = 0, group_size = DEFAULT_GROUP_SIZE;
+    const char *ring = NULL;
+    int opt;
+
+    //One worker per core by default
+    ballot.workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "w:n:m:c:a:l:d:g:s:i:x:")) != -1) {
+        if (opt == 'w' && atoi(optarg) > 0) {
+            ballot.workers = atoi(optarg);
+        } else if (opt == 'n' && atoi(optarg) > 0) {
+            batch = atoi(optarg);
+        } else if (opt == 'm' && parseBackend(optarg) >= 0) {
+            backend = parseBackend(optarg);
+        } else if (opt == 'c') {
+            candidates_path = optarg;
+        } else if (opt == 'a' && atol(optarg) >= 0 && atol(optarg) < UINT32_MAX / 4) {
+            room = atol(optarg);
+        } else if (opt == 'l') {
+            log_path = optarg;
+        } else if (opt == 'd' && atoi(optarg) >= 0) {
+            commit_delay = atoi(optarg);
+        } else if (opt == 'g' && atoi(optarg) > 0) {
+            group_size = atoi(optarg);
+        } else if (opt == 's') {
+            snapshotter.path = optarg;
+        } else if (opt == 'i' && atoi(optarg) >= 0) {
+            snapshotter.interval = atoi(optarg);
+        } else if (opt == 'x') {
+            ring = optarg;
+        } else {
+            usageError(argv[0]);
+        }
+    }
+    if (ballot.workers < 1) ballot.workers = 1;
+    //The ring is served by a worker of its own, with its own shard like the others
+    if (ring != NULL) ballot.workers++;
+    if (ballot.workers > MAX_WORKERS) ballot.workers = MAX_WORKERS;
+
+    if (loadCandidates(candidates_path, room, &ballot.registry) < 0) {
+        fprintf(stderr, "[ERROR]: Could not load the candidates!\n");
+        exit(1);
+    }
+    uint32_t capacity = ballot.registry.capacity;
 
-    //Important microservice info
-    char *candidates[NUM_CANDIDATES] = {"Dennis Ritchie", "Linus Torvalds", "Bill Gates", "Gordon Moore"};
-    char *ids[NUM_CANDIDATES] = {"101", "202", "303", "404"};
-    int votes[NUM_CANDIDATES] = {89, 62, 70, 50};
+    for (int w = 0; w < ballot.workers; w++) {
+        workers[w].uncommitted = calloc(capacity, sizeof(long));
+        workers[w].voted = malloc(capacity * sizeof(uint32_t));
 
-    //String for holding incoming/outgoing network data
+        if (allocShard(&ballot.shards[w], capacity) < 0 || allocView(&workers[w].view, capacity) < 0 ||
+                workers[w].uncommitted == NULL || workers[w].voted == NULL) {
+            fprintf(stderr, "[ERROR]: Not enough memory for the vote counts!\n");
+            exit(1);
+        }
+    }
+    snapshotter.counts = calloc(capacity, sizeof(long));
+    if (snapshotter.counts == NULL) {
+        fprintf(stderr, "[ERROR]: Not enough memory for the vote counts!\n");
+        exit(1);
+    }
+    //Start from the last snapshot, or from the starting counts if there is none
+    memcpy(snapshotter.counts, ballot.registry.seeds, candidateCount(&ballot.registry) * sizeof(long));
+    int snapshot_loaded = loadSnapshot(snapshotter.path, &ballot, &snapshotter) == 0;
+    uint64_t snapshot_lsn = snapshotter.lsn;
+
+    //Then recount the votes that were acknowledged after it
+    long replayed = openVoteLog(&ballot.log, log_path, snapshot_lsn, commit_delay, group_size, countLoggedVote, &snapshotter);
+    if (replayed < 0) {
+        fprintf(stderr, "[ERROR]: Could not open the vote log!\n");
+        exit(1);
+    }
+    snapshotter.lsn += replayed;
+    memcpy(ballot.shards[0].votes, snapshotter.counts, candidateCount(&ballot.registry) * sizeof(long));
+
+    pthread_t snapshot_thread;
+    if (snapshotter.interval > 0) {
+        if (pthread_create(&snapshot_thread, NULL, takeSnapshots, &snapshotter) != 0) {
+            fprintf(stderr, "[ERROR]: Could not start the snapshot thread!\n");
+            exit(1);
+        }
+        pthread_detach(snapshot_thread);
+    }
+
+    //String for printing the candidates
     char buffer[MAX_BUFFER_SIZE];
     memset(buffer, 0, MAX_BUFFER_SIZE);
 
-    //Print info about the microservice
-    sprintCandidates(buffer, candidates, ids);
-    printf("%s\n", buffer);
+    //Print info about the microservice, a long list of candidates is only counted
+    if (candidateCount(&ballot.registry) <= MAX_LISTED_CANDIDATES) {
+        sprintCandidates(buffer, &ballot.registry);
+        printf("%s\n", buffer);
+    }
+    printf("Loaded %u candidates from %s\n", candidateCount(&ballot.registry), candidates_path);
+    for (uint32_t i = 0; i < candidateCount(&ballot.registry); i++) {
+        if (ballot.registry.ids[i] > maxCandidateId()) {
+            fprintf(stderr, "[WARNING]: Candidate %u cannot be voted for, ids go up to %u\n", ballot.registry.ids[i], maxCandidateId());
+        }
+    }
+    if (snapshot_loaded) printf("Loaded %s up to vote %lu\n", snapshotter.path, (unsigned long) snapshot_lsn);
+    printf("Replayed %ld votes from %s\n", replayed, log_path);
+    printf("Serving votes with %d workers\n", ballot.workers);
 
-    //Placeholder info for communicating with indirection server
-    struct sockaddr_in server;
+    for (int w = 0; w < ballot.workers; w++) {
+        struct worker *worker = &workers[w];
 
-    int sock_len = sizeof(struct sockaddr_in);
-    int done = FALSE;
-    int bytes;
-
-	while (!done) {
-        memset(buffer, 0, MAX_BUFFER_SIZE);
-
-        if (bytes = recvfrom(server_fd, buffer, MAX_BUFFER_SIZE, 0, (struct sockaddr *) &server, &sock_len) > 0) {
-            if (strcmp(buffer, "key_req") == 0) {
-                //Indirection server has requested the encryption key
-                memset(buffer, 0, MAX_BUFFER_SIZE);
-                strcpy(buffer, ENCRYPT_KEY);
-            } else {
-                //Get the input choice entered by the client
-                int input = atoi(buffer);
-                memset(buffer, 0, MAX_BUFFER_SIZE);
-
-                if (input == 3) {
-                    //Show candidate info
-                    sprintCandidates(buffer, candidates, ids);
-                } else if (input == 5) {
-                    //Show voting results
-                    sprintResults(buffer, candidates, ids, votes);
-                } else {
-                    //Unknown number received... we will assume it is an encrypted id!
-                    //Decrypt the id retrieved from indirection server
-                    int id = input / atoi(ENCRYPT_KEY), i;
-
-                    //Add 1 to the vote count of the corresponding candidate
-                    if ((i = addVote(id, ids, votes)) == -1) {
-                        //The id provided was invalid
-                        strcpy(buffer, "Invalid candidate ID, please try again.");
-                    } else {
-                        sprintf(buffer, "Your vote for %s has been added!", candidates[i]);
-                    }
-                }
-            }
-            //Send result message back to indirection server
-            sendto(server_fd, buffer, sizeof(buffer), 0, (struct sockaddr *) &server, sock_len);
+        worker->ballot = &ballot;
+        worker->shard = &ballot.shards[w];
+        sprintf(worker->name, "voting %d", w);
+
+        struct udp_loop loop = {.name = worker->name, .fd = -1, .batch = batch, .backend = backend, .handler = handleRequest,
+            .context = worker, .before_reply = commitBatch};
+
+        if (ring != NULL && w == ballot.workers - 1) {
+            sprintf(worker->name, "voting ring");
+            loop.ring = ring;
+        } else {
+            loop.fd = initServer(PORT);
         }
-	}
-	close(server_fd);
+        worker->loop = loop;
+
+        if (pthread_create(&worker->thread, NULL, runWorker, worker) != 0) {
+            fprintf(stderr, "[ERROR]: Could not start worker %d!\n", w);
+            exit(1);
+        }
+    }
+    //Workers serve requests until the program is killed
+    for (int w = 0; w < ballot.workers; w++) {
+        pthread_join(workers[w].thread, NULL);
+        if (workers[w].loop.fd >= 0) close(workers[w].loop.fd);
+    }
 	
 	return 0;
 }